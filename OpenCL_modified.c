@@ -18,12 +18,23 @@ VERSION 20.0 - relax physic correctness check
 // prev and OpenMP:   gcc -o parallel parallel.c -std=c99 -lglut -lGL -lm -O2 -ftree-vectorize -fopt-info-vec -ffast-math -fopenmp
 // prev and OpenCL:   gcc -o parallel parallel.c -std=c99 -lglut -lGL -lm -O2 -ftree-vectorize -fopt-info-vec -ffast-math -fopenmp -lOpenCL
 
+// headless (no GLUT, no X display): gcc -o OpenCL_modified OpenCL_modified.c -std=c99 -lm -O2 -pthread -lOpenCL -DHEADLESS
+// The physics runs on the thread pool of taskpool.h, so every build also needs -pthread.
+// Both builds take [seed] [--satellites N] [--width N] [--height N] [--substeps N],
+// headless builds also [--frames N].
+
 // Example compilation on macos X
 // no optimization:   gcc -o parallel parallel.c -std=c99 -framework GLUT -framework OpenGL
 // most optimization: gcc -o parallel parallel.c -std=c99 -framework GLUT -framework OpenGL -O3
 
 
 
+// clock_gettime for the frame timings, CPU affinity for the thread pool
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #endif
@@ -33,6 +44,7 @@ VERSION 20.0 - relax physic correctness check
 #include <string.h>
 
 // Window handling includes
+#ifndef HEADLESS
 #ifndef __APPLE__
 #include <GL/gl.h>
 #include <GL/glut.h>
@@ -40,61 +52,58 @@ VERSION 20.0 - relax physic correctness check
 #include <OpenGL/gl.h>
 #include <GLUT/glut.h>
 #endif
+#endif
+
+#include "frametiming.h"
+#include "satellitegrid.h"
+#include "taskpool.h"
+#include "chrometrace.h"
+#include "pixelformat.h"
+#include "verifyreport.h"
+#include "benchreport.h"
+#include "framerecorder.h"
+#include "tilereuse.h"
 
 // OpenCL includes
 #include <CL/cl.h>
 
-// These are used to decide the window size
-#define WINDOW_HEIGHT 1024
-#define WINDOW_WIDTH  1024
+// These are used to decide the window size.
+// They can be changed at runtime with --width and --height.
+#define DEFAULT_WINDOW_HEIGHT 1024
+#define DEFAULT_WINDOW_WIDTH  1024
+int windowHeight = DEFAULT_WINDOW_HEIGHT;
+int windowWidth = DEFAULT_WINDOW_WIDTH;
+#define WINDOW_HEIGHT windowHeight
+#define WINDOW_WIDTH  windowWidth
+// SIZE as an unsigned count, for loops with an unsigned index
+#define PIXEL_COUNT ((unsigned int)WINDOW_WIDTH * (unsigned int)WINDOW_HEIGHT)
 
 // The number of satellites can be changed to see how it affects performance.
 // Benchmarks must be run with the original number of satellites
-#define SATELLITE_COUNT 64
+#define DEFAULT_SATELLITE_COUNT 64
+int satelliteCount = DEFAULT_SATELLITE_COUNT;
+#define SATELLITE_COUNT satelliteCount
 
-// These are used to control the satellite movement
-#define SATELLITE_RADIUS 3.16f
-#define MAX_VELOCITY 0.1f
-#define GRAVITY 1.0f
-#define DELTATIME 32
-#define PHYSICSUPDATESPERFRAME 100000
+// The satellite movement is controlled by the constants in satellitetypes.h
+#define DEFAULT_PHYSICSUPDATESPERFRAME 100000
+int physicsUpdatesPerFrame = DEFAULT_PHYSICSUPDATESPERFRAME;
+#define PHYSICSUPDATESPERFRAME physicsUpdatesPerFrame
 
-// Some helpers to window size variables
-#define SIZE WINDOW_WIDTH*WINDOW_HEIGHT
-#define HORIZONTAL_CENTER (WINDOW_WIDTH / 2)
-#define VERTICAL_CENTER (WINDOW_HEIGHT / 2)
+// Satellite types and constants shared with the kernels, which also holds
+// the helpers to window size variables
+#include "satellitetypes.h"
 
 // Is used to find out frame times
-int previousFinishTime = 0;
+long long previousFinishTime = 0;
 unsigned int frameNumber = 0;
 unsigned int seed = 0;
 
-// Stores 2D data like the coordinates
-typedef struct{
-   float x;
-   float y;
-} floatvector;
-
 // Stores 2D data like the coordinates
 typedef struct{
    double x;
    double y;
 } doublevector;
 
-// Stores rendered colors. Each float may vary from 0.0f ... 1.0f
-typedef struct{
-   float red;
-   float green;
-   float blue;
-} color;
-
-// Stores the satellite data, which fly around black hole in the space
-typedef struct{
-   color identifier;
-   floatvector position;
-   floatvector velocity;
-} satellite;
-
 // Pixel buffer which is rendered to the screen
 color* pixels;
 
@@ -109,19 +118,218 @@ satellite* backupSatelites;
 
 // ## You may add your own variables here ##
 #define PROGRAM_FILE "parallelOpenCL.cl"
+#define SHARED_HEADER_FILE "satellitetypes.h"
 #define KERNEL_FUNC "parallelOpenCL"
+#define PHYSICS_KERNEL_FUNC "parallelPhysicsOpenCL"
 #define MAX_SOURCE_SIZE (0x100000)
+#define LOCAL_WORK_SIZE 16
 
 /*OpenCL data structures*/
 cl_device_id device;
 cl_context context; // Context object
 cl_command_queue queue; // Command queue to assiciate with the device
+cl_command_queue readQueue; // Command queue for the pixel readbacks
 cl_program program; // Program object
 cl_kernel kernel; // Kernel object
 cl_int status;
-cl_mem satelliteDataBuffer; // memory object to hold satellite for the kernel
+
+// Frames alternate between two slots of device buffers, host copies and
+// events, so that frame N + 1 can be uploaded and rendered while frame N
+// is still read back.
+#define RENDER_SLOTS 2
+cl_mem satelliteDataBuffer[RENDER_SLOTS]; // memory object to hold satellite for the kernel
 cl_mem pixelDataBuffer; // memory object to hold pixel data from the kernel
-cl_mem pixelOut;
+cl_mem pixelOut[RENDER_SLOTS];
+
+// Satellite grid for the hit test and the nearest satellite in the kernel,
+// built on the host and copied to the device every frame
+satelliteGrid renderGrid[RENDER_SLOTS];
+cl_mem cellStartBuffer[RENDER_SLOTS];
+cl_mem cellSatelliteBuffer[RENDER_SLOTS];
+
+// Host copies of the uploaded satellites and of the read back pixels.
+// pixels points to the host pixels of the frame shown.
+satellite* stagedSatellites[RENDER_SLOTS];
+color* hostPixels[RENDER_SLOTS];
+color* fixedPixels;
+
+// When the device works in host memory (CPU devices, integrated GPUs) the
+// pixel buffers are allocated by the runtime in host memory and mapped
+// instead of read back, so the kernel writes straight into the pixels that
+// are shown. -1 decides by the device, --zero-copy and --copy-pixels force
+// either path. Falls back to copying if the buffers cannot be mapped.
+int zeroCopyPixels = -1;
+int pixelsMapped[RENDER_SLOTS];
+cl_event kernelDone[RENDER_SLOTS];
+cl_event readDone[RENDER_SLOTS];
+unsigned int renderedFrames = 0;
+
+// With --async the frame rendered last is shown only after the next one
+// has been started, which hides the readback behind the next frame's
+// physics. Time the host spent waiting for readbacks, in nanoseconds.
+int asyncFrames = 0;
+long long readbackWaitTime = 0;
+
+// Number of frames --verify checks, 0 for the normal frame loop. The
+// verification reads the device satellites back every frame and shows
+// every frame as soon as it is rendered.
+int verifyFrames = 0;
+
+// --bench N times each engine and kernel N times after benchWarmup runs,
+// see benchreport.h. The kernels are timed by the device through profiled
+// queues.
+int benchRuns = 0;
+int benchWarmup = BENCH_DEFAULT_WARMUP;
+int benchFormat = BENCH_CSV;
+const char* benchOutput = NULL;
+const char* benchLabel = NULL;
+
+// With --pixel-format rgba8 or half the kernel packs the pixels, see
+// pixelformat.h, and a third or two thirds of the bytes are read back into
+// packedPixels. The checked frames still read back float colors for
+// errorCheck(). They render the packed format a second time as well, which
+// checkPackedPixels() compares with the sequential reference when the next
+// frame starts. Packed output is read back, never mapped.
+int pixelFormat = PIXEL_FLOAT;
+unsigned char* packedPixels[RENDER_SLOTS];
+int slotPacked[RENDER_SLOTS];
+int packedCheckSlot = -1;
+
+// With --incremental T the kernel skips the tiles of tileSize pixels
+// (--tile) that are estimated to have changed by less than T, see
+// tilereuse.h, so they keep what the slot's pixel buffer holds. That is the
+// image of two frames ago, so the records are per slot: slotTileFrame is
+// the frame each tile of the slot was last shaded in and slotTileSamples
+// its blend then. tileStableFrom is the frame since which a tile has kept
+// its hits and nearest satellite, so a tile is only kept if that held from
+// the frame the slot shaded it in. keptTiles is the mask of the slot's
+// frame, uploaded to keptTileBuffer. slotContentFormat is the pixel format
+// the slot's buffer holds. The checked frames, every refreshFrames-th
+// frame (--refresh) and a change of format shade every tile. The tests
+// need the host satellites of every frame, so the physics stays on the host.
+#define DEFAULT_REFRESH_FRAMES 30
+#define DEFAULT_TILE_SIZE 32
+float incrementalThreshold = 0.f;
+int refreshFrames = DEFAULT_REFRESH_FRAMES;
+int tileSize = DEFAULT_TILE_SIZE;
+int tileColumns;
+int tileRows;
+unsigned int* tileStableFrom;
+unsigned int* slotTileFrame[RENDER_SLOTS];
+float* slotTileSamples[RENDER_SLOTS];
+int slotContentFormat[RENDER_SLOTS];
+unsigned char* keptTiles[RENDER_SLOTS];
+cl_mem keptTileBuffer[RENDER_SLOTS];
+satellite* previousSatellites;
+int havePreviousSatellites = 0;
+long long tilesKept = 0;
+long long tilesDecided = 0;
+
+// With double precision on the device the satellites live in device memory
+// (deviceSatellites) and the physics runs there, so a frame transfers
+// nothing but the image. The grid is built on the host, so the shading
+// kernel gets a grid of one cell holding every satellite instead. The host
+// satellites are only read back for the checked frames. -1 decides by the
+// device, --host-physics and --incremental keep the physics on the host.
+int devicePhysics = -1;
+cl_kernel physicsKernel;
+cl_mem deviceSatellites;
+satelliteGrid wholeGrid;
+cl_mem wholeCellStart;
+cl_mem wholeCellSatellites;
+
+// Work group shape of the shading kernel. It is tuned on the first frame
+// by timing a few candidate shapes, and the winner is cached in
+// tuneCacheFile for the device and the sizes, so later runs skip the tuning.
+// --retune ignores the cache, --tune-cache FILE moves it.
+size_t workGroupShape[2] = { LOCAL_WORK_SIZE, LOCAL_WORK_SIZE };
+int workGroupTuned = 0;
+int retuneWorkGroup = 0;
+const char* tuneCacheFile = "parallelOpenCL.tune";
+char tuneKey[256];
+
+// Built program binaries are cached in this directory, see build_program.
+// --program-cache DIR moves them, --no-program-cache always compiles.
+const char* binaryCacheDirectory = ".";
+int useBinaryCache = 1;
+
+// With --split-devices every OpenCL device of every platform renders a
+// band of rows, and the host threads render one more band unless
+// --split-no-host is given. The bands follow the throughput measured in
+// the previous frame: device times come from the profiling events, from
+// the start of the upload to the end of the readback. Split rendering
+// uses the host physics and copies the pixels back synchronously.
+typedef struct{
+	cl_device_id device; // NULL for the host threads
+	char name[64];
+	cl_context context;
+	cl_command_queue queue;
+	cl_program program;
+	cl_kernel kernel;
+	cl_mem satellites;
+	cl_mem cellStart;
+	cl_mem cellSatellites;
+	cl_mem pixels;
+	size_t shape[2];
+	cl_event uploaded;
+	cl_event readBack;
+
+	// Rows rowBegin .. rowEnd - 1 of this frame, the fraction of the rows
+	// for the next one and the statistics for the report
+	int rowBegin;
+	int rowEnd;
+	double share;
+	long long time;
+	double speed;
+	double shareSum;
+	long long timeSum;
+} splitRenderer;
+int splitRendering = 0;
+int splitHost = 1;
+splitRenderer* splitRenderers;
+int splitRendererCount = 0;
+char programOptions[512];
+
+// With --trace FILE the queues are created with CL_QUEUE_PROFILING_ENABLE
+// and every write, kernel and read of a frame is recorded, next to the host
+// spans of the physics and the rendering, as a Chrome trace (chrometrace.h).
+// A command is placed on the host clock by taking the host time of its
+// enqueue as its QUEUED time. The commands of a frame are written once the
+// frame's pixels have been waited for, so that all of them are done.
+typedef struct{
+	cl_event event;
+	const char* name;
+	int track;
+	unsigned int frame;
+	long long enqueued;
+} traceCommandRecord;
+enum { TRACK_PHYSICS = 1, TRACK_RENDER, TRACK_QUEUE, TRACK_READ_QUEUE, TRACK_SPLIT = 10 };
+const char* traceFileName = NULL;
+chromeTrace trace;
+
+// --record FILE streams every shown frame to FILE ("-" for stdout) on a
+// background thread, see framerecorder.h. --record-format, --record-slots
+// and --record-lossless work as in parallel.c.
+const char* recordPath = NULL;
+int recordContainer = RECORD_RGB8;
+int recordSlots = RECORD_DEFAULT_SLOTS;
+int recordLossless = 0;
+frameRecorder recorder;
+// The first asynchronous frame shows the last checked one again
+long long lastRecordedFrame = -1;
+traceCommandRecord* traceCommands;
+int traceCommandCount = 0;
+int traceCommandCapacity = 0;
+
+// Event argument of a command that is only needed for the trace
+#define TRACE_EVENT(event) (trace.file ? (event) : NULL)
+
+// Persistent worker threads of the physics engine, see taskpool.h. --threads
+// sets their number (default: every CPU the process may use) and --no-pin
+// leaves them unpinned.
+taskPool enginePool;
+int engineThreads = 0;
+int pinThreads = 1;
 
 
 
@@ -169,40 +377,326 @@ cl_device_id create_device() {
 }
 
 
-/* Create program from a file and compile it */
-cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename) {
+/* True if the device works in host memory, so that mapping a buffer needs
+   no copy */
+int deviceSharesHostMemory(cl_device_id dev) {
+	cl_device_type type = 0;
+	cl_bool unified = CL_FALSE;
+	clGetDeviceInfo(dev, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, NULL);
+	return (type & CL_DEVICE_TYPE_CPU) || unified;
+}
 
-	cl_program program;
-	FILE* program_handle;
-	char* program_buffer, * program_log;
-	size_t program_size, log_size;
-	int status;
+/* True if the device supports double precision */
+int deviceHasDoubles(cl_device_id dev) {
+	cl_bitfield config = 0;
+	clGetDeviceInfo(dev, CL_DEVICE_DOUBLE_FP_CONFIG, sizeof(config), &config, NULL);
+	return config != 0;
+}
+
+/* Records a command of the current frame for the trace and takes over its
+   event. Events that are also used elsewhere must be retained first. */
+void traceCommand(cl_event event, const char* name, int track) {
+	if (!event)
+	{
+		return;
+	}
+	if (traceCommandCount == traceCommandCapacity)
+	{
+		int capacity = traceCommandCapacity ? traceCommandCapacity * 2 : 64;
+		traceCommandRecord* grown = (traceCommandRecord*)realloc(traceCommands,
+			sizeof(traceCommandRecord) * capacity);
+		if (!grown)
+		{
+			printf("Cannot allocate the trace\n");
+			exit(1);
+		}
+		traceCommands = grown;
+		traceCommandCapacity = capacity;
+	}
+	traceCommandRecord* record = &traceCommands[traceCommandCount++];
+	record->event = event;
+	record->name = name;
+	record->track = track;
+	record->frame = renderedFrames;
+	record->enqueued = nowNanoseconds();
+}
 
-	/* Read program file and place content into buffer */
-	program_handle = fopen(filename, "rb");
+/* Same for an event the caller keeps */
+void traceSharedCommand(cl_event event, const char* name, int track) {
+	if (trace.file && event)
+	{
+		clRetainEvent(event);
+		traceCommand(event, name, track);
+	}
+}
+
+/* Writes the recorded commands of frames up to last, which must be done,
+   and drops them */
+void traceFlush(unsigned int last) {
+	int kept = 0;
+	for (int i = 0; i < traceCommandCount; ++i)
+	{
+		traceCommandRecord* record = &traceCommands[i];
+		if (record->frame > last)
+		{
+			traceCommands[kept++] = *record;
+			continue;
+		}
+		cl_ulong queued = 0, submit = 0, start = 0, end = 0;
+		clGetEventProfilingInfo(record->event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL);
+		clGetEventProfilingInfo(record->event, CL_PROFILING_COMMAND_SUBMIT, sizeof(submit), &submit, NULL);
+		clGetEventProfilingInfo(record->event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+		clGetEventProfilingInfo(record->event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+		long long offset = record->enqueued - (long long)queued;
+		char args[160];
+		snprintf(args, sizeof(args),
+			"\"frame\": %u, \"queued_to_submit_us\": %.3f, \"submit_to_start_us\": %.3f",
+			record->frame, submit > queued ? (submit - queued) / 1e3 : 0.0,
+			start > submit ? (start - submit) / 1e3 : 0.0);
+		chromeTraceSpan(&trace, record->track, record->name, "device",
+			(long long)start + offset, (long long)end + offset, args);
+		clReleaseEvent(record->event);
+	}
+	traceCommandCount = kept;
+}
+
+/* A host span of the current frame */
+void traceHostSpan(int track, const char* name, long long start) {
+	if (trace.file)
+	{
+		char args[32];
+		snprintf(args, sizeof(args), "\"frame\": %u", renderedFrames);
+		chromeTraceSpan(&trace, track, name, "host", start, nowNanoseconds(), args);
+	}
+}
+
+/* Key of the tuned work group shape in the cache file: device and sizes */
+void makeTuneKey(cl_device_id dev) {
+	char name[128] = "";
+	clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+	snprintf(tuneKey, sizeof(tuneKey), "%s | %dx%d | %d", name,
+		WINDOW_WIDTH, WINDOW_HEIGHT, SATELLITE_COUNT);
+}
+
+/* Reads the cached work group shape for tuneKey, the last entry wins.
+   Lines are "width height key". Returns 0 if there is none. */
+int loadWorkGroupShape() {
+	FILE* file = fopen(tuneCacheFile, "r");
+	if (!file)
+	{
+		return 0;
+	}
+	char line[512];
+	int found = 0;
+	while (fgets(line, sizeof(line), file))
+	{
+		unsigned int width, height;
+		int keyStart = 0;
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "%u %u %n", &width, &height, &keyStart) == 2 &&
+			keyStart > 0 && strcmp(line + keyStart, tuneKey) == 0 &&
+			width > 0 && height > 0)
+		{
+			workGroupShape[0] = width;
+			workGroupShape[1] = height;
+			found = 1;
+		}
+	}
+	fclose(file);
+	return found;
+}
+
+void saveWorkGroupShape() {
+	FILE* file = fopen(tuneCacheFile, "a");
+	if (!file)
+	{
+		printf("Cannot write the work group cache %s\n", tuneCacheFile);
+		return;
+	}
+	fprintf(file, "%u %u %s\n", (unsigned int)workGroupShape[0],
+		(unsigned int)workGroupShape[1], tuneKey);
+	fclose(file);
+}
+
+/* FNV-1a over size bytes, continuing from hash */
+unsigned long long hashBytes(unsigned long long hash, const void* data, size_t size) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* Loads the program binary cached under key from path, NULL if there is none
+   or the runtime rejects it. The file holds the key, then the binary. */
+cl_program load_program_binary(cl_context ctx, cl_device_id dev, const char* path,
+	const char* key) {
+
+	FILE* file = fopen(path, "rb");
+	if (!file)
+	{
+		return NULL;
+	}
+	size_t keyLength = 0, binarySize = 0;
+	char storedKey[1024];
+	unsigned char* binary = NULL;
+	int valid = fread(&keyLength, sizeof(keyLength), 1, file) == 1 &&
+		keyLength < sizeof(storedKey) &&
+		fread(storedKey, 1, keyLength, file) == keyLength &&
+		fread(&binarySize, sizeof(binarySize), 1, file) == 1 && binarySize > 0;
+	if (valid)
+	{
+		storedKey[keyLength] = '\0';
+		valid = strcmp(storedKey, key) == 0;
+	}
+	if (valid)
+	{
+		binary = (unsigned char*)malloc(binarySize);
+		valid = binary && fread(binary, 1, binarySize, file) == binarySize;
+	}
+	fclose(file);
+	if (!valid)
+	{
+		free(binary);
+		return NULL;
+	}
+
+	cl_int binaryStatus;
+	cl_program program = clCreateProgramWithBinary(ctx, 1, &dev, &binarySize,
+		(const unsigned char**)&binary, &binaryStatus, &status);
+	free(binary);
+	if (status != CL_SUCCESS || binaryStatus != CL_SUCCESS)
+	{
+		if (program)
+		{
+			clReleaseProgram(program);
+		}
+		return NULL;
+	}
+	if (clBuildProgram(program, 1, &dev, NULL, NULL, NULL) != CL_SUCCESS)
+	{
+		clReleaseProgram(program);
+		return NULL;
+	}
+	return program;
+}
+
+/* Writes the binary of a built program to path under key. The file is
+   written next to path and renamed, so a start never reads half a binary. */
+void save_program_binary(cl_program program, const char* path, const char* key) {
+
+	size_t binarySize = 0;
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binarySize),
+		&binarySize, NULL) != CL_SUCCESS || binarySize == 0)
+	{
+		return;
+	}
+	unsigned char* binary = (unsigned char*)malloc(binarySize);
+	if (!binary || clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary),
+		&binary, NULL) != CL_SUCCESS)
+	{
+		free(binary);
+		return;
+	}
+
+	char temporary[1100];
+	snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+	FILE* file = fopen(temporary, "wb");
+	size_t keyLength = strlen(key);
+	int written = file &&
+		fwrite(&keyLength, sizeof(keyLength), 1, file) == 1 &&
+		fwrite(key, 1, keyLength, file) == keyLength &&
+		fwrite(&binarySize, sizeof(binarySize), 1, file) == 1 &&
+		fwrite(binary, 1, binarySize, file) == binarySize;
+	if (file && fclose(file) != 0)
+	{
+		written = 0;
+	}
+	if (!written || rename(temporary, path) != 0)
+	{
+		printf("Cannot write the program cache %s\n", path);
+		remove(temporary);
+	}
+	free(binary);
+}
+
+/* Reads a whole source file, exits if it is missing */
+char* read_source(const char* filename, size_t* size) {
+
+	FILE* program_handle = fopen(filename, "rb");
 	if (program_handle == NULL) {
 		perror("Cannot find the program file");
 		exit(1);
 	}
 	fseek(program_handle, 0, SEEK_END);
-	program_size = ftell(program_handle);
+	*size = ftell(program_handle);
 	rewind(program_handle);
-	program_buffer = (char*)malloc(program_size + 1);
-	program_buffer[program_size] = '\0';
-	fread(program_buffer, sizeof(char), program_size, program_handle);
+	char* program_buffer = (char*)malloc(*size + 1);
+	program_buffer[*size] = '\0';
+	fread(program_buffer, sizeof(char), *size, program_handle);
 	fclose(program_handle);
+	return program_buffer;
+}
+
+/* Create program from a file and compile it with the given build options.
+   SHARED_HEADER_FILE goes in front of the file. The built binary is
+   cached in binaryCacheDirectory, keyed by a hash of the source, the
+   device name, the driver version and the build options. A start with the
+   same key loads the binary instead of compiling. Anything that does not
+   match, or a binary the runtime rejects, is rebuilt from source. */
+cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename,
+	const char* options) {
+
+	cl_program program;
+	char* program_log;
+	size_t log_size;
+	int status;
+	long long buildStart = nowNanoseconds();
+
+	/* Read the shared header and the program file */
+	char* program_buffers[2];
+	size_t program_sizes[2];
+	program_buffers[0] = read_source(SHARED_HEADER_FILE, &program_sizes[0]);
+	program_buffers[1] = read_source(filename, &program_sizes[1]);
+
+	/* Look for a cached binary */
+	char key[1024], path[1024];
+	char deviceName[256] = "", driverVersion[256] = "";
+	clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(deviceName) - 1, deviceName, NULL);
+	clGetDeviceInfo(dev, CL_DRIVER_VERSION, sizeof(driverVersion) - 1, driverVersion, NULL);
+	snprintf(key, sizeof(key), "%016llx|%s|%s|%s",
+		hashBytes(hashBytes(0xcbf29ce484222325ULL, program_buffers[0], program_sizes[0]),
+			program_buffers[1], program_sizes[1]),
+		deviceName, driverVersion, options);
+	snprintf(path, sizeof(path), "%s/%s-%016llx.bin", binaryCacheDirectory, filename,
+		hashBytes(0xcbf29ce484222325ULL, key, strlen(key)));
+	if (useBinaryCache)
+	{
+		program = load_program_binary(ctx, dev, path, key);
+		if (program)
+		{
+			free(program_buffers[0]);
+			free(program_buffers[1]);
+			printf("Program: cached binary %s, %.1f ms\n", path,
+				(nowNanoseconds() - buildStart) / 1e6);
+			return program;
+		}
+	}
 
 	/* Create program from file */
-	program = clCreateProgramWithSource(ctx, 1,
-		(const char**)&program_buffer, &program_size, &status);
+	program = clCreateProgramWithSource(ctx, 2,
+		(const char**)program_buffers, program_sizes, &status);
 	if (status < 0) {
 		perror("Cannot create the program");
 		exit(1);
 	}
-	free(program_buffer);
+	free(program_buffers[0]);
+	free(program_buffers[1]);
 
 	/* Build program */
-	status = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+	status = clBuildProgram(program, 0, NULL, options, NULL, NULL);
 	if (status < 0) {
 
 		/* Find size of log and print to std output */
@@ -216,83 +710,460 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename)
 		free(program_log);
 		exit(1);
 	}
+	printf("Program: built from source, %.1f ms\n",
+		(nowNanoseconds() - buildStart) / 1e6);
+	if (useBinaryCache)
+	{
+		save_program_binary(program, path, key);
+	}
 
 	return program;
 }
 
-void init() {
+/* Kernel, resident satellites and one-cell grid of the device physics */
+void createDevicePhysics() {
+	physicsKernel = clCreateKernel(program, PHYSICS_KERNEL_FUNC, &status);
+	if (status < 0) {
+		perror("Cannot create the physics kernel");
+		exit(1);
+	};
+	deviceSatellites = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		SATELLITE_COUNT * sizeof(satellite), satellites, &status);
+	if (status != CL_SUCCESS)
+	{
+		printf("Error while creating the device satellite buffer\n");
+		exit(1);
+	}
+	status = clSetKernelArg(physicsKernel, 0, sizeof(cl_mem), &deviceSatellites);
+	if (status != CL_SUCCESS)
+	{
+		printf("Error while associating the satellites to the physics kernel\n");
+		exit(1);
+	}
 
-	device = create_device();
-	context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+	// The cell starts at the origin and covers everything
+	int cellStart[2] = { 0, SATELLITE_COUNT };
+	int* cellSatellites = (int*)malloc(sizeof(int) * SATELLITE_COUNT);
+	if (!cellSatellites)
+	{
+		printf("Cannot allocate the satellite grid\n");
+		exit(1);
+	}
+	for (int i = 0; i < SATELLITE_COUNT; ++i)
+	{
+		cellSatellites[i] = i;
+	}
+	wholeGrid.cellSize = 1.0f;
+	wholeGrid.columns = 1;
+	wholeGrid.rows = 1;
+	wholeCellStart = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(cellStart), cellStart, &status);
+	cl_int satelliteStatus;
+	wholeCellSatellites = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		SATELLITE_COUNT * sizeof(int), cellSatellites, &satelliteStatus);
+	free(cellSatellites);
+	if (status != CL_SUCCESS || satelliteStatus != CL_SUCCESS)
+	{
+		printf("Error while creating grid cell buffer\n");
+		exit(1);
+	}
+}
+
+/* Context, program, queue and buffers of one device of the split */
+void createSplitDevice(splitRenderer* r, cl_device_id dev) {
+	r->device = dev;
+	clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(r->name) - 1, r->name, NULL);
+	r->context = clCreateContext(NULL, 1, &dev, NULL, NULL, &status);
 	if (status < 0)
 	{
 		perror("Cannot create a context");
 		exit(1);
 	}
-	/*Build Program and create a kernel calling build_program function*/
-	program = build_program(context, device, PROGRAM_FILE);
-	kernel = clCreateKernel(program, KERNEL_FUNC, &status);
+	r->program = build_program(r->context, dev, PROGRAM_FILE, programOptions);
+	r->kernel = clCreateKernel(r->program, KERNEL_FUNC, &status);
 	if (status < 0) {
 		perror("Cannot create a kernel");
 		exit(1);
 	};
- 
-	// Buffer for satellite data
-	satelliteDataBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY, SATELLITE_COUNT * sizeof(satellite),
-		NULL, &status);
 
-	if (status != CL_SUCCESS)
+	// The profiling times balance the split
+	cl_queue_properties properties[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+	r->queue = clCreateCommandQueueWithProperties(r->context, dev, properties, &status);
+	if (status < 0) {
+		perror("Cannot create a command queue");
+		exit(1);
+	};
+
+	// Each device keeps a whole image, only its band is read back
+	cl_int statuses[4];
+	r->satellites = clCreateBuffer(r->context, CL_MEM_READ_ONLY,
+		SATELLITE_COUNT * sizeof(satellite), NULL, &statuses[0]);
+	r->cellStart = clCreateBuffer(r->context, CL_MEM_READ_ONLY,
+		(satelliteGridMaxCells(SATELLITE_COUNT) + 1) * sizeof(int), NULL, &statuses[1]);
+	r->cellSatellites = clCreateBuffer(r->context, CL_MEM_READ_ONLY,
+		SATELLITE_COUNT * sizeof(int), NULL, &statuses[2]);
+	r->pixels = clCreateBuffer(r->context, CL_MEM_WRITE_ONLY,
+		SIZE * sizeof(color), NULL, &statuses[3]);
+	for (int i = 0; i < 4; ++i)
 	{
-		printf("Error while creating satellite buffer input\n");
-		return;
+		if (statuses[i] != CL_SUCCESS)
+		{
+			printf("Error while creating the buffers of %s\n", r->name);
+			exit(1);
+		}
 	}
 
-	// Buffer for pixel out data
-	pixelOut = clCreateBuffer(context, CL_MEM_WRITE_ONLY, SIZE * sizeof(color),
-		NULL, &status);
-	if (status != CL_SUCCESS)
+	size_t maxGroup = 0;
+	clGetKernelWorkGroupInfo(r->kernel, dev, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(maxGroup), &maxGroup, NULL);
+	r->shape[0] = r->shape[1] = maxGroup == 0 || maxGroup >= LOCAL_WORK_SIZE * LOCAL_WORK_SIZE ?
+		LOCAL_WORK_SIZE : (maxGroup >= 64 ? 8 : 1);
+}
+
+/* Every device of every platform, plus the host threads */
+void initSplitRenderers() {
+	cl_uint platformCount = 0;
+	clGetPlatformIDs(0, NULL, &platformCount);
+	cl_platform_id* platforms = (cl_platform_id*)malloc(sizeof(cl_platform_id) * (platformCount + 1));
+	if (!platforms || clGetPlatformIDs(platformCount, platforms, NULL) != CL_SUCCESS)
 	{
-		printf("Error while creating pixel buffer output\n");
-		return;
+		platformCount = 0;
 	}
-	
-	// Associating satellite buffer to kernel (Associate buffer to kernel)
-	status = clSetKernelArg(kernel, 0, sizeof(cl_mem), &satelliteDataBuffer);
-	if (status != CL_SUCCESS)
+	for (cl_uint p = 0; p < platformCount; ++p)
 	{
-		printf("Error while associating satellite data buffer\n");
-		return;
+		cl_uint deviceCount = 0;
+		if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &deviceCount) != CL_SUCCESS ||
+			deviceCount == 0)
+		{
+			continue;
+		}
+		cl_device_id* devices = (cl_device_id*)malloc(sizeof(cl_device_id) * deviceCount);
+		splitRenderer* grown = (splitRenderer*)realloc(splitRenderers,
+			sizeof(splitRenderer) * (splitRendererCount + deviceCount + 1));
+		if (!devices || !grown)
+		{
+			printf("Cannot allocate the split renderers\n");
+			exit(1);
+		}
+		splitRenderers = grown;
+		clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, deviceCount, devices, NULL);
+		for (cl_uint d = 0; d < deviceCount; ++d)
+		{
+			splitRenderer* r = &splitRenderers[splitRendererCount++];
+			memset(r, 0, sizeof(*r));
+			createSplitDevice(r, devices[d]);
+		}
+		free(devices);
 	}
+	free(platforms);
 
-	// Associating pixel buffer output to kernel
-	status = clSetKernelArg(kernel, 1, sizeof(cl_mem), &pixelOut);
-	if (status != CL_SUCCESS)
+	if (splitHost || splitRendererCount == 0)
 	{
-		printf("Error while associating pixel data buffer to the kernel\n");
-		return;
+		splitRenderer* grown = (splitRenderer*)realloc(splitRenderers,
+			sizeof(splitRenderer) * (splitRendererCount + 1));
+		if (!grown)
+		{
+			printf("Cannot allocate the split renderers\n");
+			exit(1);
+		}
+		splitRenderers = grown;
+		splitRenderer* r = &splitRenderers[splitRendererCount++];
+		memset(r, 0, sizeof(*r));
+		snprintf(r->name, sizeof(r->name), "host (%d threads)", enginePool.threads);
+	}
+
+	// Equal bands until the first frame has been measured
+	printf("Split rendering over %d renderers:\n", splitRendererCount);
+	for (int i = 0; i < splitRendererCount; ++i)
+	{
+		splitRenderers[i].share = 1.0 / splitRendererCount;
+		printf("  %s\n", splitRenderers[i].name);
+		chromeTraceTrackName(&trace, TRACK_SPLIT + i, splitRenderers[i].name);
+	}
+}
+
+void init() {
+
+	// The split renderers read back float colors
+	if (recordPath && !frameRecorderOpen(&recorder, recordPath, recordContainer,
+		splitRendering ? PIXEL_FLOAT : pixelFormat, WINDOW_WIDTH, WINDOW_HEIGHT,
+		recordSlots, recordLossless))
+	{
+		exit(1);
 	}
 
-	// Creating a command queue and associating it with the device 
-	queue = clCreateCommandQueueWithProperties(context, device, 0,
-		&status);
+	if (!taskPoolInit(&enginePool, engineThreads > 0 ? engineThreads : taskPoolCpuCount(),
+		pinThreads))
+	{
+		printf("Cannot start the physics threads\n");
+		exit(1);
+	}
+
+	device = create_device();
+	if (traceFileName)
+	{
+		if (!chromeTraceOpen(&trace, traceFileName))
+		{
+			printf("Cannot write the trace %s\n", traceFileName);
+			exit(1);
+		}
+		chromeTraceTrackName(&trace, TRACK_PHYSICS, "host physics");
+		chromeTraceTrackName(&trace, TRACK_RENDER, "host render");
+		chromeTraceTrackName(&trace, TRACK_QUEUE, "queue");
+		chromeTraceTrackName(&trace, TRACK_READ_QUEUE, "readQueue");
+	}
+	if (verifyFrames > 0)
+	{
+		asyncFrames = 0;
+	}
+	if (splitRendering)
+	{
+		// The split uploads host satellites to every device and reads its
+		// bands straight into the pixels
+		devicePhysics = 0;
+		zeroCopyPixels = 0;
+		asyncFrames = 0;
+		if (pixelFormat != PIXEL_FLOAT)
+		{
+			printf("Split rendering reads back float colors\n");
+			pixelFormat = PIXEL_FLOAT;
+		}
+		if (incrementalThreshold > 0.f)
+		{
+			printf("Split rendering shades every tile\n");
+			incrementalThreshold = 0.f;
+		}
+	}
+	if (incrementalThreshold > 0.f)
+	{
+		// The tile tests read the host satellites of every frame
+		devicePhysics = 0;
+	}
+	if (pixelFormat != PIXEL_FLOAT)
+	{
+		zeroCopyPixels = 0;
+	}
+	if (zeroCopyPixels < 0)
+	{
+		zeroCopyPixels = deviceSharesHostMemory(device);
+	}
+	if (devicePhysics && !deviceHasDoubles(device))
+	{
+		if (devicePhysics > 0)
+		{
+			printf("The device has no double precision, physics stays on the host\n");
+		}
+		devicePhysics = 0;
+	}
+	devicePhysics = devicePhysics != 0;
+	context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+	if (status < 0)
+	{
+		perror("Cannot create a context");
+		exit(1);
+	}
+	/*Build Program and create a kernel calling build_program function.
+	  The constants and the runtime sizes are compiled in so the kernel loops
+	  stay specialized. Every size gets its own binary in the program cache.*/
+	char* options = programOptions;
+	snprintf(options, sizeof(programOptions),
+		SATELLITE_KERNEL_OPTIONS " -DWINDOW_WIDTH=%d -DWINDOW_HEIGHT=%d"
+		" -DSATELLITE_COUNT=%d%s",
+		WINDOW_WIDTH, WINDOW_HEIGHT, SATELLITE_COUNT, devicePhysics ? " -DDEVICE_PHYSICS" : "");
+	if (devicePhysics)
+	{
+		snprintf(options + strlen(options), sizeof(programOptions) - strlen(options),
+			" -DPHYSICSUPDATESPERFRAME=%d", PHYSICSUPDATESPERFRAME);
+	}
+	program = build_program(context, device, PROGRAM_FILE, options);
+	kernel = clCreateKernel(program, KERNEL_FUNC, &status);
+	if (status < 0) {
+		perror("Cannot create a kernel");
+		exit(1);
+	};
+ 
+	// Two sets of the per frame buffers, see RENDER_SLOTS
+	for (int slot = 0; slot < RENDER_SLOTS; ++slot)
+	{
+		satelliteDataBuffer[slot] = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			SATELLITE_COUNT * sizeof(satellite), NULL, &status);
+		if (status != CL_SUCCESS)
+		{
+			printf("Error while creating satellite buffer input\n");
+			exit(1);
+		}
+		pixelOut[slot] = clCreateBuffer(context,
+			CL_MEM_WRITE_ONLY | (zeroCopyPixels ? CL_MEM_ALLOC_HOST_PTR : 0),
+			SIZE * sizeof(color), NULL, &status);
+		if (status != CL_SUCCESS && zeroCopyPixels)
+		{
+			zeroCopyPixels = 0;
+			pixelOut[slot] = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+				SIZE * sizeof(color), NULL, &status);
+		}
+		if (status != CL_SUCCESS)
+		{
+			printf("Error while creating pixel buffer output\n");
+			exit(1);
+		}
+
+		// Grid buffers, sized for the largest grid
+		cellStartBuffer[slot] = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			(satelliteGridMaxCells(SATELLITE_COUNT) + 1) * sizeof(int), NULL, &status);
+		if (status != CL_SUCCESS)
+		{
+			printf("Error while creating grid cell buffer\n");
+			exit(1);
+		}
+		cellSatelliteBuffer[slot] = clCreateBuffer(context, CL_MEM_READ_ONLY,
+			SATELLITE_COUNT * sizeof(int), NULL, &status);
+		if (status != CL_SUCCESS)
+		{
+			printf("Error while creating grid satellite buffer\n");
+			exit(1);
+		}
+
+		// Host side copy the uploads read from
+		stagedSatellites[slot] = (satellite*)malloc(sizeof(satellite) * SATELLITE_COUNT);
+		if (!stagedSatellites[slot])
+		{
+			printf("Cannot allocate the host render buffers\n");
+			exit(1);
+		}
+	}
+
+	// Creating a command queue and associating it with the device. The
+	// readbacks get a queue of their own, so that they can run next to the
+	// uploads and the kernel of the following frame.
+	cl_queue_properties profiling[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+	queue = clCreateCommandQueueWithProperties(context, device,
+		traceFileName || benchRuns > 0 ? profiling : NULL, &status);
+	if (status < 0) {
+		perror("Cannot create a command queue");
+		exit(1);
+	};
+	readQueue = clCreateCommandQueueWithProperties(context, device,
+		traceFileName || benchRuns > 0 ? profiling : NULL, &status);
 	if (status < 0) {
 		perror("Cannot create a command queue");
 		exit(1);
 	};
-	
 
+	// Zero-copy needs the pixel buffers to map, which is tried once here
+	for (int slot = 0; slot < RENDER_SLOTS && zeroCopyPixels; ++slot)
+	{
+		void* mapped = clEnqueueMapBuffer(readQueue, pixelOut[slot], CL_TRUE,
+			CL_MAP_READ, 0, SIZE * sizeof(color), 0, NULL, NULL, &status);
+		if (status != CL_SUCCESS || !mapped)
+		{
+			zeroCopyPixels = 0;
+			break;
+		}
+		clEnqueueUnmapMemObject(readQueue, pixelOut[slot], mapped, 0, NULL, NULL);
+	}
+	clFinish(readQueue);
+
+	// The copy path reads back into host copies. Slot 0 uses the pixel
+	// buffer of fixedInit.
+	fixedPixels = pixels;
+	if (!zeroCopyPixels)
+	{
+		hostPixels[0] = fixedPixels;
+		hostPixels[1] = (color*)malloc(sizeof(color) * SIZE);
+		if (!hostPixels[1])
+		{
+			printf("Cannot allocate the host render buffers\n");
+			exit(1);
+		}
+	}
+	for (int slot = 0; slot < RENDER_SLOTS && pixelFormat != PIXEL_FLOAT; ++slot)
+	{
+		packedPixels[slot] = (unsigned char*)malloc(pixelFormatBytes(pixelFormat) * SIZE);
+		if (!packedPixels[slot])
+		{
+			printf("Cannot allocate the host render buffers\n");
+			exit(1);
+		}
+	}
+	if (incrementalThreshold > 0.f)
+	{
+		tileColumns = (WINDOW_WIDTH + tileSize - 1) / tileSize;
+		tileRows = (WINDOW_HEIGHT + tileSize - 1) / tileSize;
+		int tiles = tileColumns * tileRows;
+		tileStableFrom = (unsigned int*)calloc(tiles, sizeof(unsigned int));
+		previousSatellites = (satellite*)malloc(sizeof(satellite) * SATELLITE_COUNT);
+		int allocated = tileStableFrom && previousSatellites;
+		for (int slot = 0; slot < RENDER_SLOTS; ++slot)
+		{
+			slotTileFrame[slot] = (unsigned int*)calloc(tiles, sizeof(unsigned int));
+			slotTileSamples[slot] = (float*)calloc((size_t)tiles * 3 * TILE_SAMPLES,
+				sizeof(float));
+			keptTiles[slot] = (unsigned char*)calloc(tiles, 1);
+			allocated = allocated && slotTileFrame[slot] && slotTileSamples[slot] &&
+				keptTiles[slot];
+			keptTileBuffer[slot] = clCreateBuffer(context, CL_MEM_READ_ONLY, tiles, NULL,
+				&status);
+			if (status != CL_SUCCESS)
+			{
+				printf("Error while creating the kept tile buffer\n");
+				exit(1);
+			}
+		}
+		if (!allocated)
+		{
+			printf("Cannot allocate the tile buffers\n");
+			exit(1);
+		}
+	}
+	for (int slot = 0; slot < RENDER_SLOTS; ++slot)
+	{
+		slotContentFormat[slot] = -1;
+	}
+	if (devicePhysics)
+	{
+		createDevicePhysics();
+	}
+	makeTuneKey(device);
+	if (!retuneWorkGroup && loadWorkGroupShape())
+	{
+		workGroupTuned = 1;
+		printf("Work group: %ux%u (cached in %s)\n", (unsigned int)workGroupShape[0],
+			(unsigned int)workGroupShape[1], tuneCacheFile);
+	}
+	printf("Physics: %s\n", devicePhysics ? "on the device (double precision)" :
+		"on the host");
+	printf("Pixel output: %s\n", zeroCopyPixels ? "mapped device buffers (zero-copy)" :
+		"read back from the device");
+	if (pixelFormat != PIXEL_FLOAT)
+	{
+		printf("Pixel format: %s, %u bytes per pixel instead of %u\n",
+			pixelFormatName(pixelFormat), (unsigned int)pixelFormatBytes(pixelFormat),
+			(unsigned int)sizeof(color));
+	}
+	if (asyncFrames)
+	{
+		printf("Asynchronous rendering: frames are shown one frame late\n");
+	}
+	if (incrementalThreshold > 0.f)
+	{
+		printf("Incremental rendering: %i x %i pixel tiles are shaded once they change by"
+			" about %g, all of them every %i frames\n", tileSize, tileSize,
+			incrementalThreshold, refreshFrames);
+	}
+	if (splitRendering)
+	{
+		initSplitRenderers();
+	}
 }
 
-// ## You are asked to make this code parallel ##
-// Physics engine loop. (This is called once a frame before graphics engine) 
-// Moves the satellites based on gravity
-// This is done multiple times in a frame because the Euler integration 
-// is not accurate enough to be done only once
-void parallelPhysicsEngine(){
+// Satellites i = begin .. end - 1 of the physics loop. Every satellite is
+// written by exactly one thread, so no locking is needed.
+static void physicsTask(void* context, int begin, int end, int worker){
+   (void)context;
+   (void)worker;
 
-   #pragma omp parallel for  
    // SWAPPED Physics satellite loop
-   for(int i = 0; i < SATELLITE_COUNT; ++i){
+   for(int i = begin; i < end; ++i){
          
          // cache the variables
          double tmpPositionx = satellites[i].position.x;
@@ -334,70 +1205,756 @@ void parallelPhysicsEngine(){
          tmpPositiony += tmpVelocityy * DELTATIME / PHYSICSUPDATESPERFRAME;
       
       }
-      #pragma omp critical
-      {
-         satellites[i].position.x = tmpPositionx;
-         satellites[i].position.y = tmpPositiony;
-         satellites[i].velocity.x = tmpVelocityx;
-         satellites[i].velocity.y = tmpVelocityy;
-      } 
+      satellites[i].position.x = tmpPositionx;
+      satellites[i].position.y = tmpPositiony;
+      satellites[i].velocity.x = tmpVelocityx;
+      satellites[i].velocity.y = tmpVelocityy;
    }
 
 }
 
+// Satellites a thread takes at a time
+#define PHYSICS_TASK_GRAIN 4
+
+// ## You are asked to make this code parallel ##
+// Physics engine loop. (This is called once a frame before graphics engine) 
+// Moves the satellites based on gravity
+// This is done multiple times in a frame because the Euler integration 
+// is not accurate enough to be done only once
+void parallelPhysicsEngine(){
+   if(devicePhysics){
+      // Queued in front of this frame's shading kernel
+      size_t globalWorkSize = SATELLITE_COUNT;
+      cl_event physicsDone = NULL, satellitesRead = NULL;
+      status = clEnqueueNDRangeKernel(queue, physicsKernel, 1, NULL, &globalWorkSize,
+                                      NULL, 0, NULL, TRACE_EVENT(&physicsDone));
+      if(status != CL_SUCCESS){
+         printf("Error while executing the physics kernel\n");
+         return;
+      }
+      traceCommand(physicsDone, "physics kernel", TRACK_QUEUE);
+      // The checked frames and --verify compare the host satellites
+      if(frameNumber < 2 || verifyFrames > 0){
+         clEnqueueReadBuffer(queue, deviceSatellites, CL_TRUE, 0,
+                             SATELLITE_COUNT * sizeof(satellite), satellites, 0, NULL,
+                             TRACE_EVENT(&satellitesRead));
+         traceCommand(satellitesRead, "read satellites", TRACK_QUEUE);
+      }
+      return;
+   }
+   long long start = nowNanoseconds();
+   taskPoolFor(&enginePool, SATELLITE_COUNT, PHYSICS_TASK_GRAIN, physicsTask, NULL);
+   traceHostSpan(TRACK_PHYSICS, "physics", start);
+}
+
+// Global size of the shading kernel, rounded up to whole work groups
+static void shadingGlobalSize(const size_t* shape, size_t* globalWorkSize) {
+	globalWorkSize[0] = (WINDOW_WIDTH + shape[0] - 1) / shape[0] * shape[0];
+	globalWorkSize[1] = (WINDOW_HEIGHT + shape[1] - 1) / shape[1] * shape[1];
+}
+
+// Times the shading kernel with its current arguments for every candidate
+// shape the kernel allows and keeps the fastest. Runs on the first frame,
+// before anything waits on the pixel buffers.
+#define TUNE_RUNS 3
+static void tuneWorkGroup() {
+	static const size_t candidates[][2] = {
+		{ 8, 8 }, { 16, 8 }, { 8, 16 }, { 16, 16 }, { 32, 4 }, { 32, 8 },
+		{ 64, 4 }, { 32, 16 }, { 16, 32 }, { 64, 8 }, { 32, 32 } };
+	size_t maxGroup = 0;
+	clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(maxGroup), &maxGroup, NULL);
+	long long bestTime = -1;
+	for (size_t c = 0; c < sizeof(candidates) / sizeof(candidates[0]); ++c)
+	{
+		if (maxGroup && candidates[c][0] * candidates[c][1] > maxGroup)
+		{
+			continue;
+		}
+		size_t globalWorkSize[2];
+		shadingGlobalSize(candidates[c], globalWorkSize);
+
+		// The first run is a warm-up, the fastest of the others counts
+		long long fastest = -1;
+		for (int run = 0; run <= TUNE_RUNS; ++run)
+		{
+			long long start = nowNanoseconds();
+			status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL,
+				globalWorkSize, candidates[c], 0, NULL, NULL);
+			if (status != CL_SUCCESS)
+			{
+				break;
+			}
+			clFinish(queue);
+			long long time = nowNanoseconds() - start;
+			if (run > 0 && (fastest < 0 || time < fastest))
+			{
+				fastest = time;
+			}
+		}
+		if (status == CL_SUCCESS && (bestTime < 0 || fastest < bestTime))
+		{
+			bestTime = fastest;
+			workGroupShape[0] = candidates[c][0];
+			workGroupShape[1] = candidates[c][1];
+		}
+	}
+	if (bestTime < 0)
+	{
+		printf("No work group shape runs, keeping %ux%u\n",
+			(unsigned int)workGroupShape[0], (unsigned int)workGroupShape[1]);
+	}
+	else
+	{
+		printf("Work group: %ux%u (tuned, %.3f ms)\n", (unsigned int)workGroupShape[0],
+			(unsigned int)workGroupShape[1], bestTime / 1e6);
+		saveWorkGroupShape();
+	}
+	workGroupTuned = 1;
+}
+
+// Waits for an event of an earlier frame and drops it
+static void finishEvent(cl_event* event) {
+	if (*event)
+	{
+		clWaitForEvents(1, event);
+		clReleaseEvent(*event);
+		*event = NULL;
+	}
+}
+
+// Rows of the host's band, shaded exactly like parallelOpenCL with the
+// grid of the frame
+typedef struct{
+	const satelliteGrid* grid;
+	int firstRow;
+} hostBand;
+
+static void hostShadeTask(void* context, int begin, int end, int worker){
+	const hostBand* band = (const hostBand*)context;
+	const float* x = &satellites[0].position.x;
+	const float* y = &satellites[0].position.y;
+	int stride = sizeof(satellite) / sizeof(float);
+	(void)worker;
+	for (int row = band->firstRow + begin; row < band->firstRow + end; ++row)
+	{
+		for (int column = 0; column < WINDOW_WIDTH; ++column)
+		{
+			float px = column, py = row;
+			color renderColor = { .red = 1.0f, .green = 1.0f, .blue = 1.0f };
+			if (!satelliteGridHits(band->grid, x, y, stride, px, py, SATELLITE_RADIUS))
+			{
+				int nearest = satelliteGridNearest(band->grid, x, y, stride, px, py);
+				renderColor.red = renderColor.green = renderColor.blue = 0.f;
+				if (nearest >= 0)
+				{
+					renderColor = satellites[nearest].identifier;
+				}
+				float weights = 0.f;
+				color blend = { .red = 0.f, .green = 0.f, .blue = 0.f };
+				for (int j = 0; j < SATELLITE_COUNT; ++j)
+				{
+					floatvector difference = { .x = px - satellites[j].position.x,
+						.y = py - satellites[j].position.y };
+					float dist2 = difference.x * difference.x + difference.y * difference.y;
+					float weight = 1.0f / (dist2 * dist2);
+					weights += weight;
+					blend.red += satellites[j].identifier.red * weight;
+					blend.green += satellites[j].identifier.green * weight;
+					blend.blue += satellites[j].identifier.blue * weight;
+				}
+				renderColor.red += blend.red / weights * 3.0f;
+				renderColor.green += blend.green / weights * 3.0f;
+				renderColor.blue += blend.blue / weights * 3.0f;
+			}
+			pixels[row * WINDOW_WIDTH + column] = renderColor;
+		}
+	}
+}
+
+// Smallest fraction of the rows a renderer keeps, so that a renderer that
+// was slow once is still measured
+#define SPLIT_MIN_SHARE 0.02
+
+// Renders the frame in bands across splitRenderers and moves the bands
+// towards the measured throughput for the next frame
+static void splitGraphicsEngine() {
+	int floatFormat = PIXEL_FLOAT, noTiles = 0;
+	satelliteGrid* grid = &renderGrid[0];
+	if (!satelliteGridBuild(grid, &satellites[0].position.x, &satellites[0].position.y,
+		sizeof(satellite) / sizeof(float), SATELLITE_COUNT, 0.f, 0.f,
+		WINDOW_WIDTH - 1, WINDOW_HEIGHT - 1, 2.0f * SATELLITE_RADIUS))
+	{
+		printf("Cannot allocate the satellite grid\n");
+		exit(1);
+	}
+	pixels = fixedPixels;
+
+	// Bands from the shares, the last one ends at the bottom row
+	double shareSum = 0.0;
+	for (int i = 0; i < splitRendererCount; ++i)
+	{
+		splitRenderer* r = &splitRenderers[i];
+		r->rowBegin = (int)(shareSum * WINDOW_HEIGHT + 0.5);
+		shareSum += r->share;
+		r->rowEnd = i == splitRendererCount - 1 ? WINDOW_HEIGHT :
+			(int)(shareSum * WINDOW_HEIGHT + 0.5);
+	}
+
+	// The devices get their work first, then the host renders its band
+	// while they run
+	for (int i = 0; i < splitRendererCount; ++i)
+	{
+		splitRenderer* r = &splitRenderers[i];
+		int rows = r->rowEnd - r->rowBegin;
+		if (!r->device || rows <= 0)
+		{
+			continue;
+		}
+		status = clEnqueueWriteBuffer(r->queue, r->satellites, CL_FALSE, 0,
+			SATELLITE_COUNT * sizeof(satellite), satellites, 0, NULL, &r->uploaded);
+		status |= clEnqueueWriteBuffer(r->queue, r->cellStart, CL_FALSE, 0,
+			(grid->columns * grid->rows + 1) * sizeof(int), grid->cellStart, 0, NULL, NULL);
+		status |= clEnqueueWriteBuffer(r->queue, r->cellSatellites, CL_FALSE, 0,
+			SATELLITE_COUNT * sizeof(int), grid->cellSatellites, 0, NULL, NULL);
+		status |= clSetKernelArg(r->kernel, 0, sizeof(cl_mem), &r->satellites);
+		status |= clSetKernelArg(r->kernel, 1, sizeof(cl_mem), &r->pixels);
+		status |= clSetKernelArg(r->kernel, 2, sizeof(cl_mem), &r->cellStart);
+		status |= clSetKernelArg(r->kernel, 3, sizeof(cl_mem), &r->cellSatellites);
+		status |= clSetKernelArg(r->kernel, 4, sizeof(float), &grid->originX);
+		status |= clSetKernelArg(r->kernel, 5, sizeof(float), &grid->originY);
+		status |= clSetKernelArg(r->kernel, 6, sizeof(float), &grid->cellSize);
+		status |= clSetKernelArg(r->kernel, 7, sizeof(int), &grid->columns);
+		status |= clSetKernelArg(r->kernel, 8, sizeof(int), &grid->rows);
+		status |= clSetKernelArg(r->kernel, 9, sizeof(int), &floatFormat);
+		status |= clSetKernelArg(r->kernel, 10, sizeof(cl_mem), NULL);
+		status |= clSetKernelArg(r->kernel, 11, sizeof(int), &noTiles);
+
+		// The offset moves the band, the kernel skips rows below the window
+		// and the rows past the band are not read back
+		size_t offset[] = { 0, (size_t)r->rowBegin };
+		size_t globalWorkSize[] = {
+			(WINDOW_WIDTH + r->shape[0] - 1) / r->shape[0] * r->shape[0],
+			(rows + r->shape[1] - 1) / r->shape[1] * r->shape[1] };
+		cl_event shaded = NULL;
+		status |= clEnqueueNDRangeKernel(r->queue, r->kernel, 2, offset,
+			globalWorkSize, r->shape, 0, NULL, TRACE_EVENT(&shaded));
+		traceCommand(shaded, "shade band", TRACK_SPLIT + i);
+		status |= clEnqueueReadBuffer(r->queue, r->pixels, CL_FALSE,
+			(size_t)r->rowBegin * WINDOW_WIDTH * sizeof(color),
+			(size_t)rows * WINDOW_WIDTH * sizeof(color),
+			pixels + (size_t)r->rowBegin * WINDOW_WIDTH, 0, NULL, &r->readBack);
+		if (status != CL_SUCCESS)
+		{
+			printf("Error while rendering the band of %s\n", r->name);
+			exit(1);
+		}
+		clFlush(r->queue);
+	}
+	for (int i = 0; i < splitRendererCount; ++i)
+	{
+		splitRenderer* r = &splitRenderers[i];
+		if (!r->device && r->rowEnd > r->rowBegin)
+		{
+			long long start = nowNanoseconds();
+			hostBand band = { grid, r->rowBegin };
+			taskPoolFor(&enginePool, r->rowEnd - r->rowBegin, 1, hostShadeTask, &band);
+			r->time = nowNanoseconds() - start;
+			traceHostSpan(TRACK_SPLIT + i, "shade band", start);
+		}
+	}
+
+	// Wait for the bands and take the device times
+	for (int i = 0; i < splitRendererCount; ++i)
+	{
+		splitRenderer* r = &splitRenderers[i];
+		if (!r->device || r->rowEnd <= r->rowBegin)
+		{
+			continue;
+		}
+		clWaitForEvents(1, &r->readBack);
+		cl_ulong start = 0, end = 0;
+		clGetEventProfilingInfo(r->uploaded, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+		clGetEventProfilingInfo(r->readBack, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+		r->time = end > start ? (long long)(end - start) : 0;
+		traceSharedCommand(r->uploaded, "upload", TRACK_SPLIT + i);
+		traceSharedCommand(r->readBack, "read band", TRACK_SPLIT + i);
+		finishEvent(&r->uploaded);
+		finishEvent(&r->readBack);
+	}
+	traceFlush(renderedFrames);
+
+	// Next shares follow rows per nanosecond, half way from the current
+	// ones so that a noisy frame does not swing the bands. A renderer with
+	// no rows or no time keeps its share.
+	double speedSum = 0.0, measuredShare = 0.0;
+	for (int i = 0; i < splitRendererCount; ++i)
+	{
+		splitRenderer* r = &splitRenderers[i];
+		int rows = r->rowEnd - r->rowBegin;
+		r->shareSum += (double)rows / WINDOW_HEIGHT;
+		r->timeSum += r->time;
+		r->speed = rows > 0 && r->time > 0 ? (double)rows / r->time : 0.0;
+		if (r->speed > 0.0)
+		{
+			speedSum += r->speed;
+			measuredShare += r->share;
+		}
+	}
+	shareSum = 0.0;
+	for (int i = 0; i < splitRendererCount; ++i)
+	{
+		splitRenderer* r = &splitRenderers[i];
+		if (speedSum > 0.0 && r->speed > 0.0)
+		{
+			r->share = 0.5 * r->share + 0.5 * measuredShare * r->speed / speedSum;
+		}
+		if (r->share < SPLIT_MIN_SHARE)
+		{
+			r->share = SPLIT_MIN_SHARE;
+		}
+		shareSum += r->share;
+	}
+	for (int i = 0; i < splitRendererCount; ++i)
+	{
+		splitRenderers[i].share /= shareSum;
+	}
+	renderedFrames++;
+	if (recordPath)
+	{
+		frameRecorderSubmit(&recorder, frameNumber, pixels);
+	}
+}
+
+// Tiles of a frame decided by tileDecisionTask
+typedef struct{
+	int slot;
+	int shadeAll;
+} tileDecision;
+
+// Decides tiles begin .. end - 1 of the slot's frame, see --incremental.
+// Every tile is written by exactly one thread.
+static void tileDecisionTask(void* context, int begin, int end, int worker){
+	const tileDecision* decision = (const tileDecision*)context;
+	int stride = sizeof(satellite) / sizeof(float);
+	tileSatellites now = { &satellites[0].position.x, &satellites[0].position.y,
+		&satellites[0].identifier.red, &satellites[0].identifier.green,
+		&satellites[0].identifier.blue, stride, SATELLITE_COUNT };
+	tileSatellites previous = { &previousSatellites[0].position.x,
+		&previousSatellites[0].position.y, NULL, NULL, NULL, stride, SATELLITE_COUNT };
+	(void)worker;
+	for (int tile = begin; tile < end; ++tile)
+	{
+		int left, bottom, right, top;
+		tileBounds(tile, tileColumns, tileSize, WINDOW_WIDTH, WINDOW_HEIGHT,
+			&left, &bottom, &right, &top);
+		if (!havePreviousSatellites ||
+			!tileKeepsNearest(&previous, &now, SATELLITE_RADIUS, left, bottom, right, top))
+		{
+			tileStableFrom[tile] = frameNumber;
+		}
+		float samples[3 * TILE_SAMPLES];
+		float* shaded = &slotTileSamples[decision->slot][(size_t)tile * 3 * TILE_SAMPLES];
+		tileSampleBlend(&now, left, bottom, right, top, samples);
+		int keep = !decision->shadeAll &&
+			tileStableFrom[tile] <= slotTileFrame[decision->slot][tile] &&
+			tileBlendChange(samples, shaded) <= incrementalThreshold;
+		keptTiles[decision->slot][tile] = (unsigned char)keep;
+		if (!keep)
+		{
+			slotTileFrame[decision->slot][tile] = frameNumber;
+			memcpy(shaded, samples, sizeof(samples));
+		}
+	}
+}
+
+// Marks the tiles the kernel keeps in the slot's pixel buffer this frame
+// and uploads the mask. The slot's kernel is done, so the last upload of
+// the mask is as well.
+static void chooseKeptTiles(int slot, int format) {
+	long long start = nowNanoseconds();
+	int tiles = tileColumns * tileRows;
+	// Both slots are refreshed, one after the other
+	tileDecision decision = { slot, frameNumber < 2 ||
+		frameNumber % refreshFrames < RENDER_SLOTS || slotContentFormat[slot] != format };
+	taskPoolFor(&enginePool, tiles, 4, tileDecisionTask, &decision);
+	memcpy(previousSatellites, satellites, sizeof(satellite) * SATELLITE_COUNT);
+	havePreviousSatellites = 1;
+	for (int tile = 0; tile < tiles; ++tile)
+	{
+		tilesKept += keptTiles[slot][tile];
+	}
+	tilesDecided += tiles;
+	slotContentFormat[slot] = format;
+	traceHostSpan(TRACK_RENDER, "tile decision", start);
+
+	cl_event uploaded = NULL;
+	status = clEnqueueWriteBuffer(queue, keptTileBuffer[slot], CL_FALSE, 0, tiles,
+		keptTiles[slot], 0, NULL, TRACE_EVENT(&uploaded));
+	if (status != CL_SUCCESS)
+	{
+		printf("Error while uploading the kept tiles\n");
+		exit(1);
+	}
+	traceCommand(uploaded, "upload kept tiles", TRACK_QUEUE);
+}
+
+// errorCheck()'s allowance plus one step of 8 bit rounding
+#define PACKED_PIXEL_ERROR (0.08f + 1.0f / 255.0f)
+
+// Renders a checked frame once more in the packed format and reads it
+// back. The float colors of the slot are already on the host.
+static void renderPackedCheck(int slot, const size_t* globalWorkSize) {
+	status = clSetKernelArg(kernel, 9, sizeof(int), &pixelFormat);
+	status |= clEnqueueNDRangeKernel(queue, kernel, 2, 0,
+		globalWorkSize, workGroupShape, 0, NULL, NULL);
+	status |= clEnqueueReadBuffer(queue, pixelOut[slot], CL_TRUE, 0,
+		SIZE * pixelFormatBytes(pixelFormat), packedPixels[slot], 0, NULL, NULL);
+	if (status != CL_SUCCESS)
+	{
+		printf("Error while rendering the packed pixels\n");
+		return;
+	}
+	packedCheckSlot = slot;
+	slotContentFormat[slot] = pixelFormat;
+}
+
+// Compares the packed pixels of the last checked frame with the sequential
+// reference in correctPixels, which compute() has filled in the meantime
+static void checkPackedPixels() {
+	if (packedCheckSlot < 0)
+	{
+		return;
+	}
+	long bad = pixelFormatCompare(pixelFormat, packedPixels[packedCheckSlot],
+		&correctPixels[0].red, SIZE, PACKED_PIXEL_ERROR);
+	packedCheckSlot = -1;
+	if (bad >= 0)
+	{
+		printf("Buggy %s pixel at (x=%i, y=%i)\n", pixelFormatName(pixelFormat),
+			(int)(bad % WINDOW_WIDTH), (int)(bad / WINDOW_WIDTH));
+		return;
+	}
+	printf("Packed %s check passed!\n", pixelFormatName(pixelFormat));
+}
+
 // ## You are asked to make this code parallel ##
 // Rendering loop (This is called once a frame after physics engine) 
 // Decides the color for each pixel.
+// Every transfer is non-blocking and ordered by events: uploads and the
+// kernel run on queue, the readback on readQueue once the kernel is done.
+// The kernel waits for the readback that last used its pixel buffer.
 void parallelGraphicsEngine(){
+	checkPackedPixels();
+	if (splitRendering)
+	{
+		splitGraphicsEngine();
+		return;
+	}
+	int slot = renderedFrames % RENDER_SLOTS;
+	int previous = (renderedFrames + RENDER_SLOTS - 1) % RENDER_SLOTS;
+
+	// The uploads of the slot's last frame are done once its kernel is,
+	// after that its host copies can be refilled
+	finishEvent(&kernelDone[slot]);
 
-    // Filling satellite input buffer with satellite data
-	status = clEnqueueWriteBuffer(queue, satelliteDataBuffer, CL_TRUE,
-		0, SATELLITE_COUNT * sizeof(satellite), satellites, 0, NULL, NULL);
+	satelliteGrid* grid = &renderGrid[slot];
+	if (devicePhysics)
+	{
+		// The satellites are already on the device. The one-cell grid has
+		// the kernel test all of them.
+		grid = &wholeGrid;
+		status = clSetKernelArg(kernel, 0, sizeof(cl_mem), &deviceSatellites);
+		status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &wholeCellStart);
+		status |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &wholeCellSatellites);
+	}
+	else
+	{
+		// Physics of the next frame overwrites satellites while the upload
+		// may still be running, so the upload reads from a copy
+		memcpy(stagedSatellites[slot], satellites, sizeof(satellite) * SATELLITE_COUNT);
+
+		// Filling satellite input buffer with satellite data
+		cl_event uploaded = NULL;
+		status = clEnqueueWriteBuffer(queue, satelliteDataBuffer[slot], CL_FALSE,
+			0, SATELLITE_COUNT * sizeof(satellite), stagedSatellites[slot], 0, NULL,
+			TRACE_EVENT(&uploaded));
+		if (status != CL_SUCCESS)
+		{
+			printf("Error while feeding data into satellite buffer to the kernel\n");
+			return;
+		}
+		traceCommand(uploaded, "upload satellites", TRACK_QUEUE);
+
+		// Sorting the satellites into the grid, which covers the window and
+		// every satellite
+		long long gridStart = nowNanoseconds();
+		if (!satelliteGridBuild(grid, &stagedSatellites[slot][0].position.x,
+			&stagedSatellites[slot][0].position.y, sizeof(satellite) / sizeof(float),
+			SATELLITE_COUNT, 0.f, 0.f, WINDOW_WIDTH - 1, WINDOW_HEIGHT - 1,
+			2.0f * SATELLITE_RADIUS))
+		{
+			printf("Cannot allocate the satellite grid\n");
+			exit(1);
+		}
+		traceHostSpan(TRACK_RENDER, "grid build", gridStart);
+		cl_event gridUploaded = NULL;
+		status = clEnqueueWriteBuffer(queue, cellStartBuffer[slot], CL_FALSE, 0,
+			(grid->columns * grid->rows + 1) * sizeof(int),
+			grid->cellStart, 0, NULL, NULL);
+		status |= clEnqueueWriteBuffer(queue, cellSatelliteBuffer[slot], CL_FALSE, 0,
+			SATELLITE_COUNT * sizeof(int), grid->cellSatellites, 0, NULL,
+			TRACE_EVENT(&gridUploaded));
+		traceCommand(gridUploaded, "upload grid", TRACK_QUEUE);
+		status |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &satelliteDataBuffer[slot]);
+		status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &cellStartBuffer[slot]);
+		status |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &cellSatelliteBuffer[slot]);
+	}
+	status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &pixelOut[slot]);
+	status |= clSetKernelArg(kernel, 4, sizeof(float), &grid->originX);
+	status |= clSetKernelArg(kernel, 5, sizeof(float), &grid->originY);
+	status |= clSetKernelArg(kernel, 6, sizeof(float), &grid->cellSize);
+	status |= clSetKernelArg(kernel, 7, sizeof(int), &grid->columns);
+	status |= clSetKernelArg(kernel, 8, sizeof(int), &grid->rows);
+
+	// Checked frames read back float colors, the others the chosen format
+	int format = frameNumber < 2 ? PIXEL_FLOAT : pixelFormat;
+	status |= clSetKernelArg(kernel, 9, sizeof(int), &format);
+
+	// The tiles --incremental keeps, none without it
+	int keptTileSize = 0;
+	if (incrementalThreshold > 0.f)
+	{
+		chooseKeptTiles(slot, format);
+		keptTileSize = tileSize;
+	}
+	status |= clSetKernelArg(kernel, 10, sizeof(cl_mem),
+		keptTileSize ? &keptTileBuffer[slot] : NULL);
+	status |= clSetKernelArg(kernel, 11, sizeof(int), &keptTileSize);
 	if (status != CL_SUCCESS)
 	{
-		printf("Error while feeding data into satellite buffer to the kernel\n");
+		printf("Error while feeding the satellite grid to the kernel\n");
 		return;
 	}
 	
+	if (!workGroupTuned)
+	{
+		tuneWorkGroup();
+	}
+
 	// Define an index space (global work size) of work 
-	// items for execution. A workgroup size (local work size) 
-	// is not required, but can be used.
-	size_t globalWorkSize[] = { WINDOW_WIDTH, WINDOW_HEIGHT };
-	size_t localWorkSize[] = { 16, 16 };
+	// items for execution. The kernel stages satellites per work group,
+	// so the workgroup size (local work size) is always given. The global
+	// size is rounded up to whole work groups, the kernel skips the items
+	// outside the window.
+	size_t globalWorkSize[2];
+	shadingGlobalSize(workGroupShape, globalWorkSize);
+
+	// A mapped pixel buffer goes back to the device before the kernel
+	// writes it again
+	if (pixelsMapped[slot])
+	{
+		cl_event unmapped = NULL;
+		status = clEnqueueUnmapMemObject(queue, pixelOut[slot], hostPixels[slot],
+			1, &readDone[slot], TRACE_EVENT(&unmapped));
+		if (status != CL_SUCCESS)
+		{
+			printf("Error while unmapping the pixels\n");
+			return;
+		}
+		traceCommand(unmapped, "unmap pixels", TRACK_QUEUE);
+		pixelsMapped[slot] = 0;
+	}
 
 	/* Enqueue kernel */
 	status = clEnqueueNDRangeKernel(queue, kernel, 2, 0,
-		globalWorkSize, localWorkSize, 0, NULL, NULL);
+		globalWorkSize, workGroupShape, readDone[slot] ? 1 : 0,
+		readDone[slot] ? &readDone[slot] : NULL, &kernelDone[slot]);
 
 	if (status != CL_SUCCESS)
 	{
 		printf("Error while executing kernel\n");
 		return;
 	}
-	
-	status = clFinish(queue);
+	traceSharedCommand(kernelDone[slot], "shade kernel", TRACK_QUEUE);
+	if (readDone[slot])
+	{
+		clReleaseEvent(readDone[slot]);
+		readDone[slot] = NULL;
+	}
 
+	// Read device output buffer to the host pixel array, or map it in place
+	if (zeroCopyPixels)
+	{
+		hostPixels[slot] = (color*)clEnqueueMapBuffer(readQueue, pixelOut[slot], CL_FALSE,
+			CL_MAP_READ, 0, SIZE * sizeof(color), 1, &kernelDone[slot], &readDone[slot],
+			&status);
+		pixelsMapped[slot] = status == CL_SUCCESS;
+	}
+	else
+	{
+		status = clEnqueueReadBuffer(readQueue, pixelOut[slot], CL_FALSE, 0,
+			SIZE * pixelFormatBytes(format),
+			format == PIXEL_FLOAT ? (void*)hostPixels[slot] : (void*)packedPixels[slot],
+			1, &kernelDone[slot], &readDone[slot]);
+	}
+	slotPacked[slot] = format != PIXEL_FLOAT;
 	if (status != CL_SUCCESS)
 	{
-		printf("Error clFinish is called\n");
+		printf("Error while reading the pixels\n");
 		return;
 	}
+	traceSharedCommand(readDone[slot], zeroCopyPixels ? "map pixels" : "read pixels",
+		TRACK_READ_QUEUE);
+	clFlush(queue);
+	clFlush(readQueue);
+	renderedFrames++;
+
+	// Checked frames and the synchronous mode show the frame just rendered.
+	// The asynchronous mode shows the previous one and leaves this one in
+	// flight during the next frame's physics.
+	int shown = slot;
+	if (asyncFrames && frameNumber >= 2 && readDone[previous])
+	{
+		shown = previous;
+	}
+	long long waitStart = nowNanoseconds();
+	status = clWaitForEvents(1, &readDone[shown]);
+	readbackWaitTime += nowNanoseconds() - waitStart;
+	if (status != CL_SUCCESS)
+	{
+		printf("Error while waiting for the pixels\n");
+		return;
+	}
+	pixels = hostPixels[shown];
+	traceHostSpan(TRACK_RENDER, "readback wait", waitStart);
+	if (frameNumber < 2 && pixelFormat != PIXEL_FLOAT)
+	{
+		renderPackedCheck(slot, globalWorkSize);
+	}
+	unsigned int shownFrame = shown == slot ? frameNumber : frameNumber - 1;
+	if (recordPath && (long long)shownFrame > lastRecordedFrame)
+	{
+		frameRecorderSubmit(&recorder, shownFrame,
+			pixelFormat == PIXEL_FLOAT ? (void*)hostPixels[shown] : (void*)packedPixels[shown]);
+		lastRecordedFrame = shownFrame;
+	}
+#ifndef HEADLESS
+	// render() draws float colors
+	if (slotPacked[shown])
+	{
+		pixelFormatUnpack(pixelFormat, packedPixels[shown], &pixels[0].red, SIZE);
+	}
+#endif
 
-	// Read device output buffer to the host pixel array
-	clEnqueueReadBuffer(queue, pixelOut, CL_TRUE, 0,
-		SIZE * sizeof(color), pixels, 0, NULL, NULL);
-
+	// Everything up to the shown frame is done
+	traceFlush(renderedFrames - (shown == slot ? 1 : 2));
 }
 
 // ## You may add your own destrcution routines here ##
 void destroy() {
+	// Wait for the frames in flight and unmap the pixels
+	clFinish(queue);
+	clFinish(readQueue);
+	for (int slot = 0; slot < RENDER_SLOTS; ++slot)
+	{
+		if (pixelsMapped[slot])
+		{
+			clEnqueueUnmapMemObject(queue, pixelOut[slot], hostPixels[slot], 0, NULL, NULL);
+		}
+	}
+	clFinish(queue);
+	checkPackedPixels();
+	if (trace.file)
+	{
+		traceFlush((unsigned int)-1);
+		chromeTraceClose(&trace);
+		printf("Trace written to %s\n", traceFileName);
+	}
+	free(traceCommands);
+	frameRecorderClose(&recorder);
+	if (renderedFrames > 0)
+	{
+		printf("Host waited %.3f ms per frame for pixel readbacks\n",
+			readbackWaitTime / 1e6 / renderedFrames);
+	}
+
+	// Split renderers, with the average band and time of each
+	for (int i = 0; i < splitRendererCount; ++i)
+	{
+		splitRenderer* r = &splitRenderers[i];
+		if (renderedFrames > 0)
+		{
+			printf("%s: %.1f%% of the rows, %.3f ms per frame\n", r->name,
+				100.0 * r->shareSum / renderedFrames, r->timeSum / 1e6 / renderedFrames);
+		}
+		if (r->device)
+		{
+			clReleaseKernel(r->kernel);
+			clReleaseProgram(r->program);
+			clReleaseCommandQueue(r->queue);
+			clReleaseMemObject(r->satellites);
+			clReleaseMemObject(r->cellStart);
+			clReleaseMemObject(r->cellSatellites);
+			clReleaseMemObject(r->pixels);
+			clReleaseContext(r->context);
+		}
+	}
+	free(splitRenderers);
+
 	// Free OpenCL resources
 	clReleaseKernel(kernel);
 	clReleaseProgram(program);
 	clReleaseCommandQueue(queue);
-	clReleaseMemObject(satelliteDataBuffer);
+	clReleaseCommandQueue(readQueue);
+	for (int slot = 0; slot < RENDER_SLOTS; ++slot)
+	{
+		if (kernelDone[slot]) clReleaseEvent(kernelDone[slot]);
+		if (readDone[slot]) clReleaseEvent(readDone[slot]);
+		clReleaseMemObject(satelliteDataBuffer[slot]);
+		clReleaseMemObject(pixelOut[slot]);
+		clReleaseMemObject(cellStartBuffer[slot]);
+		clReleaseMemObject(cellSatelliteBuffer[slot]);
+		satelliteGridFree(&renderGrid[slot]);
+		free(stagedSatellites[slot]);
+	}
+	// fixedDestroy frees the pixel buffer of fixedInit
+	pixels = fixedPixels;
+	if (!zeroCopyPixels)
+	{
+		free(hostPixels[1]);
+	}
+	for (int slot = 0; slot < RENDER_SLOTS; ++slot)
+	{
+		free(packedPixels[slot]);
+	}
+	if (incrementalThreshold > 0.f)
+	{
+		if (tilesDecided > 0)
+		{
+			printf("Incremental rendering reused %.1f%% of the tiles\n",
+				100.0 * tilesKept / tilesDecided);
+		}
+		for (int slot = 0; slot < RENDER_SLOTS; ++slot)
+		{
+			clReleaseMemObject(keptTileBuffer[slot]);
+			free(slotTileFrame[slot]);
+			free(slotTileSamples[slot]);
+			free(keptTiles[slot]);
+		}
+		free(tileStableFrom);
+		free(previousSatellites);
+	}
 	clReleaseMemObject(pixelDataBuffer);
+	if (devicePhysics)
+	{
+		clReleaseKernel(physicsKernel);
+		clReleaseMemObject(deviceSatellites);
+		clReleaseMemObject(wholeCellStart);
+		clReleaseMemObject(wholeCellSatellites);
+	}
 	clReleaseContext(context);
+	taskPoolDestroy(&enginePool);
     free(device);
     free(program);
 }
@@ -480,8 +2037,8 @@ void sequentialPhysicsEngine(satellite *s){
 
    // double precision required for accumulation inside this routine,
    // but float storage is ok outside these loops.
-   doublevector tmpPosition[SATELLITE_COUNT];
-   doublevector tmpVelocity[SATELLITE_COUNT];
+   doublevector* tmpPosition = (doublevector*)malloc(sizeof(doublevector) * SATELLITE_COUNT);
+   doublevector* tmpVelocity = (doublevector*)malloc(sizeof(doublevector) * SATELLITE_COUNT);
 
    for (int i = 0; i < SATELLITE_COUNT; ++i) {
        tmpPosition[i].x = s[i].position.x;
@@ -537,13 +2094,15 @@ void sequentialPhysicsEngine(satellite *s){
        s[i].velocity.x = tmpVelocity[i].x;
        s[i].velocity.y = tmpVelocity[i].y;
    }
+   free(tmpPosition);
+   free(tmpVelocity);
 }
 
 // Just some value that barely passes for OpenCL example program
 #define ALLOWED_FP_ERROR 0.08
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
 void errorCheck(){
-   for(unsigned int i=0; i < SIZE; ++i) {
+   for(unsigned int i=0; i < PIXEL_COUNT; ++i) {
       if(fabs(correctPixels[i].red - pixels[i].red) > ALLOWED_FP_ERROR ||
          fabs(correctPixels[i].green - pixels[i].green) > ALLOWED_FP_ERROR ||
          fabs(correctPixels[i].blue - pixels[i].blue) > ALLOWED_FP_ERROR) {
@@ -555,11 +2114,207 @@ void errorCheck(){
    printf("Error check passed!\n");
 }
 
-int totalTimeAcc, satelliteMovementAcc, pixelColoringAcc, frameCount;
+long long totalTimeAcc, satelliteMovementAcc, pixelColoringAcc;
+int frameCount;
+
+// Every measured frame, summarized as percentiles at exit
+frameTimings frameStats;
+
+// Headless builds render directly from compute()
+void render(void);
+
+// Runs verifyFrames frames of the chosen engines, each checked against the
+// sequential engines, see verifyreport.h. The physics of a frame is
+// compared with sequentialPhysicsEngine from the same satellites, and with
+// an independent sequential trajectory for the drift over the run. The
+// pixels are compared with sequentialGraphicsEngine on the same satellites.
+// Returns the exit status.
+static int verifyEngines(int frames){
+   satellite* trajectory = (satellite*)malloc(sizeof(satellite) * SATELLITE_COUNT);
+   // Tolerance of every pixel, see --incremental below
+   float* tolerances = incrementalThreshold > 0.f ? (float*)malloc(sizeof(float) * SIZE) : NULL;
+   if(!trajectory || (incrementalThreshold > 0.f && !tolerances)){
+      printf("Cannot allocate the verification buffers\n");
+      free(trajectory);
+      free(tolerances);
+      return 1;
+   }
+   memcpy(trajectory, satellites, sizeof(satellite) * SATELLITE_COUNT);
+   int stride = sizeof(satellite) / sizeof(float);
+
+   // Packed frames round once more. The tiles --incremental kept are
+   // checked against its threshold instead, so a change it missed fails.
+   float rounding = pixelFormat != PIXEL_FLOAT ? PACKED_PIXEL_ERROR - ALLOWED_FP_ERROR : 0.f;
+   float tolerance = ALLOWED_FP_ERROR + rounding;
+
+   long long failedPixels = 0, largestUlp = 0;
+   int failedFrames = 0;
+   double maxError = 0.0, errorSum = 0.0;
+   for(int frame = 0; frame < frames; ++frame){
+      memcpy(backupSatelites, satellites, sizeof(satellite) * SATELLITE_COUNT);
+      parallelPhysicsEngine();
+      sequentialPhysicsEngine(backupSatelites);
+      sequentialPhysicsEngine(trajectory);
+
+      int worst = 0, mismatches = 0;
+      long long ulp = floatRecordsUlpDistance(&satellites[0].position.x,
+                                              &backupSatelites[0].position.x,
+                                              SATELLITE_COUNT, stride, 4, &worst);
+      long long drift = floatRecordsUlpDistance(&satellites[0].position.x,
+                                                &trajectory[0].position.x,
+                                                SATELLITE_COUNT, stride, 4, NULL);
+      for(int i = 0; i < SATELLITE_COUNT; ++i){
+         if(memcmp(&satellites[i], &backupSatelites[i], sizeof(satellite))){
+            printf("frame %u satellite %i: position %.9g %.9g velocity %.9g %.9g, "
+                   "expected %.9g %.9g %.9g %.9g\n", frameNumber, i,
+                   satellites[i].position.x, satellites[i].position.y,
+                   satellites[i].velocity.x, satellites[i].velocity.y,
+                   backupSatelites[i].position.x, backupSatelites[i].position.y,
+                   backupSatelites[i].velocity.x, backupSatelites[i].velocity.y);
+            mismatches++;
+         }
+      }
+      largestUlp = ulp > largestUlp ? ulp : largestUlp;
+
+      parallelGraphicsEngine();
+      sequentialGraphicsEngine();
+      int shown = (renderedFrames + RENDER_SLOTS - 1) % RENDER_SLOTS;
+      int packed = !splitRendering && slotPacked[shown];
+      int kept = !tolerances ? 0 :
+                 tileFillTolerances(tolerances, keptTiles[shown], tileColumns, tileRows,
+                                    tileSize, WINDOW_WIDTH, WINDOW_HEIGHT, tolerance,
+                                    incrementalThreshold + rounding);
+      pixelErrors errors;
+      verifyPixelsWithin(frameNumber, packed ? pixelFormat : PIXEL_FLOAT,
+                         packed ? (const void*)packedPixels[shown] : (const void*)pixels,
+                         &correctPixels[0].red, SIZE, WINDOW_WIDTH, tolerance, tolerances,
+                         &errors);
+      printf("Verify frame %u: physics %lld ulp (satellite %i), %i mismatches, "
+             "drift %lld ulp; pixels max error %.6f, mean %.8f, %lld over %.4f",
+             frameNumber, ulp, worst, mismatches, drift, errors.maxError,
+             errors.errorSum / (SIZE), errors.failing, tolerance);
+      if(tolerances){
+         printf(" (%.4f in the %i kept tiles)", incrementalThreshold + rounding, kept);
+      }
+      printf("\n");
+
+      failedPixels += errors.failing;
+      failedFrames += mismatches > 0 || errors.failing > 0;
+      maxError = errors.maxError > maxError || errors.maxError != errors.maxError ?
+                 errors.maxError : maxError;
+      errorSum += errors.errorSum;
+      frameNumber++;
+   }
+   free(trajectory);
+   free(tolerances);
+
+   printf("Verification %s: %i of %i frames failed, %lld failing pixels, "
+          "physics up to %lld ulp, pixels max error %.6f, mean %.8f\n",
+          failedFrames ? "FAILED" : "passed", failedFrames, frames, failedPixels,
+          largestUlp, maxError, frames > 0 ? errorSum / (SIZE) / frames : 0.0);
+   return failedFrames ? 1 : 0;
+}
+
+// Times runs calls of engine after warmup untimed ones into samples. The
+// device physics only enqueues, so the queue is drained inside the timing.
+static void benchEngine(void (*engine)(void), long long* samples){
+   for(int run = 0; run < benchWarmup + benchRuns; ++run){
+      long long start = nowNanoseconds();
+      engine();
+      clFinish(queue);
+      if(run >= benchWarmup){
+         samples[run - benchWarmup] = nowNanoseconds() - start;
+      }
+   }
+}
+
+// Device time of runs launches of a kernel with its current arguments
+static void benchKernel(cl_kernel k, cl_uint dimensions, const size_t* global,
+                        const size_t* local, long long* samples){
+   for(int run = 0; run < benchWarmup + benchRuns; ++run){
+      cl_event done = NULL;
+      status = clEnqueueNDRangeKernel(queue, k, dimensions, NULL, global, local,
+                                      0, NULL, &done);
+      if(status != CL_SUCCESS){
+         printf("Error while executing the kernel\n");
+         exit(1);
+      }
+      clWaitForEvents(1, &done);
+      cl_ulong start = 0, end = 0;
+      clGetEventProfilingInfo(done, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+      clGetEventProfilingInfo(done, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+      clReleaseEvent(done);
+      if(run >= benchWarmup){
+         samples[run - benchWarmup] = (long long)(end - start);
+      }
+   }
+}
+
+// Times parallelPhysicsEngine and parallelGraphicsEngine on the host clock
+// and the physics and shading kernels on the device clock, a row for each.
+// The frame number is past the checked frames, so the engines run as they
+// do in the timed frames of compute(). Returns the exit status.
+static int benchmarkEngines(void){
+   FILE* file = benchOpen(benchOutput, benchFormat);
+   long long* samples = (long long*)malloc(sizeof(long long) * benchRuns);
+   if(!file || !samples){
+      printf("Cannot write the benchmark rows\n");
+      return 1;
+   }
+   benchNotes(stderr);
+   frameNumber = 2;
+
+   char variant[160];
+   snprintf(variant, sizeof(variant), "%s%s%s%s %s", devicePhysics ? "device-physics" :
+            "host-physics", splitRendering ? " split" : "", zeroCopyPixels ? " zero-copy" : "",
+            asyncFrames ? " async" : "", pixelFormatName(pixelFormat));
+   benchRow row = {"opencl", "physics", variant, benchLabel, SATELLITE_COUNT,
+                   WINDOW_WIDTH, WINDOW_HEIGHT, enginePool.threads, PHYSICSUPDATESPERFRAME,
+                   benchWarmup, benchRuns, (double)SATELLITE_COUNT * PHYSICSUPDATESPERFRAME,
+                   "satellite-steps/s"};
+   benchEngine(parallelPhysicsEngine, samples);
+   benchWriteRow(file, benchFormat, &row, samples);
+
+   row.engine = "graphics";
+   row.work = (double)WINDOW_WIDTH * WINDOW_HEIGHT;
+   row.unit = "pixels/s";
+   benchEngine(parallelGraphicsEngine, samples);
+   benchWriteRow(file, benchFormat, &row, samples);
+
+   if(!splitRendering){
+      // The kernel keeps the arguments of the last frame. Its pixel buffer
+      // goes back to the device first if it is mapped.
+      clFinish(readQueue);
+      int slot = (renderedFrames + RENDER_SLOTS - 1) % RENDER_SLOTS;
+      if(pixelsMapped[slot]){
+         clEnqueueUnmapMemObject(queue, pixelOut[slot], hostPixels[slot], 0, NULL, NULL);
+         pixelsMapped[slot] = 0;
+      }
+      size_t globalWorkSize[2];
+      shadingGlobalSize(workGroupShape, globalWorkSize);
+      row.engine = "shade kernel";
+      benchKernel(kernel, 2, globalWorkSize, workGroupShape, samples);
+      benchWriteRow(file, benchFormat, &row, samples);
+   }
+   if(devicePhysics){
+      size_t globalWorkSize = SATELLITE_COUNT;
+      row.engine = "physics kernel";
+      row.work = (double)SATELLITE_COUNT * PHYSICSUPDATESPERFRAME;
+      row.unit = "satellite-steps/s";
+      benchKernel(physicsKernel, 1, &globalWorkSize, NULL, samples);
+      benchWriteRow(file, benchFormat, &row, samples);
+   }
+
+   free(samples);
+   if(file != stdout){
+      fclose(file);
+   }
+   return 0;
+}
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
 void compute(void){
-   int timeSinceStart = glutGet(GLUT_ELAPSED_TIME);
+   long long timeSinceStart = nowNanoseconds();
 
    // Error check during first frames
    if (frameNumber < 2) {
@@ -576,16 +2331,16 @@ void compute(void){
       }
    }
 
-   int satelliteMovementMoment = glutGet(GLUT_ELAPSED_TIME);
-   int satelliteMovementTime = satelliteMovementMoment  - timeSinceStart;
+   long long satelliteMovementMoment = nowNanoseconds();
+   long long satelliteMovementTime = satelliteMovementMoment  - timeSinceStart;
 
    // Decides the colors for the pixels
    parallelGraphicsEngine();
 
-   int pixelColoringMoment = glutGet(GLUT_ELAPSED_TIME);
-   int pixelColoringTime =  pixelColoringMoment - satelliteMovementMoment;
+   long long pixelColoringMoment = nowNanoseconds();
+   long long pixelColoringTime =  pixelColoringMoment - satelliteMovementMoment;
 
-   int finishTime = glutGet(GLUT_ELAPSED_TIME);
+   long long finishTime = nowNanoseconds();
    // Sequential code is used to check possible errors in the parallel version
    if(frameNumber < 2){
       sequentialGraphicsEngine();
@@ -595,22 +2350,28 @@ void compute(void){
       printf("Time spent on moving satellites + Time spent on space coloring = Total time in milliseconds between frames (might not equal the sum of the left-hand expression)\n");
    } else if (frameNumber > 2) {
      // Print timings
-     int totalTime = finishTime - previousFinishTime;
+     long long totalTime = finishTime - previousFinishTime;
      previousFinishTime = finishTime;
 
-     printf("Latency of this frame %i + %i = %ims \n",
-             satelliteMovementTime, pixelColoringTime, totalTime);
+     printf("Latency of this frame %.3f + %.3f = %.3fms \n",
+             satelliteMovementTime / 1e6, pixelColoringTime / 1e6, totalTime / 1e6);
 
      frameCount++;
      totalTimeAcc += totalTime;
      satelliteMovementAcc += satelliteMovementTime;
      pixelColoringAcc += pixelColoringTime;
-     printf("Averaged over all frames: %i + %i = %ims.\n",
-             satelliteMovementAcc/frameCount, pixelColoringAcc/frameCount, totalTimeAcc/frameCount);
+     frameTimingsRecord(&frameStats, satelliteMovementTime, pixelColoringTime, totalTime);
+     printf("Averaged over all frames: %.3f + %.3f = %.3fms.\n",
+             satelliteMovementAcc / 1e6 / frameCount, pixelColoringAcc / 1e6 / frameCount,
+             totalTimeAcc / 1e6 / frameCount);
 
    }
    // Render the frame
+#ifndef HEADLESS
    glutPostRedisplay();
+#else
+   render();
+#endif
 }
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
@@ -683,6 +2444,9 @@ void fixedDestroy(void){
    free(correctPixels);
    free(satellites);
 
+   frameTimingsPrint(&frameStats);
+   frameTimingsFree(&frameStats);
+
    if(seed != 0){
      printf("Used seed: %i\n", seed);
    }
@@ -690,22 +2454,172 @@ void fixedDestroy(void){
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
 // Renders pixels-buffer to the window 
+// In headless builds only the frame counter advances
 void render(void){
+#ifndef HEADLESS
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
    glDrawPixels(WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGB, GL_FLOAT, pixels);
    glutSwapBuffers();
+#endif
    frameNumber++;
 }
 
+// Number of frames a headless run computes unless --frames is given
+#define HEADLESS_DEFAULT_FRAMES 100
+
+// Reads "--name value" with a positive integer value. Returns 1 if argv[*i]
+// was the named option, advancing *i past its value.
+static int intOption(int argc, char** argv, int* i, const char* name, int* value){
+   if(strcmp(argv[*i], name) != 0){
+      return 0;
+   }
+   if(*i + 1 >= argc || atoi(argv[*i + 1]) <= 0){
+      printf("%s needs a positive integer value\n", name);
+      exit(1);
+   }
+   *value = atoi(argv[++*i]);
+   return 1;
+}
+
+// Reads "--name value" with a positive real value, see intOption
+static int floatOption(int argc, char** argv, int* i, const char* name, float* value){
+   if(strcmp(argv[*i], name) != 0){
+      return 0;
+   }
+   if(*i + 1 >= argc || !(atof(argv[*i + 1]) > 0.0)){
+      printf("%s needs a positive value\n", name);
+      exit(1);
+   }
+   *value = (float)atof(argv[++*i]);
+   return 1;
+}
+
+// Command line: [seed] [--frames N] [--satellites N] [--width N]
+//               [--height N] [--substeps N] [--threads N] [--no-pin]
+//               [--async] [--zero-copy|--copy-pixels] [--host-physics]
+//               [--retune] [--tune-cache FILE]
+//               [--program-cache DIR] [--no-program-cache]
+//               [--split-devices] [--split-no-host] [--trace FILE]
+//               [--pixel-format float|rgba8|half] [--verify N]
+//               [--incremental T] [--refresh K] [--tile N]
+//               [--bench N] [--bench-warmup N] [--bench-format csv|json]
+//               [--bench-output FILE] [--bench-label TEXT]
+//               [--record FILE|-] [--record-format rgb8|chunked]
+//               [--record-slots N] [--record-lossless]
+static void parseArguments(int argc, char** argv, int* frames){
+   // Frames recorded to stdout need it before the first line of output
+   for(int i = 1; i + 1 < argc; ++i){
+      if(strcmp(argv[i], "--record") == 0 && strcmp(argv[i + 1], "-") == 0){
+         frameRecorderClaimStdout();
+      }
+   }
+   for(int i = 1; i < argc; ++i){
+      if(intOption(argc, argv, &i, "--frames", frames) ||
+         intOption(argc, argv, &i, "--satellites", &satelliteCount) ||
+         intOption(argc, argv, &i, "--width", &windowWidth) ||
+         intOption(argc, argv, &i, "--height", &windowHeight) ||
+         intOption(argc, argv, &i, "--substeps", &physicsUpdatesPerFrame) ||
+         intOption(argc, argv, &i, "--threads", &engineThreads) ||
+         intOption(argc, argv, &i, "--verify", &verifyFrames) ||
+         intOption(argc, argv, &i, "--bench", &benchRuns) ||
+         intOption(argc, argv, &i, "--bench-warmup", &benchWarmup) ||
+         intOption(argc, argv, &i, "--record-slots", &recordSlots) ||
+         intOption(argc, argv, &i, "--refresh", &refreshFrames) ||
+         intOption(argc, argv, &i, "--tile", &tileSize) ||
+         floatOption(argc, argv, &i, "--incremental", &incrementalThreshold)){
+         continue;
+      } else if(strcmp(argv[i], "--async") == 0){
+         asyncFrames = 1;
+      } else if(strcmp(argv[i], "--retune") == 0){
+         retuneWorkGroup = 1;
+      } else if(strcmp(argv[i], "--tune-cache") == 0 && i + 1 < argc){
+         tuneCacheFile = argv[++i];
+      } else if(strcmp(argv[i], "--program-cache") == 0 && i + 1 < argc){
+         binaryCacheDirectory = argv[++i];
+      } else if(strcmp(argv[i], "--no-program-cache") == 0){
+         useBinaryCache = 0;
+      } else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc){
+         traceFileName = argv[++i];
+      } else if(strcmp(argv[i], "--split-devices") == 0){
+         splitRendering = 1;
+      } else if(strcmp(argv[i], "--split-no-host") == 0){
+         splitRendering = 1;
+         splitHost = 0;
+      } else if(strcmp(argv[i], "--host-physics") == 0){
+         devicePhysics = 0;
+      } else if(strcmp(argv[i], "--zero-copy") == 0){
+         zeroCopyPixels = 1;
+      } else if(strcmp(argv[i], "--copy-pixels") == 0){
+         zeroCopyPixels = 0;
+      } else if(strcmp(argv[i], "--bench-format") == 0 && i + 1 < argc){
+         benchFormat = strcmp(argv[++i], "json") == 0 ? BENCH_JSON : BENCH_CSV;
+      } else if(strcmp(argv[i], "--bench-output") == 0 && i + 1 < argc){
+         benchOutput = argv[++i];
+      } else if(strcmp(argv[i], "--bench-label") == 0 && i + 1 < argc){
+         benchLabel = argv[++i];
+      } else if(strcmp(argv[i], "--pixel-format") == 0 && i + 1 < argc){
+         pixelFormat = pixelFormatParse(argv[++i]);
+         if(pixelFormat < 0){
+            printf("--pixel-format is float, rgba8 or half\n");
+            exit(1);
+         }
+      } else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc){
+         recordPath = argv[++i];
+      } else if(strcmp(argv[i], "--record-format") == 0 && i + 1 < argc){
+         recordContainer = frameRecorderContainerParse(argv[++i]);
+         if(recordContainer < 0){
+            printf("--record-format is rgb8 or chunked\n");
+            exit(1);
+         }
+      } else if(strcmp(argv[i], "--record-lossless") == 0){
+         recordLossless = 1;
+      } else if(strcmp(argv[i], "--no-pin") == 0){
+         pinThreads = 0;
+      } else if(argv[i][0] != '-'){
+         seed = atoi(argv[i]);
+         printf("Using seed: %i\n", seed);
+      } else {
+         printf("Unknown option: %s\n", argv[i]);
+         exit(1);
+      }
+   }
+}
+
 // DO NOT EDIT THIS FUNCTION
 // Inits glut and start mainloop
 int main(int argc, char** argv){
 
-   if(argc > 1){
-     seed = atoi(argv[1]);
-     printf("Using seed: %i\n", seed);
+   int frames = HEADLESS_DEFAULT_FRAMES;
+   parseArguments(argc, argv, &frames);
+
+   // The verification runs without a window in every build
+   if(verifyFrames > 0){
+      atexit(fixedDestroy);
+      fixedInit(seed);
+      init();
+      exit(verifyEngines(verifyFrames));
+   }
+   if(benchRuns > 0){
+      atexit(fixedDestroy);
+      fixedInit(seed);
+      init();
+      exit(benchmarkEngines());
    }
 
+#ifdef HEADLESS
+   // Without a seed srand() is never called, so rand() starts from its
+   // default state and every headless run sees the same satellites.
+   atexit(fixedDestroy);
+   fixedInit(seed);
+   init();
+
+   for(int frame = 0; frame < frames; ++frame){
+      compute();
+   }
+   return 0;
+#else
+   (void)frames;
+
    // Init glut window
    glutInit(&argc, argv);
    glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
@@ -723,4 +2637,5 @@ int main(int argc, char** argv){
 
    // Start main loop
    glutMainLoop();
+#endif
 }
@@ -0,0 +1,304 @@
+/* Scaling sweeps over the --bench mode of parallel.c and OpenCL_modified.c
+
+   Runs the program once for every combination of the satellite counts,
+   resolutions, thread counts and substep counts given, each time with
+   --bench, and gathers the rows (see benchreport.h) into one CSV table or
+   one JSON array. Lists are comma separated; a list that is not given
+   leaves the option to the program's default.
+
+   Strong scaling keeps the problem and sweeps --threads. With --weak the
+   satellite counts are per thread, so every thread count gets the same
+   work per thread.
+
+   Rows of two builds taken with the same sweep can be diffed to catch
+   regressions. The frequency notes of benchNotes() go to stderr.
+*/
+
+// Example compilation: gcc -o benchmark benchmark.c -std=c99 -O2 -lm
+// Example use:
+//    ./benchmark --program ./parallel --satellites 64,256,1024 --threads 1,2,4,8
+//                --sizes 640x480,1280x720 --reps 10 --output scaling.csv -- --pipeline
+
+// mkstemp, clock_gettime, getline, fork and waitpid with -std=c99
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "benchreport.h"
+
+#define MAX_VALUES 64
+// Words of a run besides the program options after --, and the numbers
+// among them
+#define RUN_WORDS 32
+#define RUN_NUMBERS 8
+
+typedef struct{
+   int values[MAX_VALUES];
+   int count;
+} valueList;
+
+// Parses "1,2,4" into list. Returns 0 if an entry is not a positive integer.
+static int parseList(const char* text, valueList* list){
+   list->count = 0;
+   while(*text){
+      char* end;
+      long value = strtol(text, &end, 10);
+      if(end == text || value <= 0 || list->count == MAX_VALUES ||
+         (*end != ',' && *end != '\0')){
+         return 0;
+      }
+      list->values[list->count++] = (int)value;
+      text = *end ? end + 1 : end;
+   }
+   return list->count > 0;
+}
+
+// Parses "640x480,1280x720" into widths and heights
+static int parseSizes(const char* text, valueList* widths, valueList* heights){
+   widths->count = heights->count = 0;
+   while(*text){
+      char* end;
+      long width = strtol(text, &end, 10);
+      if(end == text || width <= 0 || *end != 'x' || widths->count == MAX_VALUES){
+         return 0;
+      }
+      text = end + 1;
+      long height = strtol(text, &end, 10);
+      if(end == text || height <= 0 || (*end != ',' && *end != '\0')){
+         return 0;
+      }
+      widths->values[widths->count++] = (int)width;
+      heights->values[heights->count++] = (int)height;
+      text = *end ? end + 1 : end;
+   }
+   return widths->count > 0;
+}
+
+// Arguments of one run. They go to execvp as they are, so nothing needs
+// quoting and no argument is cut short.
+typedef struct{
+   const char** words;
+   int count;
+   char numbers[RUN_NUMBERS][16];
+   int numberCount;
+} runArguments;
+
+static void appendWord(runArguments* run, const char* word){
+   run->words[run->count++] = word;
+   run->words[run->count] = NULL;
+}
+
+// Appends "--name value" unless value is 0, the program default
+static void appendOption(runArguments* run, const char* name, int value){
+   if(value > 0){
+      char* text = run->numbers[run->numberCount++];
+      snprintf(text, sizeof(run->numbers[0]), "%d", value);
+      appendWord(run, name);
+      appendWord(run, text);
+   }
+}
+
+// Runs the program with its output discarded. Returns its exit status, -1
+// if it did not run or did not exit.
+static int runProgram(const runArguments* run){
+   pid_t child = fork();
+   if(child < 0){
+      return -1;
+   }
+   if(child == 0){
+      int null = open("/dev/null", O_WRONLY);
+      if(null >= 0){
+         dup2(null, STDOUT_FILENO);
+         dup2(null, STDERR_FILENO);
+         close(null);
+      }
+      execvp(run->words[0], (char* const*)run->words);
+      _exit(127);
+   }
+   int status;
+   if(waitpid(child, &status, 0) != child){
+      return -1;
+   }
+   return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Copies the rows of one run from rows to output. Only the first CSV header
+// is kept, and JSON objects are joined into one array. Returns the number
+// of rows.
+static int collectRows(FILE* rows, FILE* output, int format, int* written){
+   char* line = NULL;
+   size_t capacity = 0;
+   int count = 0;
+   while(getline(&line, &capacity, rows) >= 0){
+      line[strcspn(line, "\n")] = '\0';
+      if(line[0] == '\0' || (format == BENCH_CSV && strncmp(line, "program,", 8) == 0)){
+         continue;
+      }
+      if(format == BENCH_JSON){
+         fprintf(output, "%s  %s", *written ? ",\n" : "[\n", line);
+      } else {
+         if(*written == 0){
+            fprintf(output, BENCH_CSV_HEADER);
+         }
+         fprintf(output, "%s\n", line);
+      }
+      ++*written;
+      ++count;
+   }
+   free(line);
+   return count;
+}
+
+// Command line: --program PATH [--satellites LIST] [--sizes WxH,...]
+//               [--threads LIST] [--substeps LIST] [--reps N] [--warmup N]
+//               [--weak] [--format csv|json] [--output FILE] [--label TEXT]
+//               [-- program options...]
+int main(int argc, char** argv){
+   const char* program = "./parallel";
+   const char* outputPath = NULL;
+   const char* label = NULL;
+   int format = BENCH_CSV;
+   int reps = 10;
+   int warmup = BENCH_DEFAULT_WARMUP;
+   int weak = 0;
+   // A single 0 leaves the option out
+   valueList satellites = {{0}, 1}, widths = {{0}, 1}, heights = {{0}, 1};
+   valueList threads = {{0}, 1}, substeps = {{0}, 1};
+   int extraArguments = argc;
+
+   for(int i = 1; i < argc; ++i){
+      int valid = 1;
+      if(strcmp(argv[i], "--") == 0){
+         extraArguments = i + 1;
+         break;
+      } else if(strcmp(argv[i], "--weak") == 0){
+         weak = 1;
+      } else if(i + 1 >= argc){
+         valid = 0;
+      } else if(strcmp(argv[i], "--program") == 0){
+         program = argv[++i];
+      } else if(strcmp(argv[i], "--satellites") == 0){
+         valid = parseList(argv[++i], &satellites);
+      } else if(strcmp(argv[i], "--sizes") == 0){
+         valid = parseSizes(argv[++i], &widths, &heights);
+      } else if(strcmp(argv[i], "--threads") == 0){
+         valid = parseList(argv[++i], &threads);
+      } else if(strcmp(argv[i], "--substeps") == 0){
+         valid = parseList(argv[++i], &substeps);
+      } else if(strcmp(argv[i], "--reps") == 0){
+         reps = atoi(argv[++i]);
+         valid = reps > 0;
+      } else if(strcmp(argv[i], "--warmup") == 0){
+         warmup = atoi(argv[++i]);
+         valid = warmup > 0;
+      } else if(strcmp(argv[i], "--format") == 0){
+         format = strcmp(argv[++i], "json") == 0 ? BENCH_JSON : BENCH_CSV;
+      } else if(strcmp(argv[i], "--output") == 0){
+         outputPath = argv[++i];
+      } else if(strcmp(argv[i], "--label") == 0){
+         label = argv[++i];
+      } else {
+         valid = 0;
+      }
+      if(!valid){
+         printf("Invalid option: %s\n", argv[i]);
+         exit(1);
+      }
+   }
+   if(weak && satellites.values[0] == 0){
+      printf("--weak needs --satellites, the count per thread\n");
+      exit(1);
+   }
+   if(weak && threads.values[0] == 0){
+      printf("--weak needs --threads\n");
+      exit(1);
+   }
+
+   FILE* output = outputPath ? fopen(outputPath, "w") : stdout;
+   runArguments run;
+   run.words = (const char**)malloc(sizeof(char*) * (argc - extraArguments + RUN_WORDS));
+   if(!run.words){
+      printf("Cannot allocate the run arguments\n");
+      exit(1);
+   }
+   if(!output){
+      printf("Cannot create %s\n", outputPath);
+      exit(1);
+   }
+   benchNotes(stderr);
+
+   int written = 0, failed = 0, runs = 0;
+   for(int s = 0; s < satellites.count; ++s){
+      for(int r = 0; r < widths.count; ++r){
+         for(int t = 0; t < threads.count; ++t){
+            for(int u = 0; u < substeps.count; ++u){
+               char rowsPath[] = "/tmp/benchmark-XXXXXX";
+               int descriptor = mkstemp(rowsPath);
+               if(descriptor < 0){
+                  printf("Cannot create a temporary file\n");
+                  exit(1);
+               }
+               close(descriptor);
+
+               int satelliteCount = satellites.values[s];
+               if(weak){
+                  satelliteCount *= threads.values[t];
+               }
+               run.count = run.numberCount = 0;
+               appendWord(&run, program);
+               appendOption(&run, "--bench", reps);
+               appendOption(&run, "--bench-warmup", warmup);
+               appendWord(&run, "--bench-format");
+               appendWord(&run, format == BENCH_JSON ? "json" : "csv");
+               appendWord(&run, "--bench-output");
+               appendWord(&run, rowsPath);
+               if(label){
+                  appendWord(&run, "--bench-label");
+                  appendWord(&run, label);
+               }
+               appendOption(&run, "--satellites", satelliteCount);
+               appendOption(&run, "--width", widths.values[r]);
+               appendOption(&run, "--height", heights.values[r]);
+               appendOption(&run, "--threads", threads.values[t]);
+               appendOption(&run, "--substeps", substeps.values[u]);
+               for(int i = extraArguments; i < argc; ++i){
+                  appendWord(&run, argv[i]);
+               }
+
+               ++runs;
+               int status = runProgram(&run);
+               FILE* rows = fopen(rowsPath, "r");
+               int count = rows ? collectRows(rows, output, format, &written) : 0;
+               if(rows){
+                  fclose(rows);
+               }
+               remove(rowsPath);
+               if(status != 0 || count == 0){
+                  ++failed;
+                  fprintf(stderr, "failed:");
+                  for(int w = 0; w < run.count; ++w){
+                     fprintf(stderr, " %s", run.words[w]);
+                  }
+                  fprintf(stderr, "\n");
+               }
+               fflush(output);
+            }
+         }
+      }
+   }
+   if(format == BENCH_JSON){
+      fprintf(output, written ? "\n]\n" : "[]\n");
+   }
+   if(output != stdout){
+      fclose(output);
+   }
+   free(run.words);
+   fprintf(stderr, "%d of %d runs succeeded, %d rows\n", runs - failed, runs, written);
+   return failed ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+/* Benchmark rows shared by parallel.c, OpenCL_modified.c and benchmark.c
+
+   --bench N makes either program time its engines in isolation: after
+   --bench-warmup runs (default BENCH_DEFAULT_WARMUP) every engine is timed
+   N times and summarized as one row. Rows are CSV with a header line, or
+   with --bench-format json one JSON object per line. --bench-output FILE
+   appends the rows to a file instead of stdout, which is how benchmark.c
+   collects the rows of a sweep.
+
+   Frequency scaling and turbo make single runs noisy. benchNotes() points
+   out what the machine reports, so that the numbers of two builds are
+   taken under the same conditions.
+*/
+
+#ifndef BENCHREPORT_H
+#define BENCHREPORT_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frametiming.h"
+
+#define BENCH_DEFAULT_WARMUP 3
+
+enum { BENCH_CSV, BENCH_JSON };
+
+// One engine of one configuration. Times are nanoseconds.
+typedef struct{
+   const char* program;
+   const char* engine;
+   const char* variant;
+   const char* label;
+   int satellites;
+   int width;
+   int height;
+   int threads;
+   int substeps;
+   int warmup;
+   int runs;
+   // Work done per run and its unit, for the throughput column
+   double work;
+   const char* unit;
+} benchRow;
+
+#define BENCH_CSV_HEADER "program,engine,variant,label,satellites,width,height,threads," \
+   "substeps,warmup,runs,min_ms,median_ms,mean_ms,max_ms,stddev_ms,throughput,unit\n"
+
+// Writes text as a JSON string, quotes included
+static inline void benchWriteJsonString(FILE* file, const char* text){
+   fputc('"', file);
+   for(; *text; ++text){
+      unsigned char c = (unsigned char)*text;
+      if(c == '"' || c == '\\'){
+         fprintf(file, "\\%c", c);
+      } else if(c < 0x20){
+         fprintf(file, "\\u%04x", c);
+      } else {
+         fputc(c, file);
+      }
+   }
+   fputc('"', file);
+}
+
+// Writes text as a CSV field, quoted if it holds a comma, quote or newline
+static inline void benchWriteCsvField(FILE* file, const char* text){
+   if(!strpbrk(text, ",\"\r\n")){
+      fputs(text, file);
+      return;
+   }
+   fputc('"', file);
+   for(; *text; ++text){
+      if(*text == '"'){
+         fputc('"', file);
+      }
+      fputc(*text, file);
+   }
+   fputc('"', file);
+}
+
+// Summarizes the samples of a row and writes it. Sorts samples in place.
+static inline void benchWriteRow(FILE* file, int format, const benchRow* row,
+                                 long long* samples){
+   int count = row->runs;
+   qsort(samples, count, sizeof(long long), compareLongLong);
+   double sum = 0.0, squares = 0.0;
+   for(int i = 0; i < count; ++i){
+      sum += samples[i];
+   }
+   double mean = count ? sum / count : 0.0;
+   for(int i = 0; i < count; ++i){
+      squares += (samples[i] - mean) * (samples[i] - mean);
+   }
+   double stddev = count > 1 ? sqrt(squares / (count - 1)) : 0.0;
+   double median = !count ? 0.0 : count % 2 ? samples[count / 2] :
+                   (samples[count / 2 - 1] + samples[count / 2]) / 2.0;
+   double throughput = median > 0.0 ? row->work / (median / 1e9) : 0.0;
+   const char* text[] = {row->program, row->engine, row->variant,
+                         row->label ? row->label : ""};
+   const char* names[] = {"program", "engine", "variant", "label"};
+   // The strings can come from the command line and are escaped
+   for(int i = 0; i < 4; ++i){
+      if(format == BENCH_JSON){
+         fprintf(file, i ? ", \"%s\": " : "{\"%s\": ", names[i]);
+         benchWriteJsonString(file, text[i]);
+      } else {
+         if(i){
+            fputc(',', file);
+         }
+         benchWriteCsvField(file, text[i]);
+      }
+   }
+   if(format == BENCH_JSON){
+      fprintf(file, ", \"satellites\": %d, \"width\": %d, \"height\": %d, "
+              "\"threads\": %d, \"substeps\": %d, \"warmup\": %d, \"runs\": %d, "
+              "\"min_ms\": %.6f, \"median_ms\": %.6f, \"mean_ms\": %.6f, \"max_ms\": %.6f, "
+              "\"stddev_ms\": %.6f, \"throughput\": %.6g, \"unit\": \"%s\"}\n",
+              row->satellites, row->width, row->height, row->threads, row->substeps,
+              row->warmup, count, count ? samples[0] / 1e6 : 0.0, median / 1e6, mean / 1e6,
+              count ? samples[count - 1] / 1e6 : 0.0, stddev / 1e6, throughput, row->unit);
+   } else {
+      fprintf(file, ",%d,%d,%d,%d,%d,%d,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.6g,%s\n",
+              row->satellites, row->width, row->height, row->threads, row->substeps,
+              row->warmup, count, count ? samples[0] / 1e6 : 0.0, median / 1e6, mean / 1e6,
+              count ? samples[count - 1] / 1e6 : 0.0, stddev / 1e6, throughput, row->unit);
+   }
+}
+
+// Opens the file the rows go to, stdout without a path. New or empty CSV
+// files get the header line first.
+static inline FILE* benchOpen(const char* path, int format){
+   FILE* file = path ? fopen(path, "a") : stdout;
+   if(!file){
+      return NULL;
+   }
+   fseek(file, 0, SEEK_END);
+   if(format == BENCH_CSV && (!path || ftell(file) == 0)){
+      fprintf(file, BENCH_CSV_HEADER);
+   }
+   return file;
+}
+
+// Reads the first line of a small system file into text, 0 if there is none
+static inline int benchReadLine(const char* path, char* text, int size){
+   FILE* file = fopen(path, "r");
+   if(!file){
+      return 0;
+   }
+   int found = fgets(text, size, file) != NULL;
+   fclose(file);
+   text[strcspn(text, "\n")] = '\0';
+   return found;
+}
+
+// Notes on the CPU frequency settings that make timings wander
+static inline void benchNotes(FILE* file){
+   char text[64];
+   if(benchReadLine("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor",
+                    text, sizeof(text)) && strcmp(text, "performance") != 0){
+      fprintf(file, "note: the CPU frequency governor is %s, 'cpupower frequency-set "
+              "-g performance' keeps the clock fixed\n", text);
+   }
+   if(benchReadLine("/sys/devices/system/cpu/intel_pstate/no_turbo", text, sizeof(text)) &&
+      strcmp(text, "0") == 0){
+      fprintf(file, "note: turbo is on, writing 1 to "
+              "/sys/devices/system/cpu/intel_pstate/no_turbo turns it off\n");
+   }
+   if(benchReadLine("/sys/devices/system/cpu/cpufreq/boost", text, sizeof(text)) &&
+      strcmp(text, "1") == 0){
+      fprintf(file, "note: frequency boost is on, writing 0 to "
+              "/sys/devices/system/cpu/cpufreq/boost turns it off\n");
+   }
+}
+
+#endif
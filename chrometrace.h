@@ -0,0 +1,76 @@
+/* Chrome trace export
+
+   Writes complete events ("ph": "X") in the Trace Event Format, which
+   chrome://tracing and Perfetto load. Times are nowNanoseconds() values
+   (frametiming.h); they are written in microseconds since the trace was
+   opened. Every track is a thread of process 1 and can be given a name.
+
+   Events go to the file as they are added, so a long run keeps nothing in
+   memory. The file is only valid JSON once chromeTraceClose() has run.
+*/
+
+#ifndef CHROMETRACE_H
+#define CHROMETRACE_H
+
+#include <stdio.h>
+
+#include "frametiming.h"
+
+typedef struct{
+   FILE* file;
+   long long origin;
+   int events;
+} chromeTrace;
+
+// Returns 0 if the file cannot be created
+static inline int chromeTraceOpen(chromeTrace* trace, const char* path){
+   trace->file = fopen(path, "w");
+   if(!trace->file){
+      return 0;
+   }
+   trace->origin = nowNanoseconds();
+   trace->events = 0;
+   fprintf(trace->file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+   return 1;
+}
+
+static inline void chromeTraceSeparator(chromeTrace* trace){
+   if(trace->events++ > 0){
+      fprintf(trace->file, ",\n");
+   }
+}
+
+static inline void chromeTraceTrackName(chromeTrace* trace, int track, const char* name){
+   if(!trace->file){
+      return;
+   }
+   chromeTraceSeparator(trace);
+   fprintf(trace->file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d,"
+           " \"args\": {\"name\": \"%s\"}}", track, name);
+}
+
+// A span from start to end on a track. args is the body of a JSON object
+// ("\"key\": value, ...") or NULL.
+static inline void chromeTraceSpan(chromeTrace* trace, int track, const char* name,
+                                   const char* category, long long start, long long end,
+                                   const char* args){
+   if(!trace->file){
+      return;
+   }
+   chromeTraceSeparator(trace);
+   fprintf(trace->file, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1,"
+           " \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {%s}}",
+           name, category, track, (start - trace->origin) / 1e3,
+           (end > start ? end - start : 0) / 1e3, args ? args : "");
+}
+
+static inline void chromeTraceClose(chromeTrace* trace){
+   if(!trace->file){
+      return;
+   }
+   fprintf(trace->file, "\n]}\n");
+   fclose(trace->file);
+   trace->file = NULL;
+}
+
+#endif
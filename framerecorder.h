@@ -0,0 +1,349 @@
+/* Background recording of rendered frames shared by parallel.c and
+   OpenCL_modified.c
+
+   frameRecorderSubmit() copies a frame into one of a few preallocated
+   slots and returns; a writer thread converts and writes the slots in
+   order. When every slot is still waiting, the frame is dropped and
+   counted instead of stalling the frame loop, unless the recorder was
+   opened lossless.
+
+   Two containers:
+
+   - RECORD_RGB8: raw 8 bit RGB, top row first, nothing else. ffmpeg reads
+     it with -f rawvideo -pix_fmt rgb24 -s WIDTHxHEIGHT -i FILE.
+   - RECORD_CHUNKED: a 32 byte file header ("SATREC1" and a zero byte,
+     then width, height, pixel format of pixelformat.h, bytes per pixel
+     and two zero words), then for every frame a 16 byte chunk header
+     ("FRME", frame number, payload bytes, a zero word) and the pixels as
+     rendered, bottom row first. Words are 32 bit in host byte order. The
+     frames keep the rendered format, so rgba8 and half are compact and
+     float is exact.
+
+   The path "-" records to stdout. The program's own output then goes to
+   stderr, from the moment frameRecorderClaimStdout() runs.
+
+   Writes are batched through one large staging buffer. Regular files are
+   opened with O_DIRECT where the file system allows it, so a long
+   recording does not fill the page cache. The flag is dropped for the
+   unaligned tail of the recording.
+
+   Needs -pthread.
+*/
+
+#ifndef FRAMERECORDER_H
+#define FRAMERECORDER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pixelformat.h"
+
+enum { RECORD_RGB8, RECORD_CHUNKED };
+
+#define RECORD_DEFAULT_SLOTS 8
+// Staging buffer size and the alignment O_DIRECT wants
+#define RECORD_STAGING_BYTES (8 << 20)
+#define RECORD_ALIGNMENT 4096
+
+typedef struct{
+   int fd;
+   int container;
+   int format;
+   int width;
+   int height;
+   int lossless;
+   int direct;
+   size_t frameBytes;
+
+   // Ring of slots: the writer owns [head, head + ready), the producer the rest
+   int slotCount;
+   unsigned char** slots;
+   unsigned int* slotFrames;
+   int head;
+   int ready;
+   int stop;
+   pthread_mutex_t lock;
+   pthread_cond_t work;
+   pthread_cond_t space;
+   pthread_t writer;
+   int started;
+
+   // Used by the writer thread only
+   unsigned char* staging;
+   size_t staged;
+   unsigned char* converted;
+   int failed;
+
+   long long written;
+   long long dropped;
+   long long bytes;
+} frameRecorder;
+
+// Descriptor of the original stdout once it is claimed for the frames
+static int frameRecorderStdout = -1;
+
+// Keeps stdout for the frames and sends printf and friends to stderr. Call
+// it before the first line of output when recording to "-".
+static inline int frameRecorderClaimStdout(void){
+   if(frameRecorderStdout < 0){
+      fflush(stdout);
+      frameRecorderStdout = dup(STDOUT_FILENO);
+      if(frameRecorderStdout >= 0){
+         dup2(STDERR_FILENO, STDOUT_FILENO);
+      }
+   }
+   return frameRecorderStdout;
+}
+
+static inline const char* frameRecorderContainerName(int container){
+   return container == RECORD_CHUNKED ? "chunked" : "rgb8";
+}
+
+// Container of a name given on the command line, -1 if there is none
+static inline int frameRecorderContainerParse(const char* name){
+   if(strcmp(name, "rgb8") == 0) return RECORD_RGB8;
+   if(strcmp(name, "chunked") == 0) return RECORD_CHUNKED;
+   return -1;
+}
+
+// Writes size bytes. An O_DIRECT file that refuses the write is written
+// through the page cache from then on.
+static inline int frameRecorderWriteAll(frameRecorder* r, const unsigned char* data, size_t size){
+   while(size > 0){
+      ssize_t done = write(r->fd, data, size);
+      if(done < 0 && errno == EINTR){
+         continue;
+      }
+#ifdef O_DIRECT
+      if(done < 0 && errno == EINVAL && r->direct){
+         fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_DIRECT);
+         r->direct = 0;
+         continue;
+      }
+#endif
+      if(done <= 0){
+         return 0;
+      }
+      data += done;
+      size -= (size_t)done;
+      r->bytes += done;
+   }
+   return 1;
+}
+
+// Moves whole staging buffers to the file
+static inline void frameRecorderStage(frameRecorder* r, const void* data, size_t size){
+   const unsigned char* bytes = (const unsigned char*)data;
+   while(size > 0 && !r->failed){
+      size_t room = RECORD_STAGING_BYTES - r->staged;
+      size_t part = size < room ? size : room;
+      memcpy(r->staging + r->staged, bytes, part);
+      r->staged += part;
+      bytes += part;
+      size -= part;
+      if(r->staged == RECORD_STAGING_BYTES){
+         r->failed = !frameRecorderWriteAll(r, r->staging, r->staged);
+         r->staged = 0;
+      }
+   }
+}
+
+static inline void frameRecorderStageFrame(frameRecorder* r, unsigned int frame,
+                                           const unsigned char* pixels){
+   if(r->container == RECORD_CHUNKED){
+      uint32_t header[4] = {0, frame, (uint32_t)r->frameBytes, 0};
+      memcpy(header, "FRME", 4);
+      frameRecorderStage(r, header, sizeof(header));
+      frameRecorderStage(r, pixels, r->frameBytes);
+      return;
+   }
+   // Rendered rows go bottom up, video top down
+   unsigned char* out = r->converted;
+   for(int y = r->height - 1; y >= 0; --y){
+      for(int x = 0; x < r->width; ++x){
+         float red, green, blue;
+         pixelFormatLoad(r->format, pixels, (size_t)y * r->width + x, &red, &green, &blue);
+         *out++ = pixelToUnorm8(red);
+         *out++ = pixelToUnorm8(green);
+         *out++ = pixelToUnorm8(blue);
+      }
+   }
+   frameRecorderStage(r, r->converted, (size_t)r->width * r->height * 3);
+}
+
+static inline void* frameRecorderMain(void* argument){
+   frameRecorder* r = (frameRecorder*)argument;
+   pthread_mutex_lock(&r->lock);
+   for(;;){
+      while(r->ready == 0 && !r->stop){
+         pthread_cond_wait(&r->work, &r->lock);
+      }
+      if(r->ready == 0){
+         break;
+      }
+      // Every slot that is ready goes out before the producer hears of it
+      int head = r->head, count = r->ready;
+      pthread_mutex_unlock(&r->lock);
+      for(int k = 0; k < count; ++k){
+         int slot = (head + k) % r->slotCount;
+         frameRecorderStageFrame(r, r->slotFrames[slot], r->slots[slot]);
+      }
+      pthread_mutex_lock(&r->lock);
+      r->head = (head + count) % r->slotCount;
+      r->ready -= count;
+      r->written += count;
+      pthread_cond_signal(&r->space);
+   }
+   pthread_mutex_unlock(&r->lock);
+
+   // The tail is not a whole number of blocks
+#ifdef O_DIRECT
+   if(r->direct){
+      fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_DIRECT);
+      r->direct = 0;
+   }
+#endif
+   if(r->staged > 0 && !r->failed){
+      r->failed = !frameRecorderWriteAll(r, r->staging, r->staged);
+   }
+   return NULL;
+}
+
+static inline void* frameRecorderAllocate(size_t size){
+   void* memory = NULL;
+   return posix_memalign(&memory, RECORD_ALIGNMENT, size) == 0 ? memory : NULL;
+}
+
+// Starts recording frames of width x height pixels stored in format to
+// path. Returns 0 and prints why if that is not possible.
+static inline int frameRecorderOpen(frameRecorder* r, const char* path, int container, int format,
+                                    int width, int height, int slots, int lossless){
+   memset(r, 0, sizeof(*r));
+   r->container = container;
+   r->format = format;
+   r->width = width;
+   r->height = height;
+   r->lossless = lossless;
+   r->slotCount = slots > 0 ? slots : RECORD_DEFAULT_SLOTS;
+   r->frameBytes = pixelFormatBytes(format) * width * height;
+
+   if(strcmp(path, "-") == 0){
+      int fd = frameRecorderClaimStdout();
+      r->fd = fd >= 0 ? dup(fd) : -1;
+   } else {
+      r->fd = -1;
+#ifdef O_DIRECT
+      r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+      struct stat info;
+      r->direct = r->fd >= 0 && fstat(r->fd, &info) == 0 && S_ISREG(info.st_mode);
+      if(r->fd >= 0 && !r->direct){
+         close(r->fd);
+         r->fd = -1;
+      }
+#endif
+      if(r->fd < 0){
+         r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      }
+   }
+   if(r->fd < 0){
+      printf("Cannot record to %s: %s\n", path, strerror(errno));
+      return 0;
+   }
+
+   r->slots = (unsigned char**)calloc(r->slotCount, sizeof(unsigned char*));
+   r->slotFrames = (unsigned int*)calloc(r->slotCount, sizeof(unsigned int));
+   r->staging = (unsigned char*)frameRecorderAllocate(RECORD_STAGING_BYTES);
+   r->converted = (unsigned char*)malloc((size_t)width * height * 3);
+   int allocated = r->slots && r->slotFrames && r->staging && r->converted;
+   for(int s = 0; allocated && s < r->slotCount; ++s){
+      r->slots[s] = (unsigned char*)frameRecorderAllocate(r->frameBytes);
+      allocated = r->slots[s] != NULL;
+   }
+   if(!allocated){
+      printf("Cannot allocate %i recording slots of %zu bytes\n", r->slotCount, r->frameBytes);
+      return 0;
+   }
+
+   if(container == RECORD_CHUNKED){
+      uint32_t header[8] = {0, 0, (uint32_t)width, (uint32_t)height, (uint32_t)format,
+                            (uint32_t)pixelFormatBytes(format), 0, 0};
+      memcpy(header, "SATREC1", 8);
+      frameRecorderStage(r, header, sizeof(header));
+   }
+
+   pthread_mutex_init(&r->lock, NULL);
+   pthread_cond_init(&r->work, NULL);
+   pthread_cond_init(&r->space, NULL);
+   if(pthread_create(&r->writer, NULL, frameRecorderMain, r) != 0){
+      printf("Cannot start the recording thread\n");
+      return 0;
+   }
+   r->started = 1;
+   return 1;
+}
+
+// Queues a copy of the frame's pixels. Returns 0 if it was dropped because
+// every slot was busy.
+static inline int frameRecorderSubmit(frameRecorder* r, unsigned int frame, const void* pixels){
+   pthread_mutex_lock(&r->lock);
+   while(r->lossless && r->ready == r->slotCount){
+      pthread_cond_wait(&r->space, &r->lock);
+   }
+   if(r->ready == r->slotCount){
+      r->dropped++;
+      pthread_mutex_unlock(&r->lock);
+      return 0;
+   }
+   int slot = (r->head + r->ready) % r->slotCount;
+   pthread_mutex_unlock(&r->lock);
+
+   // The slot is the producer's until ready counts it
+   memcpy(r->slots[slot], pixels, r->frameBytes);
+   r->slotFrames[slot] = frame;
+
+   pthread_mutex_lock(&r->lock);
+   r->ready++;
+   pthread_cond_signal(&r->work);
+   pthread_mutex_unlock(&r->lock);
+   return 1;
+}
+
+// Writes the queued frames, closes the file and prints what was recorded
+static inline void frameRecorderClose(frameRecorder* r){
+   if(!r->slots){
+      return;
+   }
+   if(r->started){
+      pthread_mutex_lock(&r->lock);
+      r->stop = 1;
+      pthread_cond_signal(&r->work);
+      pthread_mutex_unlock(&r->lock);
+      pthread_join(r->writer, NULL);
+      pthread_mutex_destroy(&r->lock);
+      pthread_cond_destroy(&r->work);
+      pthread_cond_destroy(&r->space);
+      printf("Recorded %lld frames (%s, %s), %lld dropped, %.1f MB%s\n", r->written,
+             frameRecorderContainerName(r->container), pixelFormatName(r->format),
+             r->dropped, r->bytes / 1e6, r->failed ? ", write failed" : "");
+   }
+   if(r->fd >= 0){
+      close(r->fd);
+   }
+   for(int s = 0; s < r->slotCount; ++s){
+      free(r->slots[s]);
+   }
+   free(r->slots);
+   free(r->slotFrames);
+   free(r->staging);
+   free(r->converted);
+   memset(r, 0, sizeof(*r));
+}
+
+#endif
@@ -0,0 +1,110 @@
+/* Frame timing helpers shared by parallel.c and OpenCL_modified.c
+
+   The original frame loop measured time with glutGet(GLUT_ELAPSED_TIME),
+   which has millisecond resolution and needs an open window. These helpers
+   use the monotonic clock instead and keep every frame so that latency
+   percentiles can be reported at the end of a run.
+
+   The including file must define _POSIX_C_SOURCE (199309L or later) before
+   its first system include for clock_gettime to be available with -std=c99.
+*/
+
+#ifndef FRAMETIMING_H
+#define FRAMETIMING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Monotonic clock in nanoseconds
+static inline long long nowNanoseconds(void){
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Phase timings of every measured frame, in nanoseconds
+typedef struct{
+   long long* physics;
+   long long* graphics;
+   long long* total;
+   int count;
+   int capacity;
+} frameTimings;
+
+static inline void frameTimingsRecord(frameTimings* t, long long physics,
+                               long long graphics, long long total){
+   if(t->count == t->capacity){
+      int capacity = t->capacity ? t->capacity * 2 : 256;
+      long long* p = (long long*)realloc(t->physics, sizeof(long long) * capacity);
+      if(p) t->physics = p;
+      long long* g = (long long*)realloc(t->graphics, sizeof(long long) * capacity);
+      if(g) t->graphics = g;
+      long long* f = (long long*)realloc(t->total, sizeof(long long) * capacity);
+      if(f) t->total = f;
+      if(!p || !g || !f){
+         return;
+      }
+      t->capacity = capacity;
+   }
+   t->physics[t->count] = physics;
+   t->graphics[t->count] = graphics;
+   t->total[t->count] = total;
+   t->count++;
+}
+
+static inline int compareLongLong(const void* a, const void* b){
+   long long x = *(const long long*)a;
+   long long y = *(const long long*)b;
+   return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of an already sorted array
+static inline long long sortedPercentile(const long long* sorted, int count, int percent){
+   int rank = (percent * count + 99) / 100;
+   if(rank < 1) rank = 1;
+   return sorted[rank - 1];
+}
+
+static inline void printPhasePercentiles(const char* name, const long long* samples,
+                                  int count){
+   long long* sorted = (long long*)malloc(sizeof(long long) * count);
+   if(!sorted){
+      return;
+   }
+   memcpy(sorted, samples, sizeof(long long) * count);
+   qsort(sorted, count, sizeof(long long), compareLongLong);
+
+   long long sum = 0;
+   for(int i = 0; i < count; ++i){
+      sum += sorted[i];
+   }
+   printf("%-9s mean %9.3f  p50 %9.3f  p95 %9.3f  p99 %9.3f  max %9.3f ms\n",
+          name, sum / 1e6 / count,
+          sortedPercentile(sorted, count, 50) / 1e6,
+          sortedPercentile(sorted, count, 95) / 1e6,
+          sortedPercentile(sorted, count, 99) / 1e6,
+          sorted[count - 1] / 1e6);
+   free(sorted);
+}
+
+// Prints the latency distribution of all recorded frames
+static inline void frameTimingsPrint(const frameTimings* t){
+   if(t->count == 0){
+      return;
+   }
+   printf("Latency summary over %i frames:\n", t->count);
+   printPhasePercentiles("physics", t->physics, t->count);
+   printPhasePercentiles("graphics", t->graphics, t->count);
+   printPhasePercentiles("frame", t->total, t->count);
+}
+
+static inline void frameTimingsFree(frameTimings* t){
+   free(t->physics);
+   free(t->graphics);
+   free(t->total);
+   memset(t, 0, sizeof(*t));
+}
+
+#endif
@@ -18,12 +18,23 @@ VERSION 20.0 - relax physic correctness check
 // prev and OpenMP:   gcc -o parallel parallel.c -std=c99 -lglut -lGL -lm -O2 -ftree-vectorize -fopt-info-vec -ffast-math -fopenmp
 // prev and OpenCL:   gcc -o parallel parallel.c -std=c99 -lglut -lGL -lm -O2 -ftree-vectorize -fopt-info-vec -ffast-math -fopenmp -lOpenCL
 
+// headless (no GLUT, no X display): gcc -o parallel parallel.c -std=c99 -lm -O2 -pthread -DHEADLESS
+// The engines run on the thread pool of taskpool.h, so every build also needs -pthread.
+// Both builds take [seed] [--satellites N] [--width N] [--height N] [--substeps N],
+// headless builds also [--frames N].
+
 // Example compilation on macos X
 // no optimization:   gcc -o parallel parallel.c -std=c99 -framework GLUT -framework OpenGL
 // most optimization: gcc -o parallel parallel.c -std=c99 -framework GLUT -framework OpenGL -O3
 
 
 
+// clock_gettime for the frame timings, CPU affinity for the thread pool
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #endif
@@ -34,6 +45,7 @@ VERSION 20.0 - relax physic correctness check
 #include <stdatomic.h>
 
 // Window handling includes
+#ifndef HEADLESS
 #ifndef __APPLE__
 #include <GL/gl.h>
 #include <GL/glut.h>
@@ -41,28 +53,62 @@ VERSION 20.0 - relax physic correctness check
 #include <OpenGL/gl.h>
 #include <GLUT/glut.h>
 #endif
-// These are used to decide the window size
-#define WINDOW_HEIGHT 80
-#define WINDOW_WIDTH  80
+#endif
+
+
+// The SIMD engine kernels are compiled with target attributes and picked
+// at runtime, so no -mavx2 or similar flag is needed
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#include "frametiming.h"
+#include "satellitegrid.h"
+#include "satellitequadtree.h"
+#include "satelliteorbit.h"
+#include "taskpool.h"
+#include "pixelformat.h"
+#include "verifyreport.h"
+#include "benchreport.h"
+#include "perfcounters.h"
+#include "framerecorder.h"
+#include "snapshot.h"
+#include "tilereuse.h"
+
+// These are used to decide the window size.
+// They can be changed at runtime with --width and --height.
+#define DEFAULT_WINDOW_HEIGHT 80
+#define DEFAULT_WINDOW_WIDTH  80
+int windowHeight = DEFAULT_WINDOW_HEIGHT;
+int windowWidth = DEFAULT_WINDOW_WIDTH;
+#define WINDOW_HEIGHT windowHeight
+#define WINDOW_WIDTH  windowWidth
 
 // The number of satellites can be changed to see how it affects performance.
 // Benchmarks must be run with the original number of satellites
-#define SATELLITE_COUNT 64
+#define DEFAULT_SATELLITE_COUNT 64
+int satelliteCount = DEFAULT_SATELLITE_COUNT;
+#define SATELLITE_COUNT satelliteCount
 
 // These are used to control the satellite movement
 #define SATELLITE_RADIUS 3.16f
 #define MAX_VELOCITY 0.1f
 #define GRAVITY 1.0f
 #define DELTATIME 32
-#define PHYSICSUPDATESPERFRAME 100000
+#define DEFAULT_PHYSICSUPDATESPERFRAME 100000
+int physicsUpdatesPerFrame = DEFAULT_PHYSICSUPDATESPERFRAME;
+#define PHYSICSUPDATESPERFRAME physicsUpdatesPerFrame
 
 // Some helpers to window size variables
 #define SIZE WINDOW_WIDTH*WINDOW_HEIGHT
+// SIZE as an unsigned count, for loops with an unsigned index
+#define PIXEL_COUNT ((unsigned int)WINDOW_WIDTH * (unsigned int)WINDOW_HEIGHT)
 #define HORIZONTAL_CENTER (WINDOW_WIDTH / 2)
 #define VERTICAL_CENTER (WINDOW_HEIGHT / 2)
 
 // Is used to find out frame times
-int previousFinishTime = 0;
+long long previousFinishTime = 0;
 unsigned int frameNumber = 0;
 unsigned int seed = 0;
 
@@ -111,50 +157,543 @@ satellite* backupSatelites;
 
 // ## You may add your own variables here ##
 
+// The physics engine integrates the satellites in blocks of this many.
+// Each block is copied to double precision arrays on the stack, which the
+// compiler knows nothing else can alias (not even errno set by sqrt), so
+// the satellite loop vectorizes as well as with the old fixed size arrays.
+#define PHYSICS_BLOCK_SIZE DEFAULT_SATELLITE_COUNT
 
+// Per-thread weight caches of the graphics engine, SATELLITE_COUNT floats
+// for every engine thread
+float* weightsCache;
+
+// Structure-of-arrays copy of the satellite state for the SIMD physics
+// integrators. The arrays are SIMD_ALIGNMENT aligned and padded to whole
+// PHYSICS_CHUNK_SIZE chunks, so the integrators have no scalar tail loops.
+typedef struct{
+   double* x;
+   double* y;
+   double* vx;
+   double* vy;
+} satelliteStateSoA;
+
+#define SIMD_ALIGNMENT 64
+#define PHYSICS_CHUNK_SIZE 16
+satelliteStateSoA physicsState;
+int physicsChunkCount;
+
+// Instruction sets of the physics integrators and pixel shaders. SIMD_AUTO
+// picks the widest one the CPU supports in init(), --simd forces one.
+typedef enum{
+   SIMD_AUTO,
+   SIMD_SCALAR,
+   SIMD_AVX2,
+   SIMD_AVX512
+} simdLevel;
+simdLevel engineSimd = SIMD_AUTO;
+
+// The SIMD integrators use the same IEEE operations in the same order as
+// sequentialPhysicsEngine and give bit-exact results. With --fast-physics
+// they instead replace sqrt and the divisions by a Newton refined
+// reciprocal square root and multiplication by DELTATIME/updates. That is
+// no longer bit-exact, so the correctness check then allows each position
+// and velocity component a relative difference of PHYSICS_TOLERANCE
+// (relative to max(1, |value|)) instead of comparing with memcmp.
+int fastPhysics = 0;
+#define PHYSICS_TOLERANCE 1e-5
+
+// Physics integrators. Euler is the PHYSICSUPDATESPERFRAME substep loop of
+// sequentialPhysicsEngine, the others follow the same orbit with the
+// propagators of satelliteorbit.h. Those are checked with PHYSICS_TOLERANCE
+// too and report their deviation from the Euler reference.
+typedef enum{
+   INTEGRATOR_EULER,
+   INTEGRATOR_VERLET,
+   INTEGRATOR_RK4,
+   INTEGRATOR_KEPLER
+} integratorKind;
+integratorKind physicsIntegrator = INTEGRATOR_EULER;
+
+// Steps per frame of the Verlet and Runge-Kutta integrators, 0 for the
+// defaults. Both stay around float rounding of the Euler reference at the
+// defaults.
+int integratorSteps = 0;
+#define DEFAULT_VERLET_STEPS 1000
+#define DEFAULT_RK4_STEPS 32
+
+// With --pipeline the physics of frame N + 1 runs into pipelineNext while
+// frame N is rendered from satellites. Both stages are one job of the
+// engine threads, so threads done with one stage steal work of the other.
+// The buffers swap at the start of every frame.
+int pipelineFrames = 0;
+int pipelinePrimed = 0;
+satellite* pipelineNext;
+
+// Structure-of-arrays copy of the satellite positions and colors, taken at
+// the start of every frame so that the SIMD shaders can broadcast them
+typedef struct{
+   float* x;
+   float* y;
+   float* red;
+   float* green;
+   float* blue;
+} satelliteRenderSoA;
+
+satelliteRenderSoA renderState;
+
+// Grid over the satellites for the hit test and the nearest satellite,
+// rebuilt every frame. The SIMD shaders test a handful of satellites faster
+// than they walk the grid, so by default they only use it from
+// GRID_SIMD_MIN_SATELLITES satellites on. --grid and --no-grid override.
+#define GRID_SIMD_MIN_SATELLITES 256
+satelliteGrid renderGrid;
+int useGrid = -1;
+
+// Opening angle of the approximate color blend, 0 for the exact blend.
+// With --blend-theta the satellites far from a pixel are blended as
+// quadtree node aggregates, see satellitequadtree.h.
+float blendTheta = 0.f;
+satelliteQuadtree blendTree;
+
+// The graphics engine renders the frame in square tiles of tileSize pixels
+// (--tile), handed out to the engine threads as separate work items. Pixels
+// next to a satellite are much cheaper than the others, so tiles balance
+// better than whole rows and keep their pixels close in the caches.
+#define DEFAULT_TILE_SIZE 32
+int tileSize = DEFAULT_TILE_SIZE;
+int tileColumns;
+int tileRows;
+
+// The SIMD shaders walk the satellites in blocks of this many over all
+// pixels of a tile. A block of renderState (10 KiB) and the sums of a
+// 32 x 32 tile (24 KiB) stay in L1/L2 together even with many satellites.
+#define TILE_SATELLITE_BLOCK 512
+
+// Per-thread sums of the SIMD tile shaders, one entry per pixel of a tile
+// and hit masks per lane group
+typedef struct{
+   float* weights;
+   float* red;
+   float* green;
+   float* blue;
+   float* shortest;
+   int* nearest;
+   unsigned int* hits;
+} tileAccumulators;
+
+tileAccumulators* tileScratch;
+
+// Time spent on every tile in the last frame and summed over all frames,
+// and the rendering time of every engine thread. Reported at exit, and
+// written as a table of microseconds per tile with --tile-costs FILE.
+long long* tileCost;
+long long* tileCostSum;
+long long* threadRenderTime;
+int tileCostFrames = 0;
+const char* tileCostFile = NULL;
+
+// With --incremental T a tile is only shaded again once its colors are
+// estimated to have changed by more than T since it was last shaded, see
+// tilereuse.h. The other tiles keep their pixels from the previous frame.
+// The checked frames and every refreshFrames-th frame (--refresh) shade
+// every tile. tileSamples holds the blend at TILE_SAMPLES points of every
+// tile when it was last shaded, previousX and previousY the satellite
+// positions of the previous frame, and tileReused marks the tiles kept
+// this frame. tileNow and tilePrevious point the tests at the satellites.
+#define DEFAULT_REFRESH_FRAMES 30
+float incrementalThreshold = 0.f;
+int refreshFrames = DEFAULT_REFRESH_FRAMES;
+int shadeEveryTile = 1;
+float* tileSamples;
+float* previousX;
+float* previousY;
+unsigned char* tileReused;
+tileSatellites tileNow;
+tileSatellites tilePrevious;
+_Atomic long long tilesReused;
+long long tilesRendered;
+
+// With --pixel-format rgba8 or half the shaders store packed pixels into
+// packedPixels (pixelformat.h) instead of the float colors. The checked
+// frames store both: errorCheck() reads the floats, and checkPackedPixels()
+// compares the packed ones with the sequential reference when the next
+// frame starts.
+int pixelFormat = PIXEL_FLOAT;
+unsigned char* packedPixels;
+int storeFloatPixels = 1;
+int storePackedPixels = 0;
+int packedCheckPending = 0;
+
+// Rendering time of a thread sits in its own cache line
+#define THREAD_TIME_STRIDE 8
+
+// Persistent worker threads of both engines, see taskpool.h. --threads
+// sets their number (default: every CPU the process may use) and --no-pin
+// leaves them unpinned.
+taskPool enginePool;
+int engineThreads = 0;
+int pinThreads = 1;
+
+// --record FILE streams every rendered frame to FILE ("-" for stdout) on a
+// background thread, see framerecorder.h. --record-format picks raw rgb8
+// or the chunked container, --record-slots the number of frames that may
+// wait for the writer, and --record-lossless waits for a free slot instead
+// of dropping the frame.
+const char* recordPath = NULL;
+int recordContainer = RECORD_RGB8;
+int recordSlots = RECORD_DEFAULT_SLOTS;
+int recordLossless = 0;
+frameRecorder recorder;
+
+// --snapshot FILE appends the state that starts every snapshotEvery-th
+// frame (--snapshot-every, default DEFAULT_SNAPSHOT_FRAMES) to a snapshot
+// file, see snapshot.h. --resume FILE continues from its last state, or
+// from the state of frame --resume-frame. --make-reference FILE keeps
+// every state of --frames frames of sequentialPhysicsEngine, which
+// --verify replays with --reference FILE instead of computing it again.
+#define DEFAULT_SNAPSHOT_FRAMES 100
+const char* snapshotPath = NULL;
+int snapshotEvery = DEFAULT_SNAPSHOT_FRAMES;
+const char* resumePath = NULL;
+int resumeFrame = -1;
+const char* makeReferencePath = NULL;
+const char* referencePath = NULL;
+snapshotWriter snapshots;
+long long lastSnapshotFrame = -1;
+
+// --perf opens the hardware counters of perfcounters.h on every engine
+// thread. Every frame prints what the physics and the rendering, or the
+// pipelined job, cost over all threads, and --perf-file FILE writes the
+// counts of every thread and phase as a table. Workers spinning for the
+// next job count towards the phase.
+enum { PERF_PHYSICS, PERF_GRAPHICS, PERF_PIPELINED, PERF_PHASES };
+int perfEnabled = 0;
+const char* perfFileName = NULL;
+FILE* perfFile;
+perfThreadCounters* perfThreads;
+// Counts of every thread when the phase began, and the counts of every
+// phase and thread (phase * threads + thread) in the current frame
+perfCounts* perfStart;
+perfCounts* perfFrame;
+int perfPhaseRan[PERF_PHASES];
+// Sums over all threads and frames, for the summary at exit
+perfCounts perfTotals[PERF_PHASES];
+int perfFrames[PERF_PHASES];
+
+static const char* perfPhaseNames[PERF_PHASES] = {"physics", "graphics", "pipelined"};
+
+// Opens the counters of every engine thread, and the table --perf-file asks for
+static void openPerfCounters(void){
+   int threads = enginePool.threads;
+   perfThreads = (perfThreadCounters*)malloc(sizeof(perfThreadCounters) * threads);
+   perfStart = (perfCounts*)malloc(sizeof(perfCounts) * threads);
+   perfFrame = (perfCounts*)calloc((size_t)PERF_PHASES * threads, sizeof(perfCounts));
+   if(!perfThreads || !perfStart || !perfFrame){
+      printf("Cannot allocate the performance counters\n");
+      exit(1);
+   }
+   int opened = 0;
+   for(int t = 0; t < threads; ++t){
+      opened += perfCountersOpen(&perfThreads[t], enginePool.tids[t]);
+   }
+   if(opened == 0){
+      printf("Cannot open hardware counters (%s), see "
+             "/proc/sys/kernel/perf_event_paranoid\n", strerror(errno));
+      perfEnabled = 0;
+      free(perfThreads);
+      free(perfStart);
+      free(perfFrame);
+      return;
+   }
+   printf("Hardware counters:");
+   for(int e = 0; e < PERF_EVENTS; ++e){
+      printf(" %s%s", perfEventName(e), perfThreads[0].fd[e] < 0 ? " (n/a)" : "");
+   }
+   printf("\n");
 
+   if(perfFileName){
+      perfFile = fopen(perfFileName, "w");
+      if(!perfFile){
+         printf("Cannot write the counters to %s\n", perfFileName);
+         exit(1);
+      }
+      fprintf(perfFile, "frame,phase,thread");
+      for(int e = 0; e < PERF_EVENTS; ++e){
+         fprintf(perfFile, ",%s", perfEventName(e));
+      }
+      fprintf(perfFile, "\n");
+   }
+}
+
+// Checks that a snapshot file holds states of this build's satellites, taken
+// with the window and substeps of this run. The black hole sits in the middle
+// of the window and the step size follows the substeps, so a state of any
+// other run would continue a different simulation.
+static int snapshotFitsRun(const snapshotHeader* header, const char* path){
+   if(header->satelliteCount != (uint32_t)SATELLITE_COUNT ||
+      header->satelliteBytes != sizeof(satellite)){
+      printf("%s holds %u satellites of %u bytes, this run has %i of %i\n", path,
+             header->satelliteCount, header->satelliteBytes, SATELLITE_COUNT,
+             (int)sizeof(satellite));
+      return 0;
+   }
+   if(header->width != (uint32_t)WINDOW_WIDTH || header->height != (uint32_t)WINDOW_HEIGHT ||
+      header->substeps != (uint32_t)PHYSICSUPDATESPERFRAME){
+      printf("%s was written by a %ux%u run with %u substeps, this one is %ix%i with %i\n",
+             path, header->width, header->height, header->substeps, WINDOW_WIDTH,
+             WINDOW_HEIGHT, PHYSICSUPDATESPERFRAME);
+      return 0;
+   }
+   return 1;
+}
+
+// Loads the satellites and the frame number of a snapshot
+static void resumeSnapshot(void){
+   snapshotFile file;
+   if(!snapshotOpen(&file, resumePath) || !snapshotFitsRun(file.header, resumePath)){
+      exit(1);
+   }
+   const snapshotRecord* record = NULL;
+   if(resumeFrame >= 0){
+      record = snapshotFind(&file, resumeFrame);
+   } else if(file.header->recordCount > 0){
+      record = snapshotRecordAt(&file, file.header->recordCount - 1);
+   }
+   if(!record || !snapshotRecordValid(&file, record)){
+      printf("%s has no valid state of frame %i\n", resumePath, resumeFrame);
+      exit(1);
+   }
+   memcpy(satellites, snapshotSatellites(record), sizeof(satellite) * SATELLITE_COUNT);
+   frameNumber = record->frame;
+   seed = file.header->seed;
+   previousFinishTime = nowNanoseconds();
+   printf("Resumed frame %u of %s (seed %u)\n", frameNumber, resumePath, seed);
+   snapshotClose(&file);
+}
+
+// Starts or continues the snapshot file with the state of the first frame
+static void openSnapshots(const char* path, unsigned int flags){
+   snapshotHeader layout = snapshotLayout(SATELLITE_COUNT, sizeof(satellite), WINDOW_WIDTH,
+                                          WINDOW_HEIGHT, PHYSICSUPDATESPERFRAME, seed, flags);
+   if(!snapshotCreate(&snapshots, path, &layout, frameNumber) ||
+      !snapshotAppend(&snapshots, frameNumber, satellites)){
+      printf("Cannot write the snapshot of frame %u to %s\n", frameNumber, path);
+      exit(1);
+   }
+   lastSnapshotFrame = frameNumber;
+}
 
 // ## You may add your own initialization routines here ##
+static double* allocateAligned(size_t count){
+   void* memory = NULL;
+   if(posix_memalign(&memory, SIMD_ALIGNMENT, sizeof(double) * count) != 0){
+      return NULL;
+   }
+   return (double*)memory;
+}
+
+static simdLevel detectSimd(void){
+#ifdef HAVE_X86_SIMD
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx512f")){
+      return SIMD_AVX512;
+   }
+   if(__builtin_cpu_supports("avx2")){
+      return SIMD_AVX2;
+   }
+#endif
+   return SIMD_SCALAR;
+}
+
 void init(){
 
+   if(resumePath){
+      resumeSnapshot();
+   }
+   if(snapshotPath){
+      openSnapshots(snapshotPath, 0);
+   }
+   if(recordPath && !frameRecorderOpen(&recorder, recordPath, recordContainer, pixelFormat,
+                                       WINDOW_WIDTH, WINDOW_HEIGHT, recordSlots,
+                                       recordLossless)){
+      exit(1);
+   }
 
-}
+   if(!taskPoolInit(&enginePool, engineThreads > 0 ? engineThreads : taskPoolCpuCount(),
+                    pinThreads)){
+      printf("Cannot start the engine threads\n");
+      exit(1);
+   }
+   printf("Engine threads: %i%s\n", enginePool.threads,
+          enginePool.pinned ? " (pinned)" : "");
+
+   weightsCache = (float*)malloc(sizeof(float) * SATELLITE_COUNT * enginePool.threads);
+   renderState.x = (float*)malloc(sizeof(float) * SATELLITE_COUNT);
+   renderState.y = (float*)malloc(sizeof(float) * SATELLITE_COUNT);
+   renderState.red = (float*)malloc(sizeof(float) * SATELLITE_COUNT);
+   renderState.green = (float*)malloc(sizeof(float) * SATELLITE_COUNT);
+   renderState.blue = (float*)malloc(sizeof(float) * SATELLITE_COUNT);
+
+   physicsChunkCount = (SATELLITE_COUNT + PHYSICS_CHUNK_SIZE - 1) / PHYSICS_CHUNK_SIZE;
+   size_t paddedCount = (size_t)physicsChunkCount * PHYSICS_CHUNK_SIZE;
+   physicsState.x = allocateAligned(paddedCount);
+   physicsState.y = allocateAligned(paddedCount);
+   physicsState.vx = allocateAligned(paddedCount);
+   physicsState.vy = allocateAligned(paddedCount);
+
+   if(!weightsCache || !physicsState.x || !physicsState.y ||
+      !physicsState.vx || !physicsState.vy || !renderState.x ||
+      !renderState.y || !renderState.red || !renderState.green ||
+      !renderState.blue){
+      printf("Cannot allocate engine buffers for %i satellites\n", SATELLITE_COUNT);
+      exit(1);
+   }
 
-// ## You are asked to make this code parallel ##
-// Physics engine loop. (This is called once a frame before graphics engine) 
-// Moves the satellites based on gravity
-// This is done multiple times in a frame because the Euler integration 
-// is not accurate enough to be done only once
-void parallelPhysicsEngine(){
+   simdLevel supported = detectSimd();
+   if(engineSimd == SIMD_AUTO){
+      engineSimd = supported;
+   } else if(engineSimd > supported){
+      printf("Requested SIMD integrator is not supported by this CPU\n");
+      exit(1);
+   }
+   if(engineSimd == SIMD_SCALAR && fastPhysics){
+      printf("--fast-physics needs a SIMD integrator, using the exact one\n");
+      fastPhysics = 0;
+   }
+   tileColumns = (WINDOW_WIDTH + tileSize - 1) / tileSize;
+   tileRows = (WINDOW_HEIGHT + tileSize - 1) / tileSize;
+   int tiles = tileColumns * tileRows;
+   tileCost = (long long*)calloc(tiles, sizeof(long long));
+   tileCostSum = (long long*)calloc(tiles, sizeof(long long));
+   threadRenderTime = (long long*)calloc((size_t)enginePool.threads * THREAD_TIME_STRIDE,
+                                         sizeof(long long));
+   tileScratch = (tileAccumulators*)calloc(enginePool.threads, sizeof(tileAccumulators));
+   if(!tileCost || !tileCostSum || !threadRenderTime || !tileScratch){
+      printf("Cannot allocate the tile buffers\n");
+      exit(1);
+   }
+   // Room for partial lane groups at the right edge of a tile.
+   // allocateAligned counts doubles.
+   size_t tilePixels = (size_t)tileSize * (tileSize + 16);
+   size_t tileDoubles = (tilePixels + 1) / 2;
+   for(int t = 0; t < enginePool.threads; ++t){
+      tileAccumulators* acc = &tileScratch[t];
+      acc->weights = (float*)allocateAligned(tileDoubles);
+      acc->red = (float*)allocateAligned(tileDoubles);
+      acc->green = (float*)allocateAligned(tileDoubles);
+      acc->blue = (float*)allocateAligned(tileDoubles);
+      acc->shortest = (float*)allocateAligned(tileDoubles);
+      acc->nearest = (int*)allocateAligned(tileDoubles);
+      acc->hits = (unsigned int*)malloc(sizeof(unsigned int) * tilePixels / 8);
+      if(!acc->weights || !acc->red || !acc->green || !acc->blue ||
+         !acc->shortest || !acc->nearest || !acc->hits){
+         printf("Cannot allocate the tile buffers\n");
+         exit(1);
+      }
+   }
+   printf("Render tiles: %i x %i pixels, %i tiles\n", tileSize, tileSize, tiles);
+
+   if(incrementalThreshold > 0.f){
+      tileSamples = (float*)malloc(sizeof(float) * 3 * TILE_SAMPLES * tiles);
+      previousX = (float*)malloc(sizeof(float) * SATELLITE_COUNT);
+      previousY = (float*)malloc(sizeof(float) * SATELLITE_COUNT);
+      tileReused = (unsigned char*)calloc(tiles, 1);
+      if(!tileSamples || !previousX || !previousY || !tileReused){
+         printf("Cannot allocate the tile buffers\n");
+         exit(1);
+      }
+      printf("Incremental rendering: tiles are shaded once they change by about %g,"
+             " all of them every %i frames\n",
+             incrementalThreshold, refreshFrames);
+   }
 
+   if(pixelFormat != PIXEL_FLOAT){
+      packedPixels = (unsigned char*)malloc(pixelFormatBytes(pixelFormat) * SIZE);
+      if(!packedPixels){
+         printf("Cannot allocate the packed pixels\n");
+         exit(1);
+      }
+      printf("Pixel format: %s, %i bytes per pixel instead of %i\n",
+             pixelFormatName(pixelFormat), (int)pixelFormatBytes(pixelFormat),
+             (int)sizeof(color));
+   }
 
+   if(pipelineFrames){
+      pipelineNext = (satellite*)malloc(sizeof(satellite) * SATELLITE_COUNT);
+      if(!pipelineNext){
+         printf("Cannot allocate the pipeline satellite buffer\n");
+         exit(1);
+      }
+      printf("Pipelined frames: physics of the next frame overlaps rendering\n");
+   }
+
+   const char* names[] = {"auto", "scalar", "AVX2", "AVX-512"};
+   printf("Engine SIMD level: %s%s\n", names[engineSimd],
+          fastPhysics ? " (fast reciprocal square root)" : "");
+
+   if(integratorSteps == 0){
+      integratorSteps = physicsIntegrator == INTEGRATOR_RK4 ?
+                        DEFAULT_RK4_STEPS : DEFAULT_VERLET_STEPS;
+   }
+   if(physicsIntegrator == INTEGRATOR_VERLET){
+      printf("Physics integrator: Verlet, %i steps per frame\n", integratorSteps);
+   } else if(physicsIntegrator == INTEGRATOR_RK4){
+      printf("Physics integrator: Runge-Kutta 4, %i steps per frame\n", integratorSteps);
+   } else if(physicsIntegrator == INTEGRATOR_KEPLER){
+      printf("Physics integrator: Kepler orbit\n");
+   }
+
+   if(useGrid < 0){
+      useGrid = engineSimd == SIMD_SCALAR ||
+                SATELLITE_COUNT >= GRID_SIMD_MIN_SATELLITES;
+   }
+   if(blendTheta > 0.f){
+      if(!useGrid){
+         printf("--blend-theta finds hits and nearest satellites in the grid\n");
+      }
+      useGrid = 1;
+      printf("Approximate color blend, opening angle %.3f\n", blendTheta);
+   }
+   printf("Satellite grid: %s\n", useGrid ? "on" : "off");
+
+   if(perfEnabled){
+      openPerfCounters();
+   }
+}
+
+// The engine loops below are written once as always inlined functions and
+// instantiated for the default sizes as well as for the generic case. With
+// the default sizes the compiler sees the same constants the old #defines
+// gave it, other sizes go through the runtime sized instance.
+#define ENGINE_KERNEL static inline __attribute__((always_inline))
+
+// Physics iteration loop for one frame of count <= PHYSICS_BLOCK_SIZE satellites
+ENGINE_KERNEL void physicsKernel(satellite* s, int count, int updates,
+                                 double horizontalCenter, double verticalCenter){
 
    // double precision required for accumulation inside this routine,
    // but float storage is ok outside these loops.
-   doublevector tmpPosition[SATELLITE_COUNT];
-   doublevector tmpVelocity[SATELLITE_COUNT];
+   doublevector tmpPosition[PHYSICS_BLOCK_SIZE];
+   doublevector tmpVelocity[PHYSICS_BLOCK_SIZE];
 
-   
-   for (int i = 0; i < SATELLITE_COUNT; ++i) {
-       tmpPosition[i].x = satellites[i].position.x;
-       tmpPosition[i].y = satellites[i].position.y;
-       tmpVelocity[i].x = satellites[i].velocity.x;
-       tmpVelocity[i].y = satellites[i].velocity.y;
+   for (int i = 0; i < count; ++i) {
+       tmpPosition[i].x = s[i].position.x;
+       tmpPosition[i].y = s[i].position.y;
+       tmpVelocity[i].x = s[i].velocity.x;
+       tmpVelocity[i].y = s[i].velocity.y;
    }
 
-   // Physics iteration loop
-   
    for(int physicsUpdateIndex = 0; 
-       physicsUpdateIndex < PHYSICSUPDATESPERFRAME;
+       physicsUpdateIndex < updates;
       ++physicsUpdateIndex){
 
        // Physics satellite loop
       
-      for(int i = 0; i < SATELLITE_COUNT; ++i){
+      for(int i = 0; i < count; ++i){
 
          // Distance to the blackhole (bit ugly code because C-struct cannot have member functions)
          doublevector positionToBlackHole = {.x = tmpPosition[i].x -
-            HORIZONTAL_CENTER, .y = tmpPosition[i].y - VERTICAL_CENTER};
+            horizontalCenter, .y = tmpPosition[i].y - verticalCenter};
          double distToBlackHoleSquared =
             positionToBlackHole.x * positionToBlackHole.x +
             positionToBlackHole.y * positionToBlackHole.y;
@@ -169,106 +708,1296 @@ void parallelPhysicsEngine(){
          // Delta time is used to make velocity same despite different FPS
          // Update velocity based on force
          tmpVelocity[i].x -= accumulation * normalizedDirection.x *
-            DELTATIME / PHYSICSUPDATESPERFRAME;
+            DELTATIME / updates;
          tmpVelocity[i].y -= accumulation * normalizedDirection.y *
-            DELTATIME / PHYSICSUPDATESPERFRAME;
+            DELTATIME / updates;
 
          // Update position based on velocity
          tmpPosition[i].x +=
-            tmpVelocity[i].x * DELTATIME / PHYSICSUPDATESPERFRAME;
+            tmpVelocity[i].x * DELTATIME / updates;
          tmpPosition[i].y +=
-            tmpVelocity[i].y * DELTATIME / PHYSICSUPDATESPERFRAME;
+            tmpVelocity[i].y * DELTATIME / updates;
       }
    }
 
-   // double precision required for accumulation inside this routine,
-   // but float storage is ok outside these loops.
    // copy back the float storage.
-   for (int i = 0; i < SATELLITE_COUNT; ++i) {
-       satellites[i].position.x = tmpPosition[i].x;
-       satellites[i].position.y = tmpPosition[i].y;
-       satellites[i].velocity.x = tmpVelocity[i].x;
-       satellites[i].velocity.y = tmpVelocity[i].y;
+   for (int i = 0; i < count; ++i) {
+       s[i].position.x = tmpPosition[i].x;
+       s[i].position.y = tmpPosition[i].y;
+       s[i].velocity.x = tmpVelocity[i].x;
+       s[i].velocity.y = tmpVelocity[i].y;
    }
+}
 
+static void physicsKernelDefault(satellite* s){
+   physicsKernel(s, PHYSICS_BLOCK_SIZE, DEFAULT_PHYSICSUPDATESPERFRAME,
+                 DEFAULT_WINDOW_WIDTH / 2, DEFAULT_WINDOW_HEIGHT / 2);
 }
 
-// ## You are asked to make this code parallel ##
-// Rendering loop (This is called once a frame after physics engine) 
-// Decides the color for each pixel.
-void parallelGraphicsEngine(){
+static void physicsKernelGeneric(satellite* s, int count){
+   physicsKernel(s, count, PHYSICSUPDATESPERFRAME,
+                 HORIZONTAL_CENTER, VERTICAL_CENTER);
+}
 
-    // Graphics pixel loop
-     #pragma omp parallel for
-    for(int i = 0 ;i < SIZE; ++i) {
+// Copies one chunk of satellites to the SoA state. Lanes past
+// SATELLITE_COUNT start at rest 100 pixels from the black hole and fall
+// straight into it, so their values mean nothing; they are only there to
+// fill the vectors and are never copied back.
+static void loadPhysicsChunk(const satellite* s, int chunk){
+   int begin = chunk * PHYSICS_CHUNK_SIZE;
+   for(int i = begin; i < begin + PHYSICS_CHUNK_SIZE; ++i){
+      if(i < SATELLITE_COUNT){
+         physicsState.x[i] = s[i].position.x;
+         physicsState.y[i] = s[i].position.y;
+         physicsState.vx[i] = s[i].velocity.x;
+         physicsState.vy[i] = s[i].velocity.y;
+      } else {
+         physicsState.x[i] = HORIZONTAL_CENTER + 100.0;
+         physicsState.y[i] = VERTICAL_CENTER;
+         physicsState.vx[i] = 0.0;
+         physicsState.vy[i] = 0.0;
+      }
+   }
+}
 
-      // Row wise ordering
-      floatvector pixel = {.x = i % WINDOW_WIDTH, .y = i / WINDOW_WIDTH};
+// Copies one chunk of the SoA state back to the float storage
+static void storePhysicsChunk(satellite* s, int chunk){
+   int begin = chunk * PHYSICS_CHUNK_SIZE;
+   int end = begin + PHYSICS_CHUNK_SIZE;
+   if(end > SATELLITE_COUNT){
+      end = SATELLITE_COUNT;
+   }
+   for(int i = begin; i < end; ++i){
+      s[i].position.x = physicsState.x[i];
+      s[i].position.y = physicsState.y[i];
+      s[i].velocity.x = physicsState.vx[i];
+      s[i].velocity.y = physicsState.vy[i];
+   }
+}
 
-      // This color is used for coloring the pixel
+#ifdef HAVE_X86_SIMD
+
+// Integrates one chunk as 4 vectors of 4 satellites. The state stays in
+// registers for all physics updates of the frame.
+__attribute__((target("avx2")))
+static void physicsChunkAVX2(int chunk, int updates){
+   double* x = physicsState.x + chunk * PHYSICS_CHUNK_SIZE;
+   double* y = physicsState.y + chunk * PHYSICS_CHUNK_SIZE;
+   double* vx = physicsState.vx + chunk * PHYSICS_CHUNK_SIZE;
+   double* vy = physicsState.vy + chunk * PHYSICS_CHUNK_SIZE;
+
+   const __m256d horizontalCenter = _mm256_set1_pd(HORIZONTAL_CENTER);
+   const __m256d verticalCenter = _mm256_set1_pd(VERTICAL_CENTER);
+   const __m256d gravity = _mm256_set1_pd(GRAVITY);
+   const __m256d deltaTime = _mm256_set1_pd(DELTATIME);
+   const __m256d updateCount = _mm256_set1_pd(updates);
+
+   __m256d px[4], py[4], pvx[4], pvy[4];
+   for(int v = 0; v < 4; ++v){
+      px[v] = _mm256_load_pd(x + 4 * v);
+      py[v] = _mm256_load_pd(y + 4 * v);
+      pvx[v] = _mm256_load_pd(vx + 4 * v);
+      pvy[v] = _mm256_load_pd(vy + 4 * v);
+   }
+
+   if(!fastPhysics){
+      for(int physicsUpdateIndex = 0; physicsUpdateIndex < updates;
+          ++physicsUpdateIndex){
+         for(int v = 0; v < 4; ++v){
+            __m256d dx = _mm256_sub_pd(px[v], horizontalCenter);
+            __m256d dy = _mm256_sub_pd(py[v], verticalCenter);
+            __m256d distSquared = _mm256_add_pd(_mm256_mul_pd(dx, dx),
+                                                _mm256_mul_pd(dy, dy));
+            __m256d dist = _mm256_sqrt_pd(distSquared);
+            __m256d nx = _mm256_div_pd(dx, dist);
+            __m256d ny = _mm256_div_pd(dy, dist);
+            __m256d accumulation = _mm256_div_pd(gravity, distSquared);
+
+            pvx[v] = _mm256_sub_pd(pvx[v], _mm256_div_pd(_mm256_mul_pd(
+               _mm256_mul_pd(accumulation, nx), deltaTime), updateCount));
+            pvy[v] = _mm256_sub_pd(pvy[v], _mm256_div_pd(_mm256_mul_pd(
+               _mm256_mul_pd(accumulation, ny), deltaTime), updateCount));
+
+            px[v] = _mm256_add_pd(px[v], _mm256_div_pd(
+               _mm256_mul_pd(pvx[v], deltaTime), updateCount));
+            py[v] = _mm256_add_pd(py[v], _mm256_div_pd(
+               _mm256_mul_pd(pvy[v], deltaTime), updateCount));
+         }
+      }
+   } else {
+      const __m256d timeStep = _mm256_set1_pd((double)DELTATIME / updates);
+      const __m256d gravityStep = _mm256_set1_pd(GRAVITY * (double)DELTATIME / updates);
+      const __m256d half = _mm256_set1_pd(0.5);
+      const __m256d threeHalves = _mm256_set1_pd(1.5);
+      for(int physicsUpdateIndex = 0; physicsUpdateIndex < updates;
+          ++physicsUpdateIndex){
+         for(int v = 0; v < 4; ++v){
+            __m256d dx = _mm256_sub_pd(px[v], horizontalCenter);
+            __m256d dy = _mm256_sub_pd(py[v], verticalCenter);
+            __m256d distSquared = _mm256_add_pd(_mm256_mul_pd(dx, dx),
+                                                _mm256_mul_pd(dy, dy));
+
+            // 12 bit float estimate, three Newton steps reach double precision
+            __m256d inverse = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(distSquared)));
+            __m256d halfDistSquared = _mm256_mul_pd(half, distSquared);
+            for(int newton = 0; newton < 3; ++newton){
+               inverse = _mm256_mul_pd(inverse, _mm256_sub_pd(threeHalves,
+                  _mm256_mul_pd(halfDistSquared, _mm256_mul_pd(inverse, inverse))));
+            }
+
+            // accumulation * direction * timeStep = gravityStep * d / |d|^3
+            __m256d k = _mm256_mul_pd(gravityStep, _mm256_mul_pd(inverse,
+                                      _mm256_mul_pd(inverse, inverse)));
+            pvx[v] = _mm256_sub_pd(pvx[v], _mm256_mul_pd(k, dx));
+            pvy[v] = _mm256_sub_pd(pvy[v], _mm256_mul_pd(k, dy));
+            px[v] = _mm256_add_pd(px[v], _mm256_mul_pd(pvx[v], timeStep));
+            py[v] = _mm256_add_pd(py[v], _mm256_mul_pd(pvy[v], timeStep));
+         }
+      }
+   }
+
+   for(int v = 0; v < 4; ++v){
+      _mm256_store_pd(x + 4 * v, px[v]);
+      _mm256_store_pd(y + 4 * v, py[v]);
+      _mm256_store_pd(vx + 4 * v, pvx[v]);
+      _mm256_store_pd(vy + 4 * v, pvy[v]);
+   }
+}
+
+// Integrates one chunk as 2 vectors of 8 satellites
+__attribute__((target("avx512f")))
+static void physicsChunkAVX512(int chunk, int updates){
+   double* x = physicsState.x + chunk * PHYSICS_CHUNK_SIZE;
+   double* y = physicsState.y + chunk * PHYSICS_CHUNK_SIZE;
+   double* vx = physicsState.vx + chunk * PHYSICS_CHUNK_SIZE;
+   double* vy = physicsState.vy + chunk * PHYSICS_CHUNK_SIZE;
+
+   const __m512d horizontalCenter = _mm512_set1_pd(HORIZONTAL_CENTER);
+   const __m512d verticalCenter = _mm512_set1_pd(VERTICAL_CENTER);
+   const __m512d gravity = _mm512_set1_pd(GRAVITY);
+   const __m512d deltaTime = _mm512_set1_pd(DELTATIME);
+   const __m512d updateCount = _mm512_set1_pd(updates);
+
+   __m512d px[2], py[2], pvx[2], pvy[2];
+   for(int v = 0; v < 2; ++v){
+      px[v] = _mm512_load_pd(x + 8 * v);
+      py[v] = _mm512_load_pd(y + 8 * v);
+      pvx[v] = _mm512_load_pd(vx + 8 * v);
+      pvy[v] = _mm512_load_pd(vy + 8 * v);
+   }
+
+   if(!fastPhysics){
+      for(int physicsUpdateIndex = 0; physicsUpdateIndex < updates;
+          ++physicsUpdateIndex){
+         for(int v = 0; v < 2; ++v){
+            __m512d dx = _mm512_sub_pd(px[v], horizontalCenter);
+            __m512d dy = _mm512_sub_pd(py[v], verticalCenter);
+            __m512d distSquared = _mm512_add_pd(_mm512_mul_pd(dx, dx),
+                                                _mm512_mul_pd(dy, dy));
+            __m512d dist = _mm512_sqrt_pd(distSquared);
+            __m512d nx = _mm512_div_pd(dx, dist);
+            __m512d ny = _mm512_div_pd(dy, dist);
+            __m512d accumulation = _mm512_div_pd(gravity, distSquared);
+
+            pvx[v] = _mm512_sub_pd(pvx[v], _mm512_div_pd(_mm512_mul_pd(
+               _mm512_mul_pd(accumulation, nx), deltaTime), updateCount));
+            pvy[v] = _mm512_sub_pd(pvy[v], _mm512_div_pd(_mm512_mul_pd(
+               _mm512_mul_pd(accumulation, ny), deltaTime), updateCount));
+
+            px[v] = _mm512_add_pd(px[v], _mm512_div_pd(
+               _mm512_mul_pd(pvx[v], deltaTime), updateCount));
+            py[v] = _mm512_add_pd(py[v], _mm512_div_pd(
+               _mm512_mul_pd(pvy[v], deltaTime), updateCount));
+         }
+      }
+   } else {
+      const __m512d timeStep = _mm512_set1_pd((double)DELTATIME / updates);
+      const __m512d gravityStep = _mm512_set1_pd(GRAVITY * (double)DELTATIME / updates);
+      const __m512d half = _mm512_set1_pd(0.5);
+      const __m512d threeHalves = _mm512_set1_pd(1.5);
+      for(int physicsUpdateIndex = 0; physicsUpdateIndex < updates;
+          ++physicsUpdateIndex){
+         for(int v = 0; v < 2; ++v){
+            __m512d dx = _mm512_sub_pd(px[v], horizontalCenter);
+            __m512d dy = _mm512_sub_pd(py[v], verticalCenter);
+            __m512d distSquared = _mm512_add_pd(_mm512_mul_pd(dx, dx),
+                                                _mm512_mul_pd(dy, dy));
+
+            // 14 bit estimate, two Newton steps reach double precision
+            __m512d inverse = _mm512_rsqrt14_pd(distSquared);
+            __m512d halfDistSquared = _mm512_mul_pd(half, distSquared);
+            for(int newton = 0; newton < 2; ++newton){
+               inverse = _mm512_mul_pd(inverse, _mm512_sub_pd(threeHalves,
+                  _mm512_mul_pd(halfDistSquared, _mm512_mul_pd(inverse, inverse))));
+            }
+
+            // accumulation * direction * timeStep = gravityStep * d / |d|^3
+            __m512d k = _mm512_mul_pd(gravityStep, _mm512_mul_pd(inverse,
+                                      _mm512_mul_pd(inverse, inverse)));
+            pvx[v] = _mm512_sub_pd(pvx[v], _mm512_mul_pd(k, dx));
+            pvy[v] = _mm512_sub_pd(pvy[v], _mm512_mul_pd(k, dy));
+            px[v] = _mm512_add_pd(px[v], _mm512_mul_pd(pvx[v], timeStep));
+            py[v] = _mm512_add_pd(py[v], _mm512_mul_pd(pvy[v], timeStep));
+         }
+      }
+   }
+
+   for(int v = 0; v < 2; ++v){
+      _mm512_store_pd(x + 8 * v, px[v]);
+      _mm512_store_pd(y + 8 * v, py[v]);
+      _mm512_store_pd(vx + 8 * v, pvx[v]);
+      _mm512_store_pd(vy + 8 * v, pvy[v]);
+   }
+}
+
+#endif
+
+// Stores a finished pixel as float color, packed, or both on checked frames
+static inline void storePixel(int i, color c){
+   if(storePackedPixels){
+      pixelFormatStore(pixelFormat, packedPixels, i, c.red, c.green, c.blue);
+   }
+   if(storeFloatPixels){
+      pixels[i] = c;
+   }
+}
+
+// Colors one pixel. weights_cache holds count floats owned by the caller.
+ENGINE_KERNEL void graphicsKernel(int i, int count, float* weights_cache){
+
+   // Row wise ordering
+   floatvector pixel = {.x = i % WINDOW_WIDTH, .y = i / WINDOW_WIDTH};
+
+   // This color is used for coloring the pixel
+   color renderColor = {.red = 0.f, .green = 0.f, .blue = 0.f};
+
+   // Find closest satellite
+   float weights = 0.f;
+   float distance = 0;
+   int hitsSatellite = 0;
+   float shortestDistance = INFINITY;
+
+   // First Graphics satellite loop: Find the closest satellite.
+   for(int j = 0; j < count; ++j){
+      floatvector difference = {.x = pixel.x - satellites[j].position.x,
+                                .y = pixel.y - satellites[j].position.y};
+        float d_diff = difference.x * difference.x + difference.y * difference.y;
+       distance = sqrt(difference.x * difference.x + difference.y * difference.y);
+
+      if(distance < SATELLITE_RADIUS) {
+         renderColor.red = 1.0f;
+         renderColor.green = 1.0f;
+         renderColor.blue = 1.0f;
+         hitsSatellite = 1;
+         break;
+      } else {
+         // float weight = 1.0f / (distance*distance*distance*distance);
+         // weights += weight; 
+         weights_cache[j] = 1.0f / (d_diff * d_diff);
+         weights += weights_cache[j]; 
+         if(distance < shortestDistance){
+            shortestDistance = distance;
+            renderColor = satellites[j].identifier;
+         }
+      }
+   }
+
+   
+   // Second graphics loop: Calculate the color based on distance to every satellite.
+   if (!hitsSatellite) {
+      
+      for(int j = 0; j < count; ++j){
+         // floatvector difference = {.x = pixel.x - satellites[j].position.x,
+         //                           .y = pixel.y - satellites[j].position.y};
+         //  float dist2 = (difference.x * difference.x +
+         //                difference.y * difference.y);
+          // float weight = 1.0f / (dist2 * dist2);
+         float weight = weights_cache[j];
+
+         renderColor.red += (satellites[j].identifier.red *
+                             weight /weights) * 3.0f;
+
+         renderColor.green += (satellites[j].identifier.green *
+                               weight / weights) * 3.0f;
+
+         renderColor.blue += (satellites[j].identifier.blue *
+                              weight / weights) * 3.0f;
+      }
+   }
+   storePixel(i, renderColor);
+}
+
+// Finishes a lane group of the SIMD shaders. The weighted color sums are
+// normalized by the summed weights only here, once per pixel.
+static void finishPixels(int first, int lanes, unsigned int hits,
+                         const int* nearest, const float* weights,
+                         const float* red, const float* green,
+                         const float* blue){
+   for(int lane = 0; lane < lanes; ++lane){
       color renderColor = {.red = 0.f, .green = 0.f, .blue = 0.f};
+      if(hits & (1u << lane)){
+         renderColor.red = 1.0f;
+         renderColor.green = 1.0f;
+         renderColor.blue = 1.0f;
+      } else {
+         if(nearest[lane] >= 0){
+            renderColor = satellites[nearest[lane]].identifier;
+         }
+         renderColor.red += red[lane] / weights[lane] * 3.0f;
+         renderColor.green += green[lane] / weights[lane] * 3.0f;
+         renderColor.blue += blue[lane] / weights[lane] * 3.0f;
+      }
+      storePixel(first + lane, renderColor);
+   }
+}
 
-      // Find closest satellite
-      float weights = 0.f;
-      float distance = 0;
-      int hitsSatellite = 0;
-      float shortestDistance = INFINITY;
-       float weights_cache[SATELLITE_COUNT];
+// Colors one pixel with the help of the grid. Hit pixels skip the satellite
+// loop, the others sum up the weights in one pass and get the color of the
+// nearest satellite from the grid.
+static void shadePixelGrid(int i){
+   floatvector pixel = {.x = i % WINDOW_WIDTH, .y = i / WINDOW_WIDTH};
+   if(satelliteGridHits(&renderGrid, renderState.x, renderState.y, 1,
+                        pixel.x, pixel.y, SATELLITE_RADIUS)){
+      color white = {.red = 1.0f, .green = 1.0f, .blue = 1.0f};
+      storePixel(i, white);
+      return;
+   }
+   int nearest = satelliteGridNearest(&renderGrid, renderState.x,
+                                      renderState.y, 1, pixel.x, pixel.y);
+
+   float weights = 0.f, red = 0.f, green = 0.f, blue = 0.f;
+   for(int j = 0; j < SATELLITE_COUNT; ++j){
+      float dx = pixel.x - renderState.x[j];
+      float dy = pixel.y - renderState.y[j];
+      float distSquared = dx * dx + dy * dy;
+      float weight = 1.0f / (distSquared * distSquared);
+      weights += weight;
+      red += renderState.red[j] * weight;
+      green += renderState.green[j] * weight;
+      blue += renderState.blue[j] * weight;
+   }
+   finishPixels(i, 1, 0, &nearest, &weights, &red, &green, &blue);
+}
 
-      // First Graphics satellite loop: Find the closest satellite.
-      for(int j = 0; j < SATELLITE_COUNT; ++j){
-         floatvector difference = {.x = pixel.x - satellites[j].position.x,
-                                   .y = pixel.y - satellites[j].position.y};
-           float d_diff = difference.x * difference.x + difference.y * difference.y;
-          distance = sqrt(difference.x * difference.x + difference.y * difference.y);
+// Colors the pixels left .. right - 1 of a row with the approximate blend.
+// Hits and the nearest satellite still come exactly from the grid, the
+// weights from one quadtree walk per QUADTREE_BLEND_LANES pixels.
+static void shadeSpanApproximate(int row, int left, int right){
+   for(int column = left; column < right; column += QUADTREE_BLEND_LANES){
+      int lanes = right - column < QUADTREE_BLEND_LANES ?
+                  right - column : QUADTREE_BLEND_LANES;
+      unsigned int hits = 0;
+      int nearest[QUADTREE_BLEND_LANES];
+      for(int lane = 0; lane < lanes; ++lane){
+         if(satelliteGridHits(&renderGrid, renderState.x, renderState.y, 1,
+                              column + lane, row, SATELLITE_RADIUS)){
+            hits |= 1u << lane;
+         } else {
+            nearest[lane] = satelliteGridNearest(&renderGrid, renderState.x,
+                                                 renderState.y, 1, column + lane, row);
+         }
+      }
 
-         if(distance < SATELLITE_RADIUS) {
-            renderColor.red = 1.0f;
-            renderColor.green = 1.0f;
-            renderColor.blue = 1.0f;
-            hitsSatellite = 1;
-            break;
+      float weights[QUADTREE_BLEND_LANES], red[QUADTREE_BLEND_LANES];
+      float green[QUADTREE_BLEND_LANES], blue[QUADTREE_BLEND_LANES];
+      if(hits != (1u << lanes) - 1){
+         satelliteQuadtreeBlendRow(&blendTree, renderState.x, renderState.y,
+                                   renderState.red, renderState.green,
+                                   renderState.blue, column, row, lanes,
+                                   blendTheta, weights, red, green, blue);
+      }
+      finishPixels(row * WINDOW_WIDTH + column, lanes, hits, nearest,
+                   weights, red, green, blue);
+   }
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Largest distance in the first lanes of an AVX2 vector
+__attribute__((target("avx2")))
+static float maxLaneAVX2(__m256 value, int lanes){
+   float values[8];
+   _mm256_storeu_ps(values, value);
+   float result = values[0];
+   for(int lane = 1; lane < lanes; ++lane){
+      result = fmaxf(result, values[lane]);
+   }
+   return result;
+}
+
+// Finds satellite hits and the nearest satellites of the 8 pixels
+// (column .. column + 7, row) from the grid. Like satelliteGridNearest,
+// but the rings are searched around the cells of the whole lane group.
+__attribute__((target("avx2")))
+static void gridQueryAVX2(__m256 pixelX, __m256 pixelY, int column, int row,
+                          int lanes, __m256* hitsOut, __m256i* nearestOut){
+   const satelliteGrid* grid = &renderGrid;
+   const __m256 radius = _mm256_set1_ps(SATELLITE_RADIUS);
+   const float margin = SATELLITE_RADIUS + 1.0f;
+
+   __m256 hits = _mm256_setzero_ps();
+   int x0 = satelliteGridCellX(grid, column - margin);
+   int x1 = satelliteGridCellX(grid, column + lanes - 1 + margin);
+   int y0 = satelliteGridCellY(grid, row - margin);
+   int y1 = satelliteGridCellY(grid, row + margin);
+   for(int cy = y0; cy <= y1; ++cy){
+      for(int cx = x0; cx <= x1; ++cx){
+         int cell = cy * grid->columns + cx;
+         for(int k = grid->cellStart[cell]; k < grid->cellStart[cell + 1]; ++k){
+            int j = grid->cellSatellites[k];
+            __m256 dx = _mm256_sub_ps(pixelX, _mm256_set1_ps(renderState.x[j]));
+            __m256 dy = _mm256_sub_ps(pixelY, _mm256_set1_ps(renderState.y[j]));
+            __m256 distance = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                                           _mm256_mul_ps(dy, dy)));
+            hits = _mm256_or_ps(hits, _mm256_cmp_ps(distance, radius, _CMP_LT_OQ));
+         }
+      }
+   }
+
+   __m256 shortestDistance = _mm256_set1_ps(INFINITY);
+   __m256i nearest = _mm256_set1_epi32(0x7fffffff);
+   int cx0 = satelliteGridCellX(grid, column);
+   int cx1 = satelliteGridCellX(grid, column + lanes - 1);
+   int cy = satelliteGridCellY(grid, row);
+   for(int ring = 0; ; ++ring){
+      satelliteGridRing it;
+      satelliteGridRingBegin(&it, grid, cx0, cy, cx1, cy, ring);
+      for(int cell = satelliteGridRingNext(&it); cell >= 0;
+          cell = satelliteGridRingNext(&it)){
+         for(int k = grid->cellStart[cell]; k < grid->cellStart[cell + 1]; ++k){
+            int j = grid->cellSatellites[k];
+            __m256i index = _mm256_set1_epi32(j);
+            __m256 dx = _mm256_sub_ps(pixelX, _mm256_set1_ps(renderState.x[j]));
+            __m256 dy = _mm256_sub_ps(pixelY, _mm256_set1_ps(renderState.y[j]));
+            __m256 distance = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                                           _mm256_mul_ps(dy, dy)));
+            __m256 tie = _mm256_and_ps(
+               _mm256_cmp_ps(distance, shortestDistance, _CMP_EQ_OQ),
+               _mm256_castsi256_ps(_mm256_cmpgt_epi32(nearest, index)));
+            __m256 closer = _mm256_or_ps(tie,
+               _mm256_cmp_ps(distance, shortestDistance, _CMP_LT_OQ));
+            shortestDistance = _mm256_blendv_ps(shortestDistance, distance, closer);
+            nearest = _mm256_castps_si256(_mm256_blendv_ps(
+               _mm256_castsi256_ps(nearest), _mm256_castsi256_ps(index), closer));
+         }
+      }
+      if(maxLaneAVX2(shortestDistance, lanes) < satelliteGridRingReach(grid, ring) ||
+         satelliteGridRingCoversGrid(grid, cx0, cy, cx1, cy, ring)){
+         break;
+      }
+   }
+
+   // Lanes that found no satellite at a finite distance
+   __m256 none = _mm256_cmp_ps(shortestDistance, _mm256_set1_ps(INFINITY), _CMP_EQ_OQ);
+   *nearestOut = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(nearest),
+      _mm256_castsi256_ps(_mm256_set1_epi32(-1)), none));
+   *hitsOut = hits;
+}
+
+// Shades the tile (left, bottom) .. (right - 1, top - 1) 8 pixels at a
+// time. Every satellite is broadcast to all lanes, satellite hits and the
+// nearest satellite are tracked per lane and the weighted colors are summed
+// without normalization. Without the grid both satellite loops of the
+// scalar shader are fused into this one pass. The satellites are walked in
+// blocks of TILE_SATELLITE_BLOCK over all lane groups of the tile, with the
+// sums of the groups kept in acc. Every pixel still sees the satellites in
+// index order, so the result does not depend on the blocking.
+__attribute__((target("avx2")))
+static void shadeTileAVX2(int left, int bottom, int right, int top,
+                          tileAccumulators* acc){
+   const __m256 lane = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+   const __m256 radius = _mm256_set1_ps(SATELLITE_RADIUS);
+   const __m256 one = _mm256_set1_ps(1.0f);
+   const int groupsPerRow = (right - left + 7) / 8;
+   const int groups = (top - bottom) * groupsPerRow;
+
+   for(int g = 0; g < groups; ++g){
+      int row = bottom + g / groupsPerRow;
+      int column = left + g % groupsPerRow * 8;
+      int lanes = right - column < 8 ? right - column : 8;
+      __m256 hits = _mm256_setzero_ps();
+      __m256i nearest = _mm256_set1_epi32(-1);
+      if(useGrid){
+         gridQueryAVX2(_mm256_add_ps(_mm256_set1_ps((float)column), lane),
+                       _mm256_set1_ps((float)row), column, row, lanes, &hits, &nearest);
+      }
+      acc->hits[g] = _mm256_movemask_ps(hits) & ((1u << lanes) - 1);
+      _mm256_store_si256((__m256i*)(acc->nearest + 8 * g), nearest);
+      _mm256_store_ps(acc->shortest + 8 * g, _mm256_set1_ps(INFINITY));
+      _mm256_store_ps(acc->weights + 8 * g, _mm256_setzero_ps());
+      _mm256_store_ps(acc->red + 8 * g, _mm256_setzero_ps());
+      _mm256_store_ps(acc->green + 8 * g, _mm256_setzero_ps());
+      _mm256_store_ps(acc->blue + 8 * g, _mm256_setzero_ps());
+   }
+
+   for(int block = 0; block < SATELLITE_COUNT; block += TILE_SATELLITE_BLOCK){
+      int blockEnd = SATELLITE_COUNT - block < TILE_SATELLITE_BLOCK ?
+                     SATELLITE_COUNT : block + TILE_SATELLITE_BLOCK;
+      for(int g = 0; g < groups; ++g){
+         int row = bottom + g / groupsPerRow;
+         int column = left + g % groupsPerRow * 8;
+         int lanes = right - column < 8 ? right - column : 8;
+
+         // Hit pixels are white whatever the other satellites add
+         if(acc->hits[g] == (1u << lanes) - 1){
+            continue;
+         }
+         __m256 pixelX = _mm256_add_ps(_mm256_set1_ps((float)column), lane);
+         __m256 pixelY = _mm256_set1_ps((float)row);
+         __m256 weights = _mm256_load_ps(acc->weights + 8 * g);
+         __m256 red = _mm256_load_ps(acc->red + 8 * g);
+         __m256 green = _mm256_load_ps(acc->green + 8 * g);
+         __m256 blue = _mm256_load_ps(acc->blue + 8 * g);
+
+         if(useGrid){
+            for(int j = block; j < blockEnd; ++j){
+               __m256 dx = _mm256_sub_ps(pixelX, _mm256_set1_ps(renderState.x[j]));
+               __m256 dy = _mm256_sub_ps(pixelY, _mm256_set1_ps(renderState.y[j]));
+               __m256 distSquared = _mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                                  _mm256_mul_ps(dy, dy));
+               __m256 weight = _mm256_div_ps(one, _mm256_mul_ps(distSquared, distSquared));
+               weights = _mm256_add_ps(weights, weight);
+               red = _mm256_add_ps(red, _mm256_mul_ps(_mm256_set1_ps(renderState.red[j]), weight));
+               green = _mm256_add_ps(green, _mm256_mul_ps(_mm256_set1_ps(renderState.green[j]), weight));
+               blue = _mm256_add_ps(blue, _mm256_mul_ps(_mm256_set1_ps(renderState.blue[j]), weight));
+            }
          } else {
-            // float weight = 1.0f / (distance*distance*distance*distance);
-            // weights += weight; 
-            weights_cache[j] = 1.0f / (d_diff * d_diff);
-            weights += weights_cache[j]; 
-            if(distance < shortestDistance){
-               shortestDistance = distance;
-               renderColor = satellites[j].identifier;
+            __m256 shortestDistance = _mm256_load_ps(acc->shortest + 8 * g);
+            __m256i nearest = _mm256_load_si256((const __m256i*)(acc->nearest + 8 * g));
+            __m256 hits = _mm256_setzero_ps();
+            for(int j = block; j < blockEnd; ++j){
+               __m256 dx = _mm256_sub_ps(pixelX, _mm256_set1_ps(renderState.x[j]));
+               __m256 dy = _mm256_sub_ps(pixelY, _mm256_set1_ps(renderState.y[j]));
+               __m256 distSquared = _mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                                  _mm256_mul_ps(dy, dy));
+               __m256 distance = _mm256_sqrt_ps(distSquared);
+
+               hits = _mm256_or_ps(hits, _mm256_cmp_ps(distance, radius, _CMP_LT_OQ));
+               __m256 closer = _mm256_cmp_ps(distance, shortestDistance, _CMP_LT_OQ);
+               shortestDistance = _mm256_blendv_ps(shortestDistance, distance, closer);
+               nearest = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(nearest),
+                  _mm256_castsi256_ps(_mm256_set1_epi32(j)), closer));
+
+               __m256 weight = _mm256_div_ps(one, _mm256_mul_ps(distSquared, distSquared));
+               weights = _mm256_add_ps(weights, weight);
+               red = _mm256_add_ps(red, _mm256_mul_ps(_mm256_set1_ps(renderState.red[j]), weight));
+               green = _mm256_add_ps(green, _mm256_mul_ps(_mm256_set1_ps(renderState.green[j]), weight));
+               blue = _mm256_add_ps(blue, _mm256_mul_ps(_mm256_set1_ps(renderState.blue[j]), weight));
             }
+            acc->hits[g] |= _mm256_movemask_ps(hits) & ((1u << lanes) - 1);
+            _mm256_store_ps(acc->shortest + 8 * g, shortestDistance);
+            _mm256_store_si256((__m256i*)(acc->nearest + 8 * g), nearest);
          }
+         _mm256_store_ps(acc->weights + 8 * g, weights);
+         _mm256_store_ps(acc->red + 8 * g, red);
+         _mm256_store_ps(acc->green + 8 * g, green);
+         _mm256_store_ps(acc->blue + 8 * g, blue);
       }
+   }
 
-      
-      // Second graphics loop: Calculate the color based on distance to every satellite.
-      if (!hitsSatellite) {
-         
-         for(int j = 0; j < SATELLITE_COUNT; ++j){
-            // floatvector difference = {.x = pixel.x - satellites[j].position.x,
-            //                           .y = pixel.y - satellites[j].position.y};
-            //  float dist2 = (difference.x * difference.x +
-            //                difference.y * difference.y);
-             // float weight = 1.0f / (dist2 * dist2);
-            float weight = weights_cache[j];
+   for(int g = 0; g < groups; ++g){
+      int row = bottom + g / groupsPerRow;
+      int column = left + g % groupsPerRow * 8;
+      int lanes = right - column < 8 ? right - column : 8;
+      finishPixels(row * WINDOW_WIDTH + column, lanes, acc->hits[g],
+                   acc->nearest + 8 * g, acc->weights + 8 * g, acc->red + 8 * g,
+                   acc->green + 8 * g, acc->blue + 8 * g);
+   }
+}
 
-            renderColor.red += (satellites[j].identifier.red *
-                                weight /weights) * 3.0f;
+// Finds satellite hits and the nearest satellites of 16 pixels, see
+// gridQueryAVX2
+__attribute__((target("avx512f")))
+static void gridQueryAVX512(__m512 pixelX, __m512 pixelY, int column, int row,
+                            int lanes, __mmask16* hitsOut, __m512i* nearestOut){
+   const satelliteGrid* grid = &renderGrid;
+   const __m512 radius = _mm512_set1_ps(SATELLITE_RADIUS);
+   const float margin = SATELLITE_RADIUS + 1.0f;
+   const __mmask16 allLanes = (__mmask16)((1u << lanes) - 1);
+
+   __mmask16 hits = 0;
+   int x0 = satelliteGridCellX(grid, column - margin);
+   int x1 = satelliteGridCellX(grid, column + lanes - 1 + margin);
+   int y0 = satelliteGridCellY(grid, row - margin);
+   int y1 = satelliteGridCellY(grid, row + margin);
+   for(int cy = y0; cy <= y1; ++cy){
+      for(int cx = x0; cx <= x1; ++cx){
+         int cell = cy * grid->columns + cx;
+         for(int k = grid->cellStart[cell]; k < grid->cellStart[cell + 1]; ++k){
+            int j = grid->cellSatellites[k];
+            __m512 dx = _mm512_sub_ps(pixelX, _mm512_set1_ps(renderState.x[j]));
+            __m512 dy = _mm512_sub_ps(pixelY, _mm512_set1_ps(renderState.y[j]));
+            __m512 distance = _mm512_sqrt_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx),
+                                                           _mm512_mul_ps(dy, dy)));
+            hits |= _mm512_cmp_ps_mask(distance, radius, _CMP_LT_OQ);
+         }
+      }
+   }
 
-            renderColor.green += (satellites[j].identifier.green *
-                                  weight / weights) * 3.0f;
+   __m512 shortestDistance = _mm512_set1_ps(INFINITY);
+   __m512i nearest = _mm512_set1_epi32(0x7fffffff);
+   int cx0 = satelliteGridCellX(grid, column);
+   int cx1 = satelliteGridCellX(grid, column + lanes - 1);
+   int cy = satelliteGridCellY(grid, row);
+   for(int ring = 0; ; ++ring){
+      satelliteGridRing it;
+      satelliteGridRingBegin(&it, grid, cx0, cy, cx1, cy, ring);
+      for(int cell = satelliteGridRingNext(&it); cell >= 0;
+          cell = satelliteGridRingNext(&it)){
+         for(int k = grid->cellStart[cell]; k < grid->cellStart[cell + 1]; ++k){
+            int j = grid->cellSatellites[k];
+            __m512i index = _mm512_set1_epi32(j);
+            __m512 dx = _mm512_sub_ps(pixelX, _mm512_set1_ps(renderState.x[j]));
+            __m512 dy = _mm512_sub_ps(pixelY, _mm512_set1_ps(renderState.y[j]));
+            __m512 distance = _mm512_sqrt_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx),
+                                                           _mm512_mul_ps(dy, dy)));
+            __mmask16 closer = _mm512_cmp_ps_mask(distance, shortestDistance, _CMP_LT_OQ) |
+               (_mm512_cmp_ps_mask(distance, shortestDistance, _CMP_EQ_OQ) &
+                _mm512_cmplt_epi32_mask(index, nearest));
+            shortestDistance = _mm512_mask_mov_ps(shortestDistance, closer, distance);
+            nearest = _mm512_mask_mov_epi32(nearest, closer, index);
+         }
+      }
+      float farthest = _mm512_mask_reduce_max_ps(allLanes, shortestDistance);
+      if(farthest < satelliteGridRingReach(grid, ring) ||
+         satelliteGridRingCoversGrid(grid, cx0, cy, cx1, cy, ring)){
+         break;
+      }
+   }
 
-            renderColor.blue += (satellites[j].identifier.blue *
-                                 weight / weights) * 3.0f;
+   // Lanes that found no satellite at a finite distance
+   __mmask16 none = _mm512_cmp_ps_mask(shortestDistance, _mm512_set1_ps(INFINITY), _CMP_EQ_OQ);
+   *nearestOut = _mm512_mask_mov_epi32(nearest, none, _mm512_set1_epi32(-1));
+   *hitsOut = hits;
+}
+
+// Shades a tile 16 pixels at a time, see shadeTileAVX2
+__attribute__((target("avx512f")))
+static void shadeTileAVX512(int left, int bottom, int right, int top,
+                            tileAccumulators* acc){
+   const __m512 lane = _mm512_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f,
+                                      8.f, 9.f, 10.f, 11.f, 12.f, 13.f, 14.f, 15.f);
+   const __m512 radius = _mm512_set1_ps(SATELLITE_RADIUS);
+   const __m512 one = _mm512_set1_ps(1.0f);
+   const int groupsPerRow = (right - left + 15) / 16;
+   const int groups = (top - bottom) * groupsPerRow;
+
+   for(int g = 0; g < groups; ++g){
+      int row = bottom + g / groupsPerRow;
+      int column = left + g % groupsPerRow * 16;
+      int lanes = right - column < 16 ? right - column : 16;
+      __mmask16 hits = 0;
+      __m512i nearest = _mm512_set1_epi32(-1);
+      if(useGrid){
+         gridQueryAVX512(_mm512_add_ps(_mm512_set1_ps((float)column), lane),
+                         _mm512_set1_ps((float)row), column, row, lanes, &hits, &nearest);
+      }
+      acc->hits[g] = hits & ((1u << lanes) - 1);
+      _mm512_store_si512(acc->nearest + 16 * g, nearest);
+      _mm512_store_ps(acc->shortest + 16 * g, _mm512_set1_ps(INFINITY));
+      _mm512_store_ps(acc->weights + 16 * g, _mm512_setzero_ps());
+      _mm512_store_ps(acc->red + 16 * g, _mm512_setzero_ps());
+      _mm512_store_ps(acc->green + 16 * g, _mm512_setzero_ps());
+      _mm512_store_ps(acc->blue + 16 * g, _mm512_setzero_ps());
+   }
+
+   for(int block = 0; block < SATELLITE_COUNT; block += TILE_SATELLITE_BLOCK){
+      int blockEnd = SATELLITE_COUNT - block < TILE_SATELLITE_BLOCK ?
+                     SATELLITE_COUNT : block + TILE_SATELLITE_BLOCK;
+      for(int g = 0; g < groups; ++g){
+         int row = bottom + g / groupsPerRow;
+         int column = left + g % groupsPerRow * 16;
+         int lanes = right - column < 16 ? right - column : 16;
+
+         // Hit pixels are white whatever the other satellites add
+         if(acc->hits[g] == (1u << lanes) - 1){
+            continue;
+         }
+         __m512 pixelX = _mm512_add_ps(_mm512_set1_ps((float)column), lane);
+         __m512 pixelY = _mm512_set1_ps((float)row);
+         __m512 weights = _mm512_load_ps(acc->weights + 16 * g);
+         __m512 red = _mm512_load_ps(acc->red + 16 * g);
+         __m512 green = _mm512_load_ps(acc->green + 16 * g);
+         __m512 blue = _mm512_load_ps(acc->blue + 16 * g);
+
+         if(useGrid){
+            for(int j = block; j < blockEnd; ++j){
+               __m512 dx = _mm512_sub_ps(pixelX, _mm512_set1_ps(renderState.x[j]));
+               __m512 dy = _mm512_sub_ps(pixelY, _mm512_set1_ps(renderState.y[j]));
+               __m512 distSquared = _mm512_add_ps(_mm512_mul_ps(dx, dx),
+                                                  _mm512_mul_ps(dy, dy));
+               __m512 weight = _mm512_div_ps(one, _mm512_mul_ps(distSquared, distSquared));
+               weights = _mm512_add_ps(weights, weight);
+               red = _mm512_add_ps(red, _mm512_mul_ps(_mm512_set1_ps(renderState.red[j]), weight));
+               green = _mm512_add_ps(green, _mm512_mul_ps(_mm512_set1_ps(renderState.green[j]), weight));
+               blue = _mm512_add_ps(blue, _mm512_mul_ps(_mm512_set1_ps(renderState.blue[j]), weight));
+            }
+         } else {
+            __m512 shortestDistance = _mm512_load_ps(acc->shortest + 16 * g);
+            __m512i nearest = _mm512_load_si512(acc->nearest + 16 * g);
+            __mmask16 hits = 0;
+            for(int j = block; j < blockEnd; ++j){
+               __m512 dx = _mm512_sub_ps(pixelX, _mm512_set1_ps(renderState.x[j]));
+               __m512 dy = _mm512_sub_ps(pixelY, _mm512_set1_ps(renderState.y[j]));
+               __m512 distSquared = _mm512_add_ps(_mm512_mul_ps(dx, dx),
+                                                  _mm512_mul_ps(dy, dy));
+               __m512 distance = _mm512_sqrt_ps(distSquared);
+
+               hits |= _mm512_cmp_ps_mask(distance, radius, _CMP_LT_OQ);
+               __mmask16 closer = _mm512_cmp_ps_mask(distance, shortestDistance, _CMP_LT_OQ);
+               shortestDistance = _mm512_mask_mov_ps(shortestDistance, closer, distance);
+               nearest = _mm512_mask_mov_epi32(nearest, closer, _mm512_set1_epi32(j));
+
+               __m512 weight = _mm512_div_ps(one, _mm512_mul_ps(distSquared, distSquared));
+               weights = _mm512_add_ps(weights, weight);
+               red = _mm512_add_ps(red, _mm512_mul_ps(_mm512_set1_ps(renderState.red[j]), weight));
+               green = _mm512_add_ps(green, _mm512_mul_ps(_mm512_set1_ps(renderState.green[j]), weight));
+               blue = _mm512_add_ps(blue, _mm512_mul_ps(_mm512_set1_ps(renderState.blue[j]), weight));
+            }
+            acc->hits[g] |= hits & ((1u << lanes) - 1);
+            _mm512_store_ps(acc->shortest + 16 * g, shortestDistance);
+            _mm512_store_si512(acc->nearest + 16 * g, nearest);
+         }
+         _mm512_store_ps(acc->weights + 16 * g, weights);
+         _mm512_store_ps(acc->red + 16 * g, red);
+         _mm512_store_ps(acc->green + 16 * g, green);
+         _mm512_store_ps(acc->blue + 16 * g, blue);
+      }
+   }
+
+   for(int g = 0; g < groups; ++g){
+      int row = bottom + g / groupsPerRow;
+      int column = left + g % groupsPerRow * 16;
+      int lanes = right - column < 16 ? right - column : 16;
+      finishPixels(row * WINDOW_WIDTH + column, lanes, acc->hits[g],
+                   acc->nearest + 16 * g, acc->weights + 16 * g, acc->red + 16 * g,
+                   acc->green + 16 * g, acc->blue + 16 * g);
+   }
+}
+
+#endif
+
+// Graphics pixel loop over the tile (left, bottom) .. (right - 1, top - 1),
+// instantiated for a satellite count
+#define GRAPHICS_PIXEL_LOOP(COUNT) \
+   for(int row = bottom; row < top; ++row) { \
+      for(int i = row * WINDOW_WIDTH + left; i < row * WINDOW_WIDTH + right; ++i) { \
+         graphicsKernel(i, (COUNT), weightsCache + (size_t)worker * (COUNT)); \
+      } \
+   }
+
+// Physics work items: satellites for the orbit propagators, blocks for the
+// scalar integrator and chunks for the SIMD ones
+static int physicsTaskCount(void){
+   if(physicsIntegrator != INTEGRATOR_EULER){
+      return SATELLITE_COUNT;
+   }
+   if(engineSimd == SIMD_SCALAR){
+      return (SATELLITE_COUNT + PHYSICS_BLOCK_SIZE - 1) / PHYSICS_BLOCK_SIZE;
+   }
+   return physicsChunkCount;
+}
+
+// Propagated satellites taken at a time, enough to outweigh the stealing
+#define ORBIT_TASK_GRAIN 16
+
+static int physicsTaskGrain(void){
+   return physicsIntegrator != INTEGRATOR_EULER ? ORBIT_TASK_GRAIN : 1;
+}
+
+// Advances the physics items begin .. end - 1 of the satellite buffer
+// context by one frame
+static void physicsTask(void* context, int begin, int end, int worker){
+   satellite* s = (satellite*)context;
+   (void)worker;
+
+   // Orbit propagators, in double precision relative to the black hole
+   if(physicsIntegrator != INTEGRATOR_EULER){
+      for(int i = begin; i < end; ++i){
+         orbitState state = {.x = s[i].position.x - HORIZONTAL_CENTER,
+                             .y = s[i].position.y - VERTICAL_CENTER,
+                             .vx = s[i].velocity.x,
+                             .vy = s[i].velocity.y};
+         if(physicsIntegrator == INTEGRATOR_VERLET){
+            orbitVerlet(&state, GRAVITY, DELTATIME, integratorSteps);
+         } else if(physicsIntegrator == INTEGRATOR_RK4){
+            orbitRungeKutta4(&state, GRAVITY, DELTATIME, integratorSteps);
+         } else {
+            orbitKepler(&state, GRAVITY, DELTATIME);
+         }
+         s[i].position.x = state.x + HORIZONTAL_CENTER;
+         s[i].position.y = state.y + VERTICAL_CENTER;
+         s[i].velocity.x = state.vx;
+         s[i].velocity.y = state.vy;
+      }
+      return;
+   }
+
+   // Satellites do not affect each other, so each block or chunk runs all
+   // of its physics updates on its own
+   if(engineSimd == SIMD_SCALAR){
+      for(int block = begin * PHYSICS_BLOCK_SIZE;
+          block < end * PHYSICS_BLOCK_SIZE && block < SATELLITE_COUNT;
+          block += PHYSICS_BLOCK_SIZE){
+         int count = SATELLITE_COUNT - block;
+         if(count >= PHYSICS_BLOCK_SIZE &&
+            PHYSICSUPDATESPERFRAME == DEFAULT_PHYSICSUPDATESPERFRAME &&
+            WINDOW_WIDTH == DEFAULT_WINDOW_WIDTH &&
+            WINDOW_HEIGHT == DEFAULT_WINDOW_HEIGHT){
+            physicsKernelDefault(s + block);
+         } else {
+            physicsKernelGeneric(s + block,
+                                 count < PHYSICS_BLOCK_SIZE ? count : PHYSICS_BLOCK_SIZE);
+         }
+      }
+      return;
+   }
+
+#ifdef HAVE_X86_SIMD
+   for(int chunk = begin; chunk < end; ++chunk){
+      loadPhysicsChunk(s, chunk);
+      if(engineSimd == SIMD_AVX512){
+         physicsChunkAVX512(chunk, PHYSICSUPDATESPERFRAME);
+      } else {
+         physicsChunkAVX2(chunk, PHYSICSUPDATESPERFRAME);
+      }
+      storePhysicsChunk(s, chunk);
+   }
+#endif
+}
+
+// Advances the satellites of buffer s by one frame
+static void advanceSatellites(satellite* s){
+   taskPoolFor(&enginePool, physicsTaskCount(), physicsTaskGrain(), physicsTask, s);
+}
+
+static void beginPerfPhase(void){
+   if(!perfEnabled){
+      return;
+   }
+   for(int t = 0; t < enginePool.threads; ++t){
+      perfCountersRead(&perfThreads[t], &perfStart[t]);
+   }
+}
+
+static void endPerfPhase(int phase){
+   if(!perfEnabled){
+      return;
+   }
+   for(int t = 0; t < enginePool.threads; ++t){
+      perfCounts now;
+      perfCountersRead(&perfThreads[t], &now);
+      perfCountsAddDifference(&perfFrame[(size_t)phase * enginePool.threads + t],
+                              &perfStart[t], &now);
+   }
+   perfPhaseRan[phase] = 1;
+}
+
+// Ratio for the counter lines, n/a when an event was not counted
+static const char* perfRatio(char* text, size_t size, double numerator,
+                             double denominator, double scale, const char* format){
+   if(numerator < 0.0 || denominator <= 0.0){
+      return "n/a";
+   }
+   snprintf(text, size, format, numerator * scale / denominator);
+   return text;
+}
+
+// One line of counts over all threads: instructions per cycle, misses per
+// 1000 instructions and the share of cycles in the AVX licences
+static void printPerfCounts(const char* title, const perfCounts* c, const char* busiest){
+   char ipc[16], l1d[16], llc[16], branch[16], licence1[16], licence2[16];
+   const double* v = c->value;
+   printf("%s: %.4g cycles, IPC %s; misses per 1000 instructions: L1D %s, LLC %s, "
+          "branch %s; AVX licence 1 %s, 2 %s%s\n", title, v[PERF_CYCLES],
+          perfRatio(ipc, 16, v[PERF_INSTRUCTIONS], v[PERF_CYCLES], 1.0, "%.2f"),
+          perfRatio(l1d, 16, v[PERF_L1D_MISSES], v[PERF_INSTRUCTIONS], 1e3, "%.2f"),
+          perfRatio(llc, 16, v[PERF_LLC_MISSES], v[PERF_INSTRUCTIONS], 1e3, "%.3f"),
+          perfRatio(branch, 16, v[PERF_BRANCH_MISSES], v[PERF_INSTRUCTIONS], 1e3, "%.2f"),
+          perfRatio(licence1, 16, v[PERF_AVX_LICENCE1], v[PERF_CYCLES], 100.0, "%.1f%%"),
+          perfRatio(licence2, 16, v[PERF_AVX_LICENCE2], v[PERF_CYCLES], 100.0, "%.1f%%"),
+          busiest);
+}
+
+// Prints the counts of the phases that ran in this frame, writes every
+// thread to the --perf-file table and starts the next frame
+static void reportPerfFrame(void){
+   if(!perfEnabled){
+      return;
+   }
+   for(int phase = 0; phase < PERF_PHASES; ++phase){
+      if(!perfPhaseRan[phase]){
+         continue;
+      }
+      perfCounts sum;
+      perfCountsClear(&sum);
+      int busiest = 0;
+      for(int t = 0; t < enginePool.threads; ++t){
+         const perfCounts* c = &perfFrame[(size_t)phase * enginePool.threads + t];
+         for(int e = 0; e < PERF_EVENTS; ++e){
+            sum.value[e] = c->value[e] < 0.0 || sum.value[e] < 0.0 ? -1.0 :
+                           sum.value[e] + c->value[e];
+         }
+         if(c->value[PERF_CYCLES] >
+            perfFrame[(size_t)phase * enginePool.threads + busiest].value[PERF_CYCLES]){
+            busiest = t;
+         }
+         if(perfFile){
+            fprintf(perfFile, "%u,%s,%i", frameNumber, perfPhaseNames[phase], t);
+            for(int e = 0; e < PERF_EVENTS; ++e){
+               fprintf(perfFile, ",%.0f", c->value[e]);
+            }
+            fprintf(perfFile, "\n");
+         }
+      }
+      char title[64], detail[64];
+      snprintf(title, sizeof(title), "Counters frame %u %s", frameNumber,
+               perfPhaseNames[phase]);
+      snprintf(detail, sizeof(detail), "; busiest thread %i", busiest);
+      printPerfCounts(title, &sum, enginePool.threads > 1 ? detail : "");
+
+      perfCountsAddDifference(&perfTotals[phase], &(perfCounts){{0}}, &sum);
+      perfFrames[phase]++;
+      perfPhaseRan[phase] = 0;
+      memset(&perfFrame[(size_t)phase * enginePool.threads], 0,
+             sizeof(perfCounts) * enginePool.threads);
+   }
+}
+
+// Mean counts per frame of every phase over the run
+static void reportPerfRun(void){
+   if(!perfEnabled){
+      return;
+   }
+   reportPerfFrame();
+   for(int phase = 0; phase < PERF_PHASES; ++phase){
+      if(perfFrames[phase] == 0){
+         continue;
+      }
+      perfCounts mean = perfTotals[phase];
+      for(int e = 0; e < PERF_EVENTS; ++e){
+         mean.value[e] = mean.value[e] < 0.0 ? -1.0 : mean.value[e] / perfFrames[phase];
+      }
+      char title[64];
+      snprintf(title, sizeof(title), "Counters per frame %s (%i frames)",
+               perfPhaseNames[phase], perfFrames[phase]);
+      printPerfCounts(title, &mean, "");
+   }
+   for(int t = 0; t < enginePool.threads; ++t){
+      perfCountersClose(&perfThreads[t]);
+   }
+   if(perfFile){
+      fclose(perfFile);
+      printf("Counters of every thread written to %s\n", perfFileName);
+   }
+   free(perfThreads);
+   free(perfStart);
+   free(perfFrame);
+}
+
+// ## You are asked to make this code parallel ##
+// Physics engine loop. (This is called once a frame before graphics engine) 
+// Moves the satellites based on gravity
+// This is done multiple times in a frame because the Euler integration 
+// is not accurate enough to be done only once
+void parallelPhysicsEngine(){
+   beginPerfPhase();
+   advanceSatellites(satellites);
+   endPerfPhase(PERF_PHYSICS);
+}
+
+// errorCheck()'s allowance plus one step of 8 bit rounding
+#define PACKED_PIXEL_ERROR (0.08f + 1.0f / 255.0f)
+
+// Compares the packed pixels of the last checked frame with the sequential
+// reference in correctPixels, which compute() has filled in the meantime
+static void checkPackedPixels(void){
+   if(!packedCheckPending){
+      return;
+   }
+   packedCheckPending = 0;
+   long bad = pixelFormatCompare(pixelFormat, packedPixels, &correctPixels[0].red,
+                                 SIZE, PACKED_PIXEL_ERROR);
+   if(bad >= 0){
+      printf("Buggy %s pixel at (x=%i, y=%i)\n", pixelFormatName(pixelFormat),
+             (int)(bad % WINDOW_WIDTH), (int)(bad / WINDOW_WIDTH));
+      return;
+   }
+   printf("Packed %s check passed!\n", pixelFormatName(pixelFormat));
+}
+
+// Serial part of the rendering: the satellite copy, grid and quadtree the
+// shaders read, and the formats the shaders store this frame
+static void prepareGraphics(void){
+   checkPackedPixels();
+   storeFloatPixels = pixelFormat == PIXEL_FLOAT || frameNumber < 2;
+   storePackedPixels = pixelFormat != PIXEL_FLOAT;
+   packedCheckPending = storePackedPixels && storeFloatPixels;
+
+   shadeEveryTile = incrementalThreshold <= 0.f || frameNumber < 2 ||
+                    frameNumber % refreshFrames == 0;
+   if(incrementalThreshold > 0.f){
+      memcpy(previousX, renderState.x, sizeof(float) * SATELLITE_COUNT);
+      memcpy(previousY, renderState.y, sizeof(float) * SATELLITE_COUNT);
+      tileNow = (tileSatellites){renderState.x, renderState.y, renderState.red,
+                                 renderState.green, renderState.blue, 1, SATELLITE_COUNT};
+      tilePrevious = (tileSatellites){previousX, previousY, NULL, NULL, NULL, 1,
+                                      SATELLITE_COUNT};
+   }
+
+   if(engineSimd != SIMD_SCALAR || useGrid || incrementalThreshold > 0.f){
+      for(int j = 0; j < SATELLITE_COUNT; ++j){
+         renderState.x[j] = satellites[j].position.x;
+         renderState.y[j] = satellites[j].position.y;
+         renderState.red[j] = satellites[j].identifier.red;
+         renderState.green[j] = satellites[j].identifier.green;
+         renderState.blue[j] = satellites[j].identifier.blue;
+      }
+   }
+
+   // The grid covers the window and all satellites
+   if(useGrid && !satelliteGridBuild(&renderGrid, renderState.x, renderState.y, 1,
+                                     SATELLITE_COUNT, 0.f, 0.f,
+                                     WINDOW_WIDTH - 1, WINDOW_HEIGHT - 1,
+                                     2.0f * SATELLITE_RADIUS)){
+      printf("Cannot allocate the satellite grid\n");
+      exit(1);
+   }
+
+   if(blendTheta > 0.f &&
+      !satelliteQuadtreeBuild(&blendTree, renderState.x, renderState.y,
+                              renderState.red, renderState.green,
+                              renderState.blue, SATELLITE_COUNT)){
+      printf("Cannot allocate the blend quadtree\n");
+      exit(1);
+   }
+}
+
+// Hands the frame just rendered to the recorder
+static void recordFrame(void){
+   if(recordPath){
+      frameRecorderSubmit(&recorder, frameNumber, pixelFormat == PIXEL_FLOAT ?
+                          (const void*)pixels : (const void*)packedPixels);
+   }
+}
+
+// Appends the state that starts the next frame when it is due. Benchmark
+// runs render the same frame again and write nothing new.
+static void saveSnapshot(void){
+   unsigned int next = frameNumber + 1;
+   if(snapshotPath && next % snapshotEvery == 0 && (long long)next > lastSnapshotFrame){
+      if(!snapshotAppend(&snapshots, next, satellites)){
+         printf("Cannot write the snapshot of frame %u\n", next);
+      }
+      lastSnapshotFrame = next;
+   }
+}
+
+// render() draws float colors, so a window shows packed frames unpacked
+static void showPackedPixels(void){
+#ifndef HEADLESS
+   if(!storeFloatPixels){
+      pixelFormatUnpack(pixelFormat, packedPixels, &pixels[0].red, SIZE);
+   }
+#endif
+}
+
+// Colors the tile (left, bottom) .. (right - 1, top - 1)
+static void shadeTile(int left, int bottom, int right, int top, int worker){
+
+   // The approximate blend has one shader for all SIMD levels
+   if(blendTheta > 0.f){
+      for(int row = bottom; row < top; ++row){
+         shadeSpanApproximate(row, left, right);
+      }
+      return;
+   }
+
+#ifdef HAVE_X86_SIMD
+   if(engineSimd == SIMD_AVX512){
+      shadeTileAVX512(left, bottom, right, top, &tileScratch[worker]);
+      return;
+   }
+   if(engineSimd == SIMD_AVX2){
+      shadeTileAVX2(left, bottom, right, top, &tileScratch[worker]);
+      return;
+   }
+#endif
+
+   if(useGrid){
+      for(int row = bottom; row < top; ++row){
+         for(int i = row * WINDOW_WIDTH + left; i < row * WINDOW_WIDTH + right; ++i){
+            shadePixelGrid(i);
+         }
+      }
+   } else if(SATELLITE_COUNT == DEFAULT_SATELLITE_COUNT){
+      GRAPHICS_PIXEL_LOOP(DEFAULT_SATELLITE_COUNT)
+   } else {
+      GRAPHICS_PIXEL_LOOP(SATELLITE_COUNT)
+   }
+}
+
+// Whether an incremental frame shades the tile again, see tilereuse.h.
+// Its samples are compared with the blend of the frame the tile was shaded
+// in. Tiles that are kept are marked in tileReused for --verify.
+static int tileNeedsShading(int tile, int left, int bottom, int right, int top){
+   if(incrementalThreshold <= 0.f){
+      return 1;
+   }
+   float samples[3 * TILE_SAMPLES];
+   float* shaded = &tileSamples[(size_t)tile * 3 * TILE_SAMPLES];
+   tileSampleBlend(&tileNow, left, bottom, right, top, samples);
+   int shade = shadeEveryTile ||
+               !tileKeepsNearest(&tilePrevious, &tileNow, SATELLITE_RADIUS,
+                                 left, bottom, right, top) ||
+               !(tileBlendChange(samples, shaded) <= incrementalThreshold);
+   tileReused[tile] = !shade;
+   if(shade){
+      memcpy(shaded, samples, sizeof(samples));
+      return 1;
+   }
+   atomic_fetch_add(&tilesReused, 1);
+   return 0;
+}
+
+// Colors the tiles begin .. end - 1, numbered row by row from the bottom
+// left, and times every one of them
+static void graphicsTask(void* context, int begin, int end, int worker){
+   (void)context;
+   long long start = nowNanoseconds();
+   for(int tile = begin; tile < end; ++tile){
+      int left = tile % tileColumns * tileSize;
+      int bottom = tile / tileColumns * tileSize;
+      int right = left + tileSize < WINDOW_WIDTH ? left + tileSize : WINDOW_WIDTH;
+      int top = bottom + tileSize < WINDOW_HEIGHT ? bottom + tileSize : WINDOW_HEIGHT;
+      if(tileNeedsShading(tile, left, bottom, right, top)){
+         shadeTile(left, bottom, right, top, worker);
+      }
+      long long finish = nowNanoseconds();
+      tileCost[tile] = finish - start;
+      threadRenderTime[(size_t)worker * THREAD_TIME_STRIDE] += finish - start;
+      start = finish;
+   }
+}
+
+// Adds the tile times of the frame just rendered to the totals
+static void recordTileCosts(void){
+   for(int tile = 0; tile < tileColumns * tileRows; ++tile){
+      tileCostSum[tile] += tileCost[tile];
+   }
+   tileCostFrames++;
+   tilesRendered += tileColumns * tileRows;
+}
+
+// Prints how evenly the rendering work was spread over the tiles and the
+// threads, and writes the per tile table if asked to
+static void reportTileCosts(void){
+   int tiles = tileColumns * tileRows;
+   if(tileCostFrames == 0 || tiles == 0){
+      return;
+   }
+   long long total = 0;
+   int slowest = 0;
+   for(int tile = 0; tile < tiles; ++tile){
+      total += tileCostSum[tile];
+      if(tileCostSum[tile] > tileCostSum[slowest]){
+         slowest = tile;
+      }
+   }
+   double mean = (double)total / tiles / tileCostFrames;
+   double max = (double)tileCostSum[slowest] / tileCostFrames;
+   printf("Tile cost per frame: mean %.1f us, max %.1f us at tile (%i, %i), max/mean %.2f\n",
+          mean / 1e3, max / 1e3, slowest % tileColumns, slowest / tileColumns,
+          mean > 0 ? max / mean : 0.0);
+   if(incrementalThreshold > 0.f){
+      printf("Incremental rendering reused %.1f%% of the tiles\n",
+             100.0 * atomic_load(&tilesReused) / tilesRendered);
+   }
+
+   long long busiest = 0, threadTotal = 0;
+   for(int t = 0; t < enginePool.threads; ++t){
+      long long time = threadRenderTime[(size_t)t * THREAD_TIME_STRIDE];
+      threadTotal += time;
+      busiest = time > busiest ? time : busiest;
+   }
+   if(threadTotal > 0){
+      printf("Render thread load: max/mean %.2f over %i threads\n",
+             (double)busiest * enginePool.threads / threadTotal, enginePool.threads);
+   }
+
+   if(tileCostFile){
+      FILE* file = fopen(tileCostFile, "w");
+      if(!file){
+         printf("Cannot write tile costs to %s\n", tileCostFile);
+         return;
+      }
+      // Top row of tiles first, like the window shows them
+      for(int row = tileRows - 1; row >= 0; --row){
+         for(int column = 0; column < tileColumns; ++column){
+            fprintf(file, "%s%.1f", column ? "," : "",
+                    tileCostSum[row * tileColumns + column] / 1e3 / tileCostFrames);
          }
+         fprintf(file, "\n");
       }
-      pixels[i] = renderColor;
+      fclose(file);
+      printf("Tile costs in microseconds written to %s\n", tileCostFile);
    }
 }
 
+// ## You are asked to make this code parallel ##
+// Rendering loop (This is called once a frame after physics engine) 
+// Decides the color for each pixel.
+void parallelGraphicsEngine(){
+   beginPerfPhase();
+   prepareGraphics();
+   taskPoolFor(&enginePool, tileColumns * tileRows, 1, graphicsTask, NULL);
+   recordTileCosts();
+   showPackedPixels();
+   endPerfPhase(PERF_GRAPHICS);
+   reportPerfFrame();
+   recordFrame();
+   saveSnapshot();
+}
+
 // ## You may add your own destrcution routines here ##
 void destroy(void){
-
+   checkPackedPixels();
+   free(packedPixels);
+   free(tileSamples);
+   free(previousX);
+   free(previousY);
+   free(tileReused);
+   free(weightsCache);
+   free(physicsState.x);
+   free(physicsState.y);
+   free(physicsState.vx);
+   free(physicsState.vy);
+   free(renderState.x);
+   free(renderState.y);
+   free(renderState.red);
+   free(renderState.green);
+   free(renderState.blue);
+   satelliteGridFree(&renderGrid);
+   satelliteQuadtreeFree(&blendTree);
+   free(pipelineNext);
+   reportTileCosts();
+   reportPerfRun();
+   frameRecorderClose(&recorder);
+   snapshotWriterClose(&snapshots);
+   for(int t = 0; t < enginePool.threads; ++t){
+      free(tileScratch[t].weights);
+      free(tileScratch[t].red);
+      free(tileScratch[t].green);
+      free(tileScratch[t].blue);
+      free(tileScratch[t].shortest);
+      free(tileScratch[t].nearest);
+      free(tileScratch[t].hits);
+   }
+   free(tileScratch);
+   free(tileCost);
+   free(tileCostSum);
+   free(threadRenderTime);
+   taskPoolDestroy(&enginePool);
 }
 
 
@@ -351,8 +2080,8 @@ void sequentialPhysicsEngine(satellite *s){
 
    // double precision required for accumulation inside this routine,
    // but float storage is ok outside these loops.
-   doublevector tmpPosition[SATELLITE_COUNT];
-   doublevector tmpVelocity[SATELLITE_COUNT];
+   doublevector* tmpPosition = (doublevector*)malloc(sizeof(doublevector) * SATELLITE_COUNT);
+   doublevector* tmpVelocity = (doublevector*)malloc(sizeof(doublevector) * SATELLITE_COUNT);
 
    for (int i = 0; i < SATELLITE_COUNT; ++i) {
        tmpPosition[i].x = s[i].position.x;
@@ -408,13 +2137,15 @@ void sequentialPhysicsEngine(satellite *s){
        s[i].velocity.x = tmpVelocity[i].x;
        s[i].velocity.y = tmpVelocity[i].y;
    }
+   free(tmpPosition);
+   free(tmpVelocity);
 }
 
 // Just some value that barely passes for OpenCL example program
 #define ALLOWED_FP_ERROR 0.08
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
 void errorCheck(){
-   for(unsigned int i=0; i < SIZE; ++i) {
+   for(unsigned int i=0; i < PIXEL_COUNT; ++i) {
       if(fabs(correctPixels[i].red - pixels[i].red) > ALLOWED_FP_ERROR ||
          fabs(correctPixels[i].green - pixels[i].green) > ALLOWED_FP_ERROR ||
          fabs(correctPixels[i].blue - pixels[i].blue) > ALLOWED_FP_ERROR) {
@@ -426,62 +2157,454 @@ void errorCheck(){
    printf("Error check passed!\n");
 }
 
-int totalTimeAcc, satelliteMovementAcc, pixelColoringAcc, frameCount;
+long long totalTimeAcc, satelliteMovementAcc, pixelColoringAcc;
+int frameCount;
+
+// Every measured frame, summarized as percentiles at exit
+frameTimings frameStats;
+
+// Headless builds render directly from compute()
+void render(void);
+
+// Prints the largest deviation of the satellites s from the Euler
+// reference: relative for positions and velocities as in closeEnough, and
+// absolute in pixels for the positions
+static void reportPhysicsDeviation(const satellite* s){
+   double relative = 0.0, pixelDistance = 0.0;
+   for(int i = 0; i < SATELLITE_COUNT; ++i){
+      const float value[] = {s[i].position.x, s[i].position.y,
+                             s[i].velocity.x, s[i].velocity.y};
+      const float reference[] = {backupSatelites[i].position.x,
+                                 backupSatelites[i].position.y,
+                                 backupSatelites[i].velocity.x,
+                                 backupSatelites[i].velocity.y};
+      for(int k = 0; k < 4; ++k){
+         double difference = fabs((double)value[k] - reference[k]);
+         relative = fmax(relative, difference / fmax(1.0, fabs(reference[k])));
+         if(k < 2){
+            pixelDistance = fmax(pixelDistance, difference);
+         }
+      }
+   }
+   printf("Physics deviation from the Euler reference: %.3g relative "
+          "(tolerance %.0e), %.3g pixels\n", relative, PHYSICS_TOLERANCE, pixelDistance);
+}
+
+// Compares the approximate blend with the sequential result. The tree
+// aggregates only change the blend, so every deviation shows up here.
+static void reportBlendError(void){
+   double maxError = 0.0, errorSum = 0.0;
+   int over = 0;
+   for(int i = 0; i < SIZE; ++i){
+      double error = fmax(fabs(correctPixels[i].red - pixels[i].red),
+                          fmax(fabs(correctPixels[i].green - pixels[i].green),
+                               fabs(correctPixels[i].blue - pixels[i].blue)));
+      if(!(error <= ALLOWED_FP_ERROR)){
+         over++;
+      }
+      if(error > maxError){
+         maxError = error;
+      }
+      errorSum += error;
+   }
+   printf("Approximate blend (theta %.3f): max error %.5f, mean error %.7f, "
+          "%i of %i pixels over ALLOWED_FP_ERROR %.2f\n", blendTheta, maxError,
+          errorSum / (SIZE), over, SIZE, ALLOWED_FP_ERROR);
+}
+
+static int closeEnough(float value, float reference){
+   return fabsf(value - reference) <=
+      PHYSICS_TOLERANCE * fmaxf(1.0f, fabsf(reference));
+}
+
+// True while the physics engine reproduces sequentialPhysicsEngine bit by bit
+static int physicsBitExact(void){
+   return !fastPhysics && physicsIntegrator == INTEGRATOR_EULER;
+}
+
+// Compares a satellite with the sequential result. Bit-exact unless the
+// integrator trades exactness for speed, see PHYSICS_TOLERANCE.
+static int satellitesMatch(const satellite* a, const satellite* b){
+   if(physicsBitExact()){
+      return memcmp(a, b, sizeof(satellite)) == 0;
+   }
+   return closeEnough(a->position.x, b->position.x) &&
+          closeEnough(a->position.y, b->position.y) &&
+          closeEnough(a->velocity.x, b->velocity.x) &&
+          closeEnough(a->velocity.y, b->velocity.y);
+}
+
+// Compares the satellites s with the sequential result in backupSatelites
+static void checkPhysics(const satellite* s){
+   if(!physicsBitExact()){
+      reportPhysicsDeviation(s);
+   }
+   for (int i = 0; i < SATELLITE_COUNT; i++) {
+      if (!satellitesMatch(&s[i], &backupSatelites[i])) {
+         printf("Incorrect satellite data of satellite: %d\n", i);
+         getchar();
+      }
+   }
+}
+
+// Moment the last item of each pipelined stage finished
+static _Atomic long long pipelinePhysicsEnd;
+static _Atomic long long pipelineGraphicsEnd;
+
+static void atomicMaxTime(_Atomic long long* target, long long value){
+   long long current = atomic_load(target);
+   while(current < value && !atomic_compare_exchange_weak(target, &current, value)){
+   }
+}
+
+// Items 0 .. physicsTaskCount() - 1 of the pipelined job are physics of
+// pipelineNext, the rest are render tiles of the current frame. Threads that
+// finish their share of one stage steal from the other.
+static void pipelineTask(void* context, int begin, int end, int worker){
+   (void)context;
+   int physicsItems = physicsTaskCount();
+   if(begin < physicsItems){
+      int physicsEnd = end < physicsItems ? end : physicsItems;
+      physicsTask(pipelineNext, begin, physicsEnd, worker);
+      atomicMaxTime(&pipelinePhysicsEnd, nowNanoseconds());
+   }
+   if(end > physicsItems){
+      graphicsTask(NULL, (begin > physicsItems ? begin : physicsItems) - physicsItems,
+                   end - physicsItems, worker);
+      atomicMaxTime(&pipelineGraphicsEnd, nowNanoseconds());
+   }
+}
+
+// Runs the physics of the next frame and the rendering of this one at the
+// same time and returns how long after the start each stage finished
+static void pipelinedStages(long long* physicsTime, long long* graphicsTime){
+   long long start = nowNanoseconds();
+   beginPerfPhase();
+   memcpy(pipelineNext, satellites, sizeof(satellite) * SATELLITE_COUNT);
+   prepareGraphics();
+   atomic_store(&pipelinePhysicsEnd, start);
+   atomic_store(&pipelineGraphicsEnd, start);
+   taskPoolFor(&enginePool, physicsTaskCount() + tileColumns * tileRows,
+               physicsTaskGrain(), pipelineTask, NULL);
+   recordTileCosts();
+   showPackedPixels();
+   endPerfPhase(PERF_PIPELINED);
+   reportPerfFrame();
+   recordFrame();
+   saveSnapshot();
+   *physicsTime = atomic_load(&pipelinePhysicsEnd) - start;
+   *graphicsTime = atomic_load(&pipelineGraphicsEnd) - start;
+}
+
+// Number of frames --verify checks, 0 for the normal frame loop
+int verifyFrames = 0;
+
+// Runs verifyFrames frames of the chosen engines, each checked against the
+// sequential engines, see verifyreport.h. The physics of a frame is
+// compared with sequentialPhysicsEngine from the same satellites, and with
+// an independent sequential trajectory for the drift over the run. The
+// pixels are compared with sequentialGraphicsEngine on the same satellites.
+// With --reference the sequential physics comes from the reference file
+// instead, and every frame starts from the reference state. Returns the
+// exit status.
+static int verifyEngines(int frames){
+   snapshotFile reference = {0};
+   if(referencePath){
+      if(!snapshotOpen(&reference, referencePath) ||
+         !snapshotFitsRun(reference.header, referencePath)){
+         snapshotClose(&reference);
+         return 1;
+      }
+      const snapshotRecord* start = snapshotFind(&reference, frameNumber);
+      if(!(reference.header->flags & SNAPSHOT_SEQUENTIAL) || !start ||
+         !snapshotRecordValid(&reference, start)){
+         printf("%s is no sequential reference from frame %u\n", referencePath, frameNumber);
+         snapshotClose(&reference);
+         return 1;
+      }
+      memcpy(satellites, snapshotSatellites(start), sizeof(satellite) * SATELLITE_COUNT);
+   }
+   satellite* before = (satellite*)malloc(sizeof(satellite) * SATELLITE_COUNT);
+   satellite* trajectory = (satellite*)malloc(sizeof(satellite) * SATELLITE_COUNT);
+   // Tolerance of every pixel, see --incremental below
+   float* tolerances = incrementalThreshold > 0.f ? (float*)malloc(sizeof(float) * SIZE) : NULL;
+   if(!before || !trajectory || (incrementalThreshold > 0.f && !tolerances)){
+      printf("Cannot allocate the verification buffers\n");
+      free(before);
+      free(trajectory);
+      free(tolerances);
+      snapshotClose(&reference);
+      return 1;
+   }
+   memcpy(trajectory, satellites, sizeof(satellite) * SATELLITE_COUNT);
+   int stride = sizeof(satellite) / sizeof(float);
+
+   // Packed frames round once more. The tiles --incremental kept are
+   // checked against its threshold instead, so a change it missed fails.
+   float rounding = pixelFormat != PIXEL_FLOAT ? PACKED_PIXEL_ERROR - ALLOWED_FP_ERROR : 0.f;
+   float tolerance = ALLOWED_FP_ERROR + rounding;
+
+   long long failedPixels = 0, largestUlp = 0;
+   int failedFrames = 0;
+   double maxError = 0.0, errorSum = 0.0;
+   for(int frame = 0; frame < frames; ++frame){
+      memcpy(before, satellites, sizeof(satellite) * SATELLITE_COUNT);
+      if(pipelineFrames && pipelinePrimed){
+         satellite* next = pipelineNext;
+         pipelineNext = satellites;
+         satellites = next;
+      } else {
+         parallelPhysicsEngine();
+      }
+      if(reference.map){
+         const snapshotRecord* next = snapshotFind(&reference, frameNumber + 1);
+         if(!next || !snapshotRecordValid(&reference, next)){
+            printf("%s has no valid state of frame %u\n", referencePath, frameNumber + 1);
+            failedFrames++;
+            break;
+         }
+         // Every frame restarts from the reference, so the drift is the
+         // distance to it
+         memcpy(backupSatelites, snapshotSatellites(next), sizeof(satellite) * SATELLITE_COUNT);
+         memcpy(trajectory, backupSatelites, sizeof(satellite) * SATELLITE_COUNT);
+      } else {
+         memcpy(backupSatelites, before, sizeof(satellite) * SATELLITE_COUNT);
+         sequentialPhysicsEngine(backupSatelites);
+         sequentialPhysicsEngine(trajectory);
+      }
+
+      int worst = 0, mismatches = 0;
+      long long ulp = floatRecordsUlpDistance(&satellites[0].position.x,
+                                              &backupSatelites[0].position.x,
+                                              SATELLITE_COUNT, stride, 4, &worst);
+      long long drift = floatRecordsUlpDistance(&satellites[0].position.x,
+                                                &trajectory[0].position.x,
+                                                SATELLITE_COUNT, stride, 4, NULL);
+      for(int i = 0; i < SATELLITE_COUNT; ++i){
+         if(!satellitesMatch(&satellites[i], &backupSatelites[i])){
+            printf("frame %u satellite %i: position %.9g %.9g velocity %.9g %.9g, "
+                   "expected %.9g %.9g %.9g %.9g\n", frameNumber, i,
+                   satellites[i].position.x, satellites[i].position.y,
+                   satellites[i].velocity.x, satellites[i].velocity.y,
+                   backupSatelites[i].position.x, backupSatelites[i].position.y,
+                   backupSatelites[i].velocity.x, backupSatelites[i].velocity.y);
+            mismatches++;
+         }
+      }
+      largestUlp = ulp > largestUlp ? ulp : largestUlp;
+      if(reference.map){
+         memcpy(satellites, backupSatelites, sizeof(satellite) * SATELLITE_COUNT);
+      }
+
+      if(pipelineFrames){
+         long long physicsTime, graphicsTime;
+         pipelinedStages(&physicsTime, &graphicsTime);
+         pipelinePrimed = 1;
+      } else {
+         parallelGraphicsEngine();
+      }
+      sequentialGraphicsEngine();
+      int keptTiles = !tolerances ? 0 :
+                      tileFillTolerances(tolerances, tileReused, tileColumns, tileRows, tileSize,
+                                         WINDOW_WIDTH, WINDOW_HEIGHT, tolerance,
+                                         incrementalThreshold + rounding);
+      pixelErrors errors;
+      verifyPixelsWithin(frameNumber, storeFloatPixels ? PIXEL_FLOAT : pixelFormat,
+                         storeFloatPixels ? (const void*)pixels : (const void*)packedPixels,
+                         &correctPixels[0].red, SIZE, WINDOW_WIDTH, tolerance, tolerances,
+                         &errors);
+      printf("Verify frame %u: physics %lld ulp (satellite %i), %i mismatches, "
+             "drift %lld ulp; pixels max error %.6f, mean %.8f, %lld over %.4f",
+             frameNumber, ulp, worst, mismatches, drift, errors.maxError,
+             errors.errorSum / (SIZE), errors.failing, tolerance);
+      if(tolerances){
+         printf(" (%.4f in the %i kept tiles)", incrementalThreshold + rounding, keptTiles);
+      }
+      printf("\n");
+
+      failedPixels += errors.failing;
+      failedFrames += mismatches > 0 || errors.failing > 0;
+      maxError = errors.maxError > maxError || errors.maxError != errors.maxError ?
+                 errors.maxError : maxError;
+      errorSum += errors.errorSum;
+      frameNumber++;
+   }
+   free(before);
+   free(trajectory);
+   free(tolerances);
+   snapshotClose(&reference);
+
+   printf("Verification %s: %i of %i frames failed, %lld failing pixels, "
+          "physics up to %lld ulp, pixels max error %.6f, mean %.8f\n",
+          failedFrames ? "FAILED" : "passed", failedFrames, frames, failedPixels,
+          largestUlp, maxError, frames > 0 ? errorSum / (SIZE) / frames : 0.0);
+   return failedFrames ? 1 : 0;
+}
+
+// Writes frames frames of sequentialPhysicsEngine to makeReferencePath, a
+// state for every frame. Returns the exit status.
+static int makeReference(int frames){
+   if(resumePath){
+      resumeSnapshot();
+   }
+   openSnapshots(makeReferencePath, SNAPSHOT_SEQUENTIAL);
+   long long start = nowNanoseconds();
+   for(int frame = 0; frame < frames; ++frame){
+      sequentialPhysicsEngine(satellites);
+      frameNumber++;
+      if(!snapshotAppend(&snapshots, frameNumber, satellites)){
+         printf("Cannot write the state of frame %u to %s\n", frameNumber, makeReferencePath);
+         return 1;
+      }
+   }
+   printf("Reference of frames %u to %u written to %s in %.3f s\n", frameNumber - frames,
+          frameNumber, makeReferencePath, (nowNanoseconds() - start) / 1e9);
+   snapshotWriterClose(&snapshots);
+   return 0;
+}
+
+// --bench N times each engine N times after benchWarmup runs, see
+// benchreport.h
+int benchRuns = 0;
+int benchWarmup = BENCH_DEFAULT_WARMUP;
+int benchFormat = BENCH_CSV;
+const char* benchOutput = NULL;
+const char* benchLabel = NULL;
+
+// Times runs calls of engine after warmup untimed ones into samples
+static void benchEngine(void (*engine)(void), long long* samples){
+   for(int run = 0; run < benchWarmup; ++run){
+      engine();
+   }
+   for(int run = 0; run < benchRuns; ++run){
+      long long start = nowNanoseconds();
+      engine();
+      samples[run] = nowNanoseconds() - start;
+   }
+}
+
+// Times parallelPhysicsEngine and parallelGraphicsEngine on their own and
+// writes a row for each. The frame number is past the checked frames, so
+// the engines run as they do in the timed frames of compute(). Returns the
+// exit status.
+static int benchmarkEngines(void){
+   FILE* file = benchOpen(benchOutput, benchFormat);
+   long long* samples = (long long*)malloc(sizeof(long long) * benchRuns);
+   if(!file || !samples){
+      printf("Cannot write the benchmark rows\n");
+      return 1;
+   }
+   benchNotes(stderr);
+   frameNumber = 2;
+
+   const char* simdNames[] = {"auto", "scalar", "avx2", "avx512"};
+   const char* integratorNames[] = {"euler", "verlet", "rk4", "kepler"};
+   char variant[128];
+   snprintf(variant, sizeof(variant), "%s %s%s %s%s %s", simdNames[engineSimd],
+            integratorNames[physicsIntegrator], fastPhysics ? " fast" : "",
+            useGrid ? "grid" : "no-grid", blendTheta > 0.f ? " approximate" : "",
+            pixelFormatName(pixelFormat));
+   int steps = physicsIntegrator == INTEGRATOR_EULER ? PHYSICSUPDATESPERFRAME :
+               integratorSteps;
+   benchRow row = {"parallel", "physics", variant, benchLabel, SATELLITE_COUNT,
+                   WINDOW_WIDTH, WINDOW_HEIGHT, enginePool.threads, steps,
+                   benchWarmup, benchRuns, (double)SATELLITE_COUNT * steps,
+                   "satellite-steps/s"};
+   benchEngine(parallelPhysicsEngine, samples);
+   benchWriteRow(file, benchFormat, &row, samples);
+
+   // Each run shades the same satellites, which --incremental would reuse
+   row.engine = "graphics";
+   row.work = (double)WINDOW_WIDTH * WINDOW_HEIGHT;
+   row.unit = "pixels/s";
+   benchEngine(parallelGraphicsEngine, samples);
+   benchWriteRow(file, benchFormat, &row, samples);
+
+   free(samples);
+   if(file != stdout){
+      fclose(file);
+   }
+   return 0;
+}
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
 void compute(void){
-   int timeSinceStart = glutGet(GLUT_ELAPSED_TIME);
-
-   // Error check during first frames
-   if (frameNumber < 2) {
-      memcpy(backupSatelites, satellites, sizeof(satellite) * SATELLITE_COUNT);
-      sequentialPhysicsEngine(backupSatelites);
-   }
-   parallelPhysicsEngine();
-   if (frameNumber < 2) {
-      for (int i = 0; i < SATELLITE_COUNT; i++) {
-         if (memcmp (&satellites[i], &backupSatelites[i], sizeof(satellite))) {
-            printf("Incorrect satellite data of satellite: %d\n", i);
-            getchar();
-         }
+   long long timeSinceStart = nowNanoseconds();
+   long long satelliteMovementTime, pixelColoringTime;
+
+   if(pipelineFrames && pipelinePrimed){
+      // The physics of this frame ran during the previous one
+      satellite* next = pipelineNext;
+      pipelineNext = satellites;
+      satellites = next;
+   } else {
+      // Error check during first frames
+      if (frameNumber < 2) {
+         memcpy(backupSatelites, satellites, sizeof(satellite) * SATELLITE_COUNT);
+         sequentialPhysicsEngine(backupSatelites);
+      }
+      parallelPhysicsEngine();
+      if (frameNumber < 2) {
+         checkPhysics(satellites);
       }
    }
 
-   int satelliteMovementMoment = glutGet(GLUT_ELAPSED_TIME);
-   int satelliteMovementTime = satelliteMovementMoment  - timeSinceStart;
+   if(pipelineFrames){
+      pipelinedStages(&satelliteMovementTime, &pixelColoringTime);
+      pipelinePrimed = 1;
 
-   // Decides the colors for the pixels
-   parallelGraphicsEngine();
+      // The next frame is checked against the satellites rendered now
+      if (frameNumber < 2) {
+         memcpy(backupSatelites, satellites, sizeof(satellite) * SATELLITE_COUNT);
+         sequentialPhysicsEngine(backupSatelites);
+         checkPhysics(pipelineNext);
+      }
+   } else {
+      long long satelliteMovementMoment = nowNanoseconds();
+      satelliteMovementTime = satelliteMovementMoment  - timeSinceStart;
+
+      // Decides the colors for the pixels
+      parallelGraphicsEngine();
 
-   int pixelColoringMoment = glutGet(GLUT_ELAPSED_TIME);
-   int pixelColoringTime =  pixelColoringMoment - satelliteMovementMoment;
+      long long pixelColoringMoment = nowNanoseconds();
+      pixelColoringTime =  pixelColoringMoment - satelliteMovementMoment;
+   }
 
-   int finishTime = glutGet(GLUT_ELAPSED_TIME);
+   long long finishTime = nowNanoseconds();
    // Sequential code is used to check possible errors in the parallel version
    if(frameNumber < 2){
       sequentialGraphicsEngine();
+      if(blendTheta > 0.f){
+         reportBlendError();
+      }
       errorCheck();
    } else if (frameNumber == 2) {
       previousFinishTime = finishTime;
       printf("Time spent on moving satellites + Time spent on space coloring = Total time in milliseconds between frames (might not equal the sum of the left-hand expression)\n");
    } else if (frameNumber > 2) {
      // Print timings
-     int totalTime = finishTime - previousFinishTime;
+     long long totalTime = finishTime - previousFinishTime;
      previousFinishTime = finishTime;
 
-     printf("Latency of this frame %i + %i = %ims \n",
-             satelliteMovementTime, pixelColoringTime, totalTime);
+     printf("Latency of this frame %.3f + %.3f = %.3fms \n",
+             satelliteMovementTime / 1e6, pixelColoringTime / 1e6, totalTime / 1e6);
 
      frameCount++;
      totalTimeAcc += totalTime;
      satelliteMovementAcc += satelliteMovementTime;
      pixelColoringAcc += pixelColoringTime;
-     printf("Averaged over all frames: %i + %i = %ims.\n",
-             satelliteMovementAcc/frameCount, pixelColoringAcc/frameCount, totalTimeAcc/frameCount);
+     frameTimingsRecord(&frameStats, satelliteMovementTime, pixelColoringTime, totalTime);
+     printf("Averaged over all frames: %.3f + %.3f = %.3fms.\n",
+             satelliteMovementAcc / 1e6 / frameCount, pixelColoringAcc / 1e6 / frameCount,
+             totalTimeAcc / 1e6 / frameCount);
 
    }
    // Render the frame
+#ifndef HEADLESS
    glutPostRedisplay();
+#else
+   render();
+#endif
 }
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
@@ -554,6 +2677,9 @@ void fixedDestroy(void){
    free(correctPixels);
    free(satellites);
 
+   frameTimingsPrint(&frameStats);
+   frameTimingsFree(&frameStats);
+
    if(seed != 0){
      printf("Used seed: %i\n", seed);
    }
@@ -561,22 +2687,214 @@ void fixedDestroy(void){
 
 // ¤¤ DO NOT EDIT THIS FUNCTION ¤¤
 // Renders pixels-buffer to the window 
+// In headless builds only the frame counter advances
 void render(void){
+#ifndef HEADLESS
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
    glDrawPixels(WINDOW_WIDTH, WINDOW_HEIGHT, GL_RGB, GL_FLOAT, pixels);
    glutSwapBuffers();
+#endif
    frameNumber++;
 }
 
+// Number of frames a headless run computes unless --frames is given
+#define HEADLESS_DEFAULT_FRAMES 100
+
+// Reads "--name value" with a positive integer value. Returns 1 if argv[*i]
+// was the named option, advancing *i past its value.
+static int intOption(int argc, char** argv, int* i, const char* name, int* value){
+   if(strcmp(argv[*i], name) != 0){
+      return 0;
+   }
+   if(*i + 1 >= argc || atoi(argv[*i + 1]) <= 0){
+      printf("%s needs a positive integer value\n", name);
+      exit(1);
+   }
+   *value = atoi(argv[++*i]);
+   return 1;
+}
+
+// Reads "--name value" with a positive real value, see intOption
+static int floatOption(int argc, char** argv, int* i, const char* name, float* value){
+   if(strcmp(argv[*i], name) != 0){
+      return 0;
+   }
+   if(*i + 1 >= argc || !(atof(argv[*i + 1]) > 0.0)){
+      printf("%s needs a positive value\n", name);
+      exit(1);
+   }
+   *value = (float)atof(argv[++*i]);
+   return 1;
+}
+
+// Command line: [seed] [--frames N] [--satellites N] [--width N]
+//               [--height N] [--substeps N] [--simd scalar|avx2|avx512]
+//               [--fast-physics] [--grid|--no-grid] [--blend-theta T]
+//               [--integrator euler|verlet|rk4|kepler] [--steps N]
+//               [--pipeline] [--threads N] [--no-pin] [--tile N]
+//               [--tile-costs FILE] [--pixel-format float|rgba8|half]
+//               [--incremental T] [--refresh K] [--verify N]
+//               [--bench N] [--bench-warmup N] [--bench-format csv|json]
+//               [--bench-output FILE] [--bench-label TEXT]
+//               [--perf] [--perf-file FILE] [--record FILE|-]
+//               [--record-format rgb8|chunked] [--record-slots N]
+//               [--record-lossless] [--snapshot FILE] [--snapshot-every K]
+//               [--resume FILE] [--resume-frame N] [--make-reference FILE]
+//               [--verify N --reference FILE]
+static void parseArguments(int argc, char** argv, int* frames){
+   // Frames recorded to stdout need it before the first line of output
+   for(int i = 1; i + 1 < argc; ++i){
+      if(strcmp(argv[i], "--record") == 0 && strcmp(argv[i + 1], "-") == 0){
+         frameRecorderClaimStdout();
+      }
+   }
+   for(int i = 1; i < argc; ++i){
+      if(intOption(argc, argv, &i, "--frames", frames) ||
+         intOption(argc, argv, &i, "--satellites", &satelliteCount) ||
+         intOption(argc, argv, &i, "--width", &windowWidth) ||
+         intOption(argc, argv, &i, "--height", &windowHeight) ||
+         intOption(argc, argv, &i, "--substeps", &physicsUpdatesPerFrame) ||
+         intOption(argc, argv, &i, "--steps", &integratorSteps) ||
+         intOption(argc, argv, &i, "--threads", &engineThreads) ||
+         intOption(argc, argv, &i, "--tile", &tileSize) ||
+         intOption(argc, argv, &i, "--refresh", &refreshFrames) ||
+         intOption(argc, argv, &i, "--verify", &verifyFrames) ||
+         intOption(argc, argv, &i, "--bench", &benchRuns) ||
+         intOption(argc, argv, &i, "--bench-warmup", &benchWarmup) ||
+         intOption(argc, argv, &i, "--record-slots", &recordSlots) ||
+         intOption(argc, argv, &i, "--snapshot-every", &snapshotEvery) ||
+         floatOption(argc, argv, &i, "--incremental", &incrementalThreshold) ||
+         floatOption(argc, argv, &i, "--blend-theta", &blendTheta)){
+         continue;
+      } else if(strcmp(argv[i], "--simd") == 0 && i + 1 < argc){
+         const char* level = argv[++i];
+         if(strcmp(level, "scalar") == 0){
+            engineSimd = SIMD_SCALAR;
+         } else if(strcmp(level, "avx2") == 0){
+            engineSimd = SIMD_AVX2;
+         } else if(strcmp(level, "avx512") == 0){
+            engineSimd = SIMD_AVX512;
+         } else {
+            printf("Unknown SIMD level: %s\n", level);
+            exit(1);
+         }
+      } else if(strcmp(argv[i], "--integrator") == 0 && i + 1 < argc){
+         const char* integrator = argv[++i];
+         if(strcmp(integrator, "euler") == 0){
+            physicsIntegrator = INTEGRATOR_EULER;
+         } else if(strcmp(integrator, "verlet") == 0){
+            physicsIntegrator = INTEGRATOR_VERLET;
+         } else if(strcmp(integrator, "rk4") == 0){
+            physicsIntegrator = INTEGRATOR_RK4;
+         } else if(strcmp(integrator, "kepler") == 0){
+            physicsIntegrator = INTEGRATOR_KEPLER;
+         } else {
+            printf("Unknown integrator: %s\n", integrator);
+            exit(1);
+         }
+      } else if(strcmp(argv[i], "--pipeline") == 0){
+         pipelineFrames = 1;
+      } else if(strcmp(argv[i], "--tile-costs") == 0 && i + 1 < argc){
+         tileCostFile = argv[++i];
+      } else if(strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc){
+         snapshotPath = argv[++i];
+      } else if(strcmp(argv[i], "--resume") == 0 && i + 1 < argc){
+         resumePath = argv[++i];
+      } else if(strcmp(argv[i], "--resume-frame") == 0 && i + 1 < argc){
+         resumeFrame = atoi(argv[++i]);
+      } else if(strcmp(argv[i], "--make-reference") == 0 && i + 1 < argc){
+         makeReferencePath = argv[++i];
+      } else if(strcmp(argv[i], "--reference") == 0 && i + 1 < argc){
+         referencePath = argv[++i];
+      } else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc){
+         recordPath = argv[++i];
+      } else if(strcmp(argv[i], "--record-format") == 0 && i + 1 < argc){
+         recordContainer = frameRecorderContainerParse(argv[++i]);
+         if(recordContainer < 0){
+            printf("--record-format is rgb8 or chunked\n");
+            exit(1);
+         }
+      } else if(strcmp(argv[i], "--record-lossless") == 0){
+         recordLossless = 1;
+      } else if(strcmp(argv[i], "--perf") == 0){
+         perfEnabled = 1;
+      } else if(strcmp(argv[i], "--perf-file") == 0 && i + 1 < argc){
+         perfEnabled = 1;
+         perfFileName = argv[++i];
+      } else if(strcmp(argv[i], "--bench-format") == 0 && i + 1 < argc){
+         benchFormat = strcmp(argv[++i], "json") == 0 ? BENCH_JSON : BENCH_CSV;
+      } else if(strcmp(argv[i], "--bench-output") == 0 && i + 1 < argc){
+         benchOutput = argv[++i];
+      } else if(strcmp(argv[i], "--bench-label") == 0 && i + 1 < argc){
+         benchLabel = argv[++i];
+      } else if(strcmp(argv[i], "--pixel-format") == 0 && i + 1 < argc){
+         pixelFormat = pixelFormatParse(argv[++i]);
+         if(pixelFormat < 0){
+            printf("--pixel-format is float, rgba8 or half\n");
+            exit(1);
+         }
+      } else if(strcmp(argv[i], "--no-pin") == 0){
+         pinThreads = 0;
+      } else if(strcmp(argv[i], "--fast-physics") == 0){
+         fastPhysics = 1;
+      } else if(strcmp(argv[i], "--grid") == 0){
+         useGrid = 1;
+      } else if(strcmp(argv[i], "--no-grid") == 0){
+         useGrid = 0;
+      } else if(argv[i][0] != '-'){
+         seed = atoi(argv[i]);
+         printf("Using seed: %i\n", seed);
+      } else {
+         printf("Unknown option: %s\n", argv[i]);
+         exit(1);
+      }
+   }
+   if(referencePath && verifyFrames <= 0){
+      printf("--reference only replaces the sequential physics of --verify\n");
+      exit(1);
+   }
+}
+
 // DO NOT EDIT THIS FUNCTION
 // Inits glut and start mainloop
 int main(int argc, char** argv){
 
-   if(argc > 1){
-     seed = atoi(argv[1]);
-     printf("Using seed: %i\n", seed);
+   int frames = HEADLESS_DEFAULT_FRAMES;
+   parseArguments(argc, argv, &frames);
+
+   // The verification runs without a window in every build
+   if(verifyFrames > 0){
+      atexit(fixedDestroy);
+      fixedInit(seed);
+      init();
+      exit(verifyEngines(verifyFrames));
+   }
+   if(benchRuns > 0){
+      atexit(fixedDestroy);
+      fixedInit(seed);
+      init();
+      exit(benchmarkEngines());
+   }
+   if(makeReferencePath){
+      atexit(fixedDestroy);
+      fixedInit(seed);
+      exit(makeReference(frames));
    }
 
+#ifdef HEADLESS
+   // Without a seed srand() is never called, so rand() starts from its
+   // default state and every headless run sees the same satellites.
+   atexit(fixedDestroy);
+   fixedInit(seed);
+   init();
+
+   for(int frame = 0; frame < frames; ++frame){
+      compute();
+   }
+   return 0;
+#else
+   (void)frames;
+
    // Init glut window
    glutInit(&argc, argv);
    glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
@@ -594,4 +2912,5 @@ int main(int argc, char** argv){
 
    // Start main loop
    glutMainLoop();
+#endif
 }
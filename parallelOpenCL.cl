@@ -1,92 +1,279 @@
-typedef struct{
-	float x;
-	float y;
-} floatvector;
-
-// Stores rendered colors.
-typedef struct{
-	float red;
-	float green;
-	float blue;
-} color;
-
-// Stores the satellite data, which fly around black hole in the space
-typedef struct{
-	color identifier;
-	floatvector position;
-	floatvector velocity;
-} satellite;
- 
-#define WINDOW_WIDTH  1024
-#define WINDOW_HEIGHT 1024
-#define SATELLITE_COUNT 64
-#define SATELLITE_RADIUS 3.16f
-#define SIZE WINDOW_HEIGHT * WINDOW_HEIGHT
-
-
-
-__kernel void parallelOpenCL(__global satellite *satellites, __global color* pixelsOut) {
-	
+// The structs and the size helpers come from satellitetypes.h, which the
+// host puts in front of this file. The host passes every constant and the
+// runtime sizes as -D build options, so the satellite loops get compiled
+// for the actual count.
+#if !defined(WINDOW_WIDTH) || !defined(WINDOW_HEIGHT) || !defined(SATELLITE_COUNT) || \
+	!defined(SATELLITE_RADIUS) || !defined(GRAVITY) || !defined(DELTATIME)
+#error "Build options are missing, see SATELLITE_KERNEL_OPTIONS in satellitetypes.h"
+#endif
+
+
+
+// The host sorts the satellites into a uniform grid every frame, see
+// satellitegrid.h. Satellites of cell c are
+// cellSatellites[cellStart[c] .. cellStart[c + 1]) in increasing index.
+int gridCellX(float x, float originX, float cellSize, int columns) {
+	return clamp((int)floor((x - originX) / cellSize), 0, columns - 1);
+}
+
+int gridCellY(float y, float originY, float cellSize, int rows) {
+	return clamp((int)floor((y - originY) / cellSize), 0, rows - 1);
+}
+
+// The blend loop reads every satellite for every pixel. A work group
+// stages them into local memory in blocks of SATELLITE_STAGE, positions and
+// colors in separate arrays, so each satellite is read from global memory
+// once per work group and its velocity not at all.
+#ifndef SATELLITE_STAGE
+#define SATELLITE_STAGE 256
+#endif
+
+// Hit test: only the cells within the satellite radius can hold a
+// satellite that covers the pixel.
+int hitsSatellite(floatvector pixel, __global const satellite* satellites,
+	__global const int* cellStart, __global const int* cellSatellites,
+	float originX, float originY, float cellSize, int columns, int rows) {
+
+	int x0 = gridCellX(pixel.x - SATELLITE_RADIUS - 1.0f, originX, cellSize, columns);
+	int x1 = gridCellX(pixel.x + SATELLITE_RADIUS + 1.0f, originX, cellSize, columns);
+	int y0 = gridCellY(pixel.y - SATELLITE_RADIUS - 1.0f, originY, cellSize, rows);
+	int y1 = gridCellY(pixel.y + SATELLITE_RADIUS + 1.0f, originY, cellSize, rows);
+	for(int cy = y0; cy <= y1; ++cy) {
+		for(int cx = x0; cx <= x1; ++cx) {
+			int cell = cy * columns + cx;
+			for(int k = cellStart[cell]; k < cellStart[cell + 1]; ++k) {
+				int j = cellSatellites[k];
+				floatvector difference = {.x = pixel.x - satellites[j].position.x,
+										.y = pixel.y - satellites[j].position.y};
+				float distance = sqrt(difference.x * difference.x +
+									difference.y * difference.y);
+				if(distance < SATELLITE_RADIUS) {
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+// Output formats, the values of pixelformat.h. The host picks one per
+// launch: full color structs, 8 bit RGBA, or half float RGBA.
+#define PIXEL_FLOAT 0
+#define PIXEL_RGBA8 1
+#define PIXEL_HALF 2
+
+// Stores pixel i with the rounding of pixelFormatStore() on the host
+void storePixel(__global uchar* pixelsOut, int format, int i, color c) {
+	if(format == PIXEL_RGBA8) {
+		__global uchar* p = pixelsOut + 4 * i;
+		p[0] = (uchar)(clamp(c.red, 0.0f, 1.0f) * 255.0f + 0.5f);
+		p[1] = (uchar)(clamp(c.green, 0.0f, 1.0f) * 255.0f + 0.5f);
+		p[2] = (uchar)(clamp(c.blue, 0.0f, 1.0f) * 255.0f + 0.5f);
+		p[3] = 255;
+	} else if(format == PIXEL_HALF) {
+		__global half* p = (__global half*)pixelsOut + 4 * i;
+		vstore_half_rte(c.red, 0, p);
+		vstore_half_rte(c.green, 1, p);
+		vstore_half_rte(c.blue, 2, p);
+		vstore_half_rte(1.0f, 3, p);
+	} else {
+		((__global color*)pixelsOut)[i] = c;
+	}
+}
+
+// Find closest satellite by searching rings of cells around the pixel's
+// cell. Once the closest satellite so far is nearer than anything outside
+// the searched rings can be, the search stops. -1 if there is none.
+int nearestSatellite(floatvector pixel, __global const satellite* satellites,
+	__global const int* cellStart, __global const int* cellSatellites,
+	float originX, float originY, float cellSize, int columns, int rows) {
+
+	float shortestDistance = INFINITY;
+	int nearest = -1;
+	int pixelCellX = gridCellX(pixel.x, originX, cellSize, columns);
+	int pixelCellY = gridCellY(pixel.y, originY, cellSize, rows);
+	for(int ring = 0; ; ++ring) {
+		for(int cy = pixelCellY - ring; cy <= pixelCellY + ring; ++cy) {
+			if(cy < 0 || cy >= rows) {
+				continue;
+			}
+			// Inner rows only have their first and last cell in the ring
+			int edgeRow = ring == 0 || cy == pixelCellY - ring || cy == pixelCellY + ring;
+			int step = edgeRow ? 1 : 2 * ring;
+			for(int cx = pixelCellX - ring; cx <= pixelCellX + ring; cx += step) {
+				if(cx < 0 || cx >= columns) {
+					continue;
+				}
+				int cell = cy * columns + cx;
+				for(int k = cellStart[cell]; k < cellStart[cell + 1]; ++k) {
+					int j = cellSatellites[k];
+					floatvector difference = {.x = pixel.x - satellites[j].position.x,
+											.y = pixel.y - satellites[j].position.y};
+					float distance = sqrt(difference.x * difference.x +
+										difference.y * difference.y);
+					if(distance < shortestDistance ||
+					   (distance == shortestDistance && j < nearest)) {
+						shortestDistance = distance;
+						nearest = j;
+					}
+				}
+			}
+		}
+		if(shortestDistance < (ring - 0.01f) * cellSize ||
+		   (pixelCellX - ring <= 0 && pixelCellY - ring <= 0 &&
+		    pixelCellX + ring >= columns - 1 && pixelCellY + ring >= rows - 1)) {
+			return nearest;
+		}
+	}
+}
+
+// With a tileSize above 0 the pixels of the tiles marked in keptTiles keep
+// what pixelsOut already holds, see --incremental in OpenCL_modified.c.
+// keptTiles has a byte per tile of tileSize x tileSize pixels, row by row
+// from the bottom left.
+__kernel void parallelOpenCL(__global const satellite *satellites, __global uchar* pixelsOut,
+	__global const int* cellStart, __global const int* cellSatellites,
+	float originX, float originY, float cellSize, int columns, int rows, int format,
+	__global const uchar* keptTiles, int tileSize) {
+
+	__local floatvector stagedPositions[SATELLITE_STAGE];
+	__local color stagedColors[SATELLITE_STAGE];
 
 	int idx = get_global_id(0);
 	int idy = get_global_id(1);
-	
+	int localIndex = get_local_id(1) * get_local_size(0) + get_local_id(0);
+	int groupSize = get_local_size(0) * get_local_size(1);
+
+	// The global size is rounded up to whole work groups. The items outside
+	// the window and the ones of kept tiles still stage satellites, every
+	// item has to reach the barriers.
+	int inside = idx < WINDOW_WIDTH && idy < WINDOW_HEIGHT;
+	if(inside && tileSize > 0) {
+		int tileColumns = (WINDOW_WIDTH + tileSize - 1) / tileSize;
+		inside = !keptTiles[idy / tileSize * tileColumns + idx / tileSize];
+	}
+
 		// Row wise ordering
 		floatvector pixel = {.x = idx, .y = idy};
 
 		// This color is used for coloring the pixel
 		color renderColor = {.red = 0.f, .green = 0.f, .blue = 0.f};
 
-		// Find closest satellite
-		float shortestDistance = INFINITY;
+		int hit = inside && hitsSatellite(pixel, satellites, cellStart, cellSatellites,
+			originX, originY, cellSize, columns, rows);
+		if(inside && !hit) {
+			int nearest = nearestSatellite(pixel, satellites, cellStart, cellSatellites,
+				originX, originY, cellSize, columns, rows);
+			if(nearest >= 0) {
+				renderColor = satellites[nearest].identifier;
+			}
+		}
 
+		// Calculate the color based on distance to every satellite. The
+		// weights are summed in the same pass and divided out at the end.
 		float weights = 0.f;
-		int hitsSatellite = 0;
-      
-		// First Graphics satellite loop: Find the closest satellite.
-		for(int j = 0; j < SATELLITE_COUNT; ++j) {
-			floatvector difference = {.x = pixel.x - satellites[j].position.x,
-									.y = pixel.y - satellites[j].position.y};
-			float distance = sqrt(difference.x * difference.x + 
-								difference.y * difference.y);
+		color blend = {.red = 0.f, .green = 0.f, .blue = 0.f};
+		for(int base = 0; base < SATELLITE_COUNT; base += SATELLITE_STAGE){
+			int count = min(SATELLITE_STAGE, SATELLITE_COUNT - base);
 
-			if(distance < SATELLITE_RADIUS) {
-			renderColor.red = 1.0f;
-			renderColor.green = 1.0f;
-			renderColor.blue = 1.0f;
-			hitsSatellite = 1;
-			break;
-			} else {
-				float weight = 1.0f / (distance*distance*distance*distance);
-				weights += weight;
-				if(distance < shortestDistance) {
-					shortestDistance = distance;
-					renderColor = satellites[j].identifier;
-				}
+			// The previous block is used up before it is overwritten
+			barrier(CLK_LOCAL_MEM_FENCE);
+			for(int k = localIndex; k < count; k += groupSize){
+				stagedPositions[k] = satellites[base + k].position;
+				stagedColors[k] = satellites[base + k].identifier;
 			}
-		}
+			barrier(CLK_LOCAL_MEM_FENCE);
 
-		// Second graphics loop: Calculate the color based on distance to every satellite.
-		if (!hitsSatellite) {
-			for(int j = 0; j < SATELLITE_COUNT; ++j){
+			if(!inside || hit){
+				continue;
+			}
+			for(int k = 0; k < count; ++k){
 
-				floatvector difference = {.x = pixel.x - satellites[j].position.x,
-											.y = pixel.y - satellites[j].position.y};
+				floatvector difference = {.x = pixel.x - stagedPositions[k].x,
+											.y = pixel.y - stagedPositions[k].y};
 				float dist2 = (difference.x * difference.x +
 								difference.y * difference.y);
 				float weight = 1.0f/(dist2* dist2);
 
-				renderColor.red += (satellites[j].identifier.red *
-									weight /weights) * 3.0f;
-
-				renderColor.green += (satellites[j].identifier.green *
-										weight / weights) * 3.0f;
-
-				renderColor.blue += (satellites[j].identifier.blue *
-										weight / weights) * 3.0f;
+				weights += weight;
+				blend.red += stagedColors[k].red * weight;
+				blend.green += stagedColors[k].green * weight;
+				blend.blue += stagedColors[k].blue * weight;
 			}
 		}
+		if(!inside) {
+			return;
+		}
+		if(hit) {
+			renderColor.red = 1.0f;
+			renderColor.green = 1.0f;
+			renderColor.blue = 1.0f;
+			storePixel(pixelsOut, format, idx + WINDOW_WIDTH * idy, renderColor);
+			return;
+		}
+		renderColor.red += blend.red / weights * 3.0f;
+		renderColor.green += blend.green / weights * 3.0f;
+		renderColor.blue += blend.blue / weights * 3.0f;
 		
-		
-		pixelsOut[idx + WINDOW_WIDTH * idy] = renderColor;
-}
\ No newline at end of file
+		storePixel(pixelsOut, format, idx + WINDOW_WIDTH * idy, renderColor);
+}
+
+
+
+// Physics on the device. The host passes -DDEVICE_PHYSICS and
+// -DPHYSICSUPDATESPERFRAME=n when the device has double precision. One
+// work item moves one satellite through all substeps of a frame with
+// exactly the operations of sequentialPhysicsEngine, so the result is
+// bit-identical: doubles during the frame, floats in between.
+#ifdef DEVICE_PHYSICS
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+// Contracting into fused multiply-adds would change the rounding
+#pragma OPENCL FP_CONTRACT OFF
+
+__kernel void parallelPhysicsOpenCL(__global satellite* satellites) {
+
+	int i = get_global_id(0);
+	if (i >= SATELLITE_COUNT) {
+		return;
+	}
+
+	double positionX = satellites[i].position.x;
+	double positionY = satellites[i].position.y;
+	double velocityX = satellites[i].velocity.x;
+	double velocityY = satellites[i].velocity.y;
+
+	for(int physicsUpdateIndex = 0; physicsUpdateIndex < PHYSICSUPDATESPERFRAME;
+		++physicsUpdateIndex) {
+
+		// Distance to the blackhole
+		double toBlackHoleX = positionX - HORIZONTAL_CENTER;
+		double toBlackHoleY = positionY - VERTICAL_CENTER;
+		double distToBlackHoleSquared =
+			toBlackHoleX * toBlackHoleX + toBlackHoleY * toBlackHoleY;
+		double distToBlackHole = sqrt(distToBlackHoleSquared);
+
+		// Gravity force
+		double directionX = toBlackHoleX / distToBlackHole;
+		double directionY = toBlackHoleY / distToBlackHole;
+		double accumulation = GRAVITY / distToBlackHoleSquared;
+
+		// Update velocity based on force
+		velocityX -= accumulation * directionX * DELTATIME / PHYSICSUPDATESPERFRAME;
+		velocityY -= accumulation * directionY * DELTATIME / PHYSICSUPDATESPERFRAME;
+
+		// Update position based on velocity
+		positionX += velocityX * DELTATIME / PHYSICSUPDATESPERFRAME;
+		positionY += velocityY * DELTATIME / PHYSICSUPDATESPERFRAME;
+	}
+
+	satellites[i].position.x = positionX;
+	satellites[i].position.y = positionY;
+	satellites[i].velocity.x = velocityX;
+	satellites[i].velocity.y = velocityY;
+}
+
+#endif
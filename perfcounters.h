@@ -0,0 +1,170 @@
+/* Hardware performance counters of single threads through perf_event_open
+
+   Every thread gets its own set of counters: cycles, instructions, L1 data
+   read misses, last level cache misses, branch misses and the cycles spent
+   in the AVX frequency licences 1 and 2. The licence events are the raw
+   CORE_POWER.LVL1_TURBO_LICENSE and LVL2_TURBO_LICENSE events of the Intel
+   server cores with AVX-512 (Skylake-SP and later); other CPUs leave them
+   out. Counters that cannot be opened, for example in a virtual machine
+   without a PMU or with a strict /proc/sys/kernel/perf_event_paranoid, read
+   as -1.
+
+   The counters are not grouped, so the kernel may multiplex them when there
+   are more events than hardware counters. Values are scaled by the share of
+   time each counter was running.
+
+   Linux only; elsewhere nothing opens.
+*/
+
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum {
+   PERF_CYCLES,
+   PERF_INSTRUCTIONS,
+   PERF_L1D_MISSES,
+   PERF_LLC_MISSES,
+   PERF_BRANCH_MISSES,
+   PERF_AVX_LICENCE1,
+   PERF_AVX_LICENCE2,
+   PERF_EVENTS
+};
+
+// Column name of an event, also the header of the --perf-file table
+static inline const char* perfEventName(int event){
+   static const char* names[PERF_EVENTS] = {
+      "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses",
+      "avx_licence1_cycles", "avx_licence2_cycles"
+   };
+   return names[event];
+}
+
+typedef struct{
+   int fd[PERF_EVENTS];
+} perfThreadCounters;
+
+// Counts of every event, -1 for events that are not counted
+typedef struct{
+   double value[PERF_EVENTS];
+} perfCounts;
+
+#ifdef __linux__
+static inline int perfEventOpen(int event, int tid){
+   struct perf_event_attr attr;
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = PERF_TYPE_HARDWARE;
+   attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   switch(event){
+   case PERF_CYCLES:
+      attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+   case PERF_INSTRUCTIONS:
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+   case PERF_L1D_MISSES:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                    PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+      break;
+   case PERF_LLC_MISSES:
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+   case PERF_BRANCH_MISSES:
+      attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+   default:
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_cpu_init();
+      if(!__builtin_cpu_is("intel") || !__builtin_cpu_supports("avx512f")){
+         return -1;
+      }
+      // Event 0x28, umask 0x18 (licence 1) or 0x20 (licence 2)
+      attr.type = PERF_TYPE_RAW;
+      attr.config = event == PERF_AVX_LICENCE1 ? 0x1828 : 0x2028;
+      break;
+#else
+      return -1;
+#endif
+   }
+   return (int)syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+}
+#endif
+
+// Opens the counters of thread tid (a kernel thread id, 0 for the calling
+// thread). Returns the number of events that opened; errno tells why the
+// first one that failed did not.
+static inline int perfCountersOpen(perfThreadCounters* counters, int tid){
+   int opened = 0, error = 0;
+   for(int e = 0; e < PERF_EVENTS; ++e){
+      errno = 0;
+#ifdef __linux__
+      counters->fd[e] = perfEventOpen(e, tid);
+#else
+      (void)tid;
+      counters->fd[e] = -1;
+      errno = ENOSYS;
+#endif
+      opened += counters->fd[e] >= 0;
+      if(counters->fd[e] < 0 && !error){
+         error = errno;
+      }
+   }
+   errno = error;
+   return opened;
+}
+
+static inline void perfCountersRead(const perfThreadCounters* counters, perfCounts* counts){
+   for(int e = 0; e < PERF_EVENTS; ++e){
+      counts->value[e] = -1.0;
+#ifdef __linux__
+      // Count, time enabled, time running
+      uint64_t values[3];
+      if(counters->fd[e] >= 0 &&
+         read(counters->fd[e], values, sizeof(values)) == (ssize_t)sizeof(values)){
+         counts->value[e] = values[2] > 0 ? (double)values[0] * values[1] / values[2] : 0.0;
+      }
+#endif
+   }
+}
+
+static inline void perfCountersClose(perfThreadCounters* counters){
+   for(int e = 0; e < PERF_EVENTS; ++e){
+#ifdef __linux__
+      if(counters->fd[e] >= 0){
+         close(counters->fd[e]);
+      }
+#endif
+      counters->fd[e] = -1;
+   }
+}
+
+// Adds end - start of every counted event to total
+static inline void perfCountsAddDifference(perfCounts* total, const perfCounts* start,
+                                           const perfCounts* end){
+   for(int e = 0; e < PERF_EVENTS; ++e){
+      if(end->value[e] < 0.0 || start->value[e] < 0.0){
+         total->value[e] = -1.0;
+      } else if(total->value[e] >= 0.0){
+         total->value[e] += end->value[e] - start->value[e];
+      }
+   }
+}
+
+static inline void perfCountsClear(perfCounts* counts){
+   memset(counts, 0, sizeof(*counts));
+}
+
+#endif
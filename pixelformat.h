@@ -0,0 +1,158 @@
+/* Packed pixel output formats shared by parallel.c and OpenCL_modified.c
+
+   The renderers compute color {float red, green, blue}, 12 bytes a pixel.
+   A display needs far less, so the output can be stored packed instead:
+
+   - PIXEL_RGBA8: 8 bit unorm per channel plus an opaque alpha, 4 bytes.
+     Channels are clamped to 0 .. 1 and rounded half up.
+   - PIXEL_HALF: IEEE half floats for red, green, blue and alpha 1, 8 bytes.
+     Rounded to nearest even, the way vstore_half_rte does on the device.
+
+   Bytes are in R, G, B, A order in memory, which is what glDrawPixels with
+   GL_RGBA and GL_UNSIGNED_BYTE or GL_HALF_FLOAT expects.
+
+   parallelOpenCL.cl packs with the same formulas, keep the two in sync.
+*/
+
+#ifndef PIXELFORMAT_H
+#define PIXELFORMAT_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+enum { PIXEL_FLOAT = 0, PIXEL_RGBA8 = 1, PIXEL_HALF = 2 };
+
+static inline const char* pixelFormatName(int format){
+   return format == PIXEL_RGBA8 ? "rgba8" : (format == PIXEL_HALF ? "half" : "float");
+}
+
+// Format of a name given on the command line, -1 if there is none
+static inline int pixelFormatParse(const char* name){
+   if(strcmp(name, "float") == 0) return PIXEL_FLOAT;
+   if(strcmp(name, "rgba8") == 0) return PIXEL_RGBA8;
+   if(strcmp(name, "half") == 0) return PIXEL_HALF;
+   return -1;
+}
+
+static inline size_t pixelFormatBytes(int format){
+   return format == PIXEL_RGBA8 ? 4 : (format == PIXEL_HALF ? 8 : 3 * sizeof(float));
+}
+
+static inline uint8_t pixelToUnorm8(float value){
+   return (uint8_t)(fminf(fmaxf(value, 0.f), 1.f) * 255.0f + 0.5f);
+}
+
+static inline uint16_t pixelToHalf(float value){
+   uint32_t bits;
+   memcpy(&bits, &value, sizeof(bits));
+   uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+   uint32_t magnitude = bits & 0x7fffffff;
+   if(magnitude >= 0x7f800000){
+      // Infinity stays infinity, NaN stays a quiet NaN
+      return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+   }
+   if(magnitude < 0x38800000){
+      // Below the smallest normal half, in units of 2^-24. The scaling is
+      // exact and lrintf rounds to nearest even.
+      float scaled;
+      memcpy(&scaled, &magnitude, sizeof(scaled));
+      return sign | (uint16_t)lrintf(scaled * 16777216.0f);
+   }
+   // Round to nearest even at the 13 dropped mantissa bits and rebias
+   uint32_t rounded = magnitude + 0xfff + ((magnitude >> 13) & 1) - 0x38000000;
+   if(rounded >= 0x0f800000){
+      return sign | 0x7c00;
+   }
+   return sign | (uint16_t)(rounded >> 13);
+}
+
+static inline float pixelFromHalf(uint16_t half){
+   uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+   uint32_t exponent = (half >> 10) & 0x1f;
+   uint32_t mantissa = half & 0x3ff;
+   float value;
+   if(exponent == 0){
+      value = ldexpf((float)mantissa, -24);
+      return sign ? -value : value;
+   }
+   uint32_t bits = sign | (exponent == 31 ? 0x7f800000 | (mantissa << 13) :
+                           ((exponent + 112) << 23) | (mantissa << 13));
+   memcpy(&value, &bits, sizeof(value));
+   return value;
+}
+
+// Stores pixel i of a packed image
+static inline void pixelFormatStore(int format, void* image, size_t i,
+                                    float red, float green, float blue){
+   if(format == PIXEL_RGBA8){
+      uint8_t* p = (uint8_t*)image + 4 * i;
+      p[0] = pixelToUnorm8(red);
+      p[1] = pixelToUnorm8(green);
+      p[2] = pixelToUnorm8(blue);
+      p[3] = 255;
+   } else if(format == PIXEL_HALF){
+      uint16_t* p = (uint16_t*)image + 4 * i;
+      p[0] = pixelToHalf(red);
+      p[1] = pixelToHalf(green);
+      p[2] = pixelToHalf(blue);
+      p[3] = 0x3c00;
+   } else {
+      float* p = (float*)image + 3 * i;
+      p[0] = red;
+      p[1] = green;
+      p[2] = blue;
+   }
+}
+
+// Reads pixel i of a packed image back into floats
+static inline void pixelFormatLoad(int format, const void* image, size_t i,
+                                   float* red, float* green, float* blue){
+   if(format == PIXEL_RGBA8){
+      const uint8_t* p = (const uint8_t*)image + 4 * i;
+      *red = p[0] / 255.0f;
+      *green = p[1] / 255.0f;
+      *blue = p[2] / 255.0f;
+   } else if(format == PIXEL_HALF){
+      const uint16_t* p = (const uint16_t*)image + 4 * i;
+      *red = pixelFromHalf(p[0]);
+      *green = pixelFromHalf(p[1]);
+      *blue = pixelFromHalf(p[2]);
+   } else {
+      const float* p = (const float*)image + 3 * i;
+      *red = p[0];
+      *green = p[1];
+      *blue = p[2];
+   }
+}
+
+// Unpacks count pixels into red, green, blue float triples
+static inline void pixelFormatUnpack(int format, const void* image, float* rgb, size_t count){
+   for(size_t i = 0; i < count; ++i){
+      pixelFormatLoad(format, image, i, &rgb[3 * i], &rgb[3 * i + 1], &rgb[3 * i + 2]);
+   }
+}
+
+// Compares a packed image with a float reference (red, green, blue triples)
+// in the packed domain: the reference is packed the same way and both are
+// read back, so clamping and rounding cancel out. Returns the first pixel
+// with a channel more than tolerance apart, or -1.
+static inline long pixelFormatCompare(int format, const void* image, const float* reference,
+                                      size_t count, float tolerance){
+   for(size_t i = 0; i < count; ++i){
+      unsigned char packed[3 * sizeof(float)];
+      float expected[3], actual[3];
+      pixelFormatStore(format, packed, 0, reference[3 * i], reference[3 * i + 1],
+                       reference[3 * i + 2]);
+      pixelFormatLoad(format, packed, 0, &expected[0], &expected[1], &expected[2]);
+      pixelFormatLoad(format, image, i, &actual[0], &actual[1], &actual[2]);
+      for(int c = 0; c < 3; ++c){
+         if(!(fabsf(expected[c] - actual[c]) <= tolerance)){
+            return (long)i;
+         }
+      }
+   }
+   return -1;
+}
+
+#endif
@@ -0,0 +1,285 @@
+/* Uniform grid over the satellite positions
+
+   Rebuilt once per frame after the physics update. A pixel then only looks
+   at the satellites of nearby cells for the SATELLITE_RADIUS hit test and
+   for finding the nearest satellite, instead of testing every satellite.
+   Both queries give exactly the same answer as the brute force loops of
+   sequentialGraphicsEngine: the same float distances are compared in the
+   same way and ties go to the lowest satellite index.
+
+   The grid covers the window and every satellite, so satellites far outside
+   the window are still found. Satellites with non-finite coordinates can
+   never be hit or nearest in the brute force loops and are left out.
+
+   parallelOpenCL.cl walks the same cellStart/cellSatellites layout on the
+   device, keep the two in sync.
+*/
+
+#ifndef SATELLITEGRID_H
+#define SATELLITEGRID_H
+
+#include <math.h>
+#include <stdlib.h>
+
+typedef struct{
+   // World coordinates of the lower left corner of cell (0, 0)
+   float originX;
+   float originY;
+   float cellSize;
+   int columns;
+   int rows;
+
+   // Satellites of cell c are cellSatellites[cellStart[c] .. cellStart[c + 1]),
+   // in increasing satellite index
+   int* cellStart;
+   int* cellSatellites;
+
+   // Cell of every satellite, -1 for the ones left out
+   int* satelliteCell;
+
+   int cellCapacity;
+   int satelliteCapacity;
+} satelliteGrid;
+
+// Largest number of cells used for count satellites. Callers sizing device
+// buffers for cellStart need room for satelliteGridMaxCells(count) + 1 ints.
+static inline int satelliteGridMaxCells(int count){
+   return 4 * count + 16;
+}
+
+static inline int satelliteGridCellX(const satelliteGrid* grid, float x){
+   int cell = (int)floorf((x - grid->originX) / grid->cellSize);
+   return cell < 0 ? 0 : (cell >= grid->columns ? grid->columns - 1 : cell);
+}
+
+static inline int satelliteGridCellY(const satelliteGrid* grid, float y){
+   int cell = (int)floorf((y - grid->originY) / grid->cellSize);
+   return cell < 0 ? 0 : (cell >= grid->rows ? grid->rows - 1 : cell);
+}
+
+// Sorts count satellites into the grid. Satellite i is at (x[i * stride],
+// y[i * stride]). The grid also covers the rectangle (minX, minY) ..
+// (maxX, maxY), normally the window. Cells are at least minCellSize wide.
+// Returns 0 if memory runs out.
+static inline int satelliteGridBuild(satelliteGrid* grid, const float* x,
+                                     const float* y, int stride, int count,
+                                     float minX, float minY, float maxX, float maxY,
+                                     float minCellSize){
+   int maxCells = satelliteGridMaxCells(count);
+   if(grid->cellCapacity < maxCells + 1){
+      int* cellStart = (int*)realloc(grid->cellStart, sizeof(int) * (maxCells + 1));
+      if(!cellStart) return 0;
+      grid->cellStart = cellStart;
+      grid->cellCapacity = maxCells + 1;
+   }
+   if(grid->satelliteCapacity < count){
+      int* cellSatellites = (int*)realloc(grid->cellSatellites, sizeof(int) * count);
+      if(!cellSatellites) return 0;
+      grid->cellSatellites = cellSatellites;
+      int* satelliteCell = (int*)realloc(grid->satelliteCell, sizeof(int) * count);
+      if(!satelliteCell) return 0;
+      grid->satelliteCell = satelliteCell;
+      grid->satelliteCapacity = count;
+   }
+
+   for(int i = 0; i < count; ++i){
+      float sx = x[(size_t)i * stride];
+      float sy = y[(size_t)i * stride];
+      if(isfinite(sx) && isfinite(sy)){
+         minX = fminf(minX, sx);
+         minY = fminf(minY, sy);
+         maxX = fmaxf(maxX, sx);
+         maxY = fmaxf(maxY, sy);
+      }
+   }
+
+   // About one satellite per cell, but never more than maxCells cells
+   float width = maxX - minX;
+   float height = maxY - minY;
+   float cellSize = sqrtf(width * height / (count > 0 ? count : 1));
+   cellSize = fmaxf(cellSize, minCellSize);
+   for(;;){
+      double columns = floor(width / cellSize) + 1.0;
+      double rows = floor(height / cellSize) + 1.0;
+      if(columns * rows <= maxCells){
+         grid->columns = (int)columns;
+         grid->rows = (int)rows;
+         break;
+      }
+      cellSize *= 1.25f;
+   }
+   grid->originX = minX;
+   grid->originY = minY;
+   grid->cellSize = cellSize;
+
+   // Counting sort by cell. Filling in satellite order keeps every cell
+   // sorted by satellite index.
+   int cells = grid->columns * grid->rows;
+   for(int c = 0; c <= cells; ++c){
+      grid->cellStart[c] = 0;
+   }
+   for(int i = 0; i < count; ++i){
+      float sx = x[(size_t)i * stride];
+      float sy = y[(size_t)i * stride];
+      if(isfinite(sx) && isfinite(sy)){
+         int cell = satelliteGridCellY(grid, sy) * grid->columns +
+                    satelliteGridCellX(grid, sx);
+         grid->satelliteCell[i] = cell;
+         grid->cellStart[cell + 1]++;
+      } else {
+         grid->satelliteCell[i] = -1;
+      }
+   }
+   for(int c = 0; c < cells; ++c){
+      grid->cellStart[c + 1] += grid->cellStart[c];
+   }
+   for(int i = 0; i < count; ++i){
+      int cell = grid->satelliteCell[i];
+      if(cell >= 0){
+         grid->cellSatellites[grid->cellStart[cell]++] = i;
+      }
+   }
+   // cellStart[c] now holds the end of cell c, shift back
+   for(int c = cells; c > 0; --c){
+      grid->cellStart[c] = grid->cellStart[c - 1];
+   }
+   grid->cellStart[0] = 0;
+   return 1;
+}
+
+static inline void satelliteGridFree(satelliteGrid* grid){
+   free(grid->cellStart);
+   free(grid->cellSatellites);
+   free(grid->satelliteCell);
+   grid->cellStart = NULL;
+   grid->cellSatellites = NULL;
+   grid->satelliteCell = NULL;
+   grid->cellCapacity = 0;
+   grid->satelliteCapacity = 0;
+}
+
+// Walks the cells at Chebyshev distance ring from the cell rectangle
+// (x0, y0) .. (x1, y1), clipped to the grid
+typedef struct{
+   const satelliteGrid* grid;
+   int left, bottom, right, top;
+   int x, y;
+   int full;
+} satelliteGridRing;
+
+static inline void satelliteGridRingBegin(satelliteGridRing* it, const satelliteGrid* grid,
+                                          int x0, int y0, int x1, int y1, int ring){
+   it->grid = grid;
+   it->left = x0 - ring;
+   it->bottom = y0 - ring;
+   it->right = x1 + ring;
+   it->top = y1 + ring;
+   it->x = it->left - 1;
+   it->y = it->bottom;
+
+   // Ring 0 is the whole rectangle
+   it->full = ring == 0;
+}
+
+// Returns the next cell index of the ring or -1 when the ring is done
+static inline int satelliteGridRingNext(satelliteGridRing* it){
+   const satelliteGrid* grid = it->grid;
+   for(;;){
+      int edgeRow = it->full || it->y == it->bottom || it->y == it->top;
+      if(edgeRow || it->x < it->left){
+         it->x++;
+      } else {
+         // Inner rows only have their first and last cell in the ring
+         it->x = it->x == it->left ? it->right : it->right + 1;
+      }
+      if(it->x > it->right){
+         it->y++;
+         it->x = it->left - 1;
+         if(it->y > it->top){
+            return -1;
+         }
+         continue;
+      }
+      if(it->x >= 0 && it->x < grid->columns && it->y >= 0 && it->y < grid->rows){
+         return it->y * grid->columns + it->x;
+      }
+   }
+}
+
+// True once rings 0 .. ring around (x0, y0) .. (x1, y1) cover the grid
+static inline int satelliteGridRingCoversGrid(const satelliteGrid* grid,
+                                              int x0, int y0, int x1, int y1, int ring){
+   return x0 - ring <= 0 && y0 - ring <= 0 &&
+          x1 + ring >= grid->columns - 1 && y1 + ring >= grid->rows - 1;
+}
+
+// After rings 0 .. ring have been searched, every other satellite is at
+// least this far from the searched cell rectangle. The small margin keeps
+// the bound safe against rounding in the cell computations.
+static inline float satelliteGridRingReach(const satelliteGrid* grid, int ring){
+   return (ring - 0.01f) * grid->cellSize;
+}
+
+// Distance between a pixel and a satellite, computed exactly like the
+// brute force loops do
+static inline float satelliteGridDistance(float px, float py, float sx, float sy){
+   float dx = px - sx;
+   float dy = py - sy;
+   return sqrtf(dx * dx + dy * dy);
+}
+
+// Returns 1 if some satellite is closer than radius to the pixel
+static inline int satelliteGridHits(const satelliteGrid* grid, const float* x,
+                                    const float* y, int stride, float px, float py,
+                                    float radius){
+   int x0 = satelliteGridCellX(grid, px - radius - 1.0f);
+   int x1 = satelliteGridCellX(grid, px + radius + 1.0f);
+   int y0 = satelliteGridCellY(grid, py - radius - 1.0f);
+   int y1 = satelliteGridCellY(grid, py + radius + 1.0f);
+   for(int cy = y0; cy <= y1; ++cy){
+      for(int cx = x0; cx <= x1; ++cx){
+         int cell = cy * grid->columns + cx;
+         for(int k = grid->cellStart[cell]; k < grid->cellStart[cell + 1]; ++k){
+            int j = grid->cellSatellites[k];
+            if(satelliteGridDistance(px, py, x[(size_t)j * stride],
+                                     y[(size_t)j * stride]) < radius){
+               return 1;
+            }
+         }
+      }
+   }
+   return 0;
+}
+
+// Returns the index of the satellite nearest to the pixel, the lowest index
+// among equally near ones, or -1 if no satellite has a finite distance
+static inline int satelliteGridNearest(const satelliteGrid* grid, const float* x,
+                                       const float* y, int stride, float px, float py){
+   int cx = satelliteGridCellX(grid, px);
+   int cy = satelliteGridCellY(grid, py);
+   float shortestDistance = INFINITY;
+   int nearest = -1;
+   for(int ring = 0; ; ++ring){
+      satelliteGridRing it;
+      satelliteGridRingBegin(&it, grid, cx, cy, cx, cy, ring);
+      for(int cell = satelliteGridRingNext(&it); cell >= 0;
+          cell = satelliteGridRingNext(&it)){
+         for(int k = grid->cellStart[cell]; k < grid->cellStart[cell + 1]; ++k){
+            int j = grid->cellSatellites[k];
+            float distance = satelliteGridDistance(px, py, x[(size_t)j * stride],
+                                                   y[(size_t)j * stride]);
+            if(distance < shortestDistance ||
+               (distance == shortestDistance && j < nearest)){
+               shortestDistance = distance;
+               nearest = j;
+            }
+         }
+      }
+      if(shortestDistance < satelliteGridRingReach(grid, ring) ||
+         satelliteGridRingCoversGrid(grid, cx, cy, cx, cy, ring)){
+         return nearest;
+      }
+   }
+}
+
+#endif
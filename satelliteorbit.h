@@ -0,0 +1,145 @@
+/* Orbit propagators for a satellite around the black hole
+
+   A satellite only feels the black hole, so its path over one frame is a
+   Kepler orbit. The physics engines normally follow it with
+   PHYSICSUPDATESPERFRAME semi-implicit Euler substeps, which is the
+   reference that sequentialPhysicsEngine checks against. The propagators
+   here reach the same positions with far less work:
+
+   - velocity Verlet, second order and symplectic, with a given step count
+   - classic Runge-Kutta 4, with a given step count
+   - the closed-form Kepler solution in universal variables, which needs
+     no substeps at all and is exact up to double rounding
+
+   All of them work in double precision on a position relative to the
+   black hole. gm is the gravitational parameter (GRAVITY) and dt the time
+   to advance (DELTATIME).
+*/
+
+#ifndef SATELLITEORBIT_H
+#define SATELLITEORBIT_H
+
+#include <math.h>
+
+typedef struct{
+   double x;
+   double y;
+   double vx;
+   double vy;
+} orbitState;
+
+// Acceleration towards the black hole at the origin
+static inline void orbitAcceleration(double gm, double x, double y,
+                                     double* ax, double* ay){
+   double distSquared = x * x + y * y;
+   double dist = sqrt(distSquared);
+   double accumulation = gm / (distSquared * dist);
+   *ax = -accumulation * x;
+   *ay = -accumulation * y;
+}
+
+static inline void orbitVerlet(orbitState* s, double gm, double dt, int steps){
+   double h = dt / steps;
+   double ax, ay;
+   orbitAcceleration(gm, s->x, s->y, &ax, &ay);
+   for(int step = 0; step < steps; ++step){
+      s->vx += 0.5 * h * ax;
+      s->vy += 0.5 * h * ay;
+      s->x += h * s->vx;
+      s->y += h * s->vy;
+      orbitAcceleration(gm, s->x, s->y, &ax, &ay);
+      s->vx += 0.5 * h * ax;
+      s->vy += 0.5 * h * ay;
+   }
+}
+
+static inline void orbitRungeKutta4(orbitState* s, double gm, double dt, int steps){
+   double h = dt / steps;
+   for(int step = 0; step < steps; ++step){
+      double x = s->x, y = s->y, vx = s->vx, vy = s->vy;
+      double ax1, ay1, ax2, ay2, ax3, ay3, ax4, ay4;
+      orbitAcceleration(gm, x, y, &ax1, &ay1);
+      double vx2 = vx + 0.5 * h * ax1, vy2 = vy + 0.5 * h * ay1;
+      orbitAcceleration(gm, x + 0.5 * h * vx, y + 0.5 * h * vy, &ax2, &ay2);
+      double vx3 = vx + 0.5 * h * ax2, vy3 = vy + 0.5 * h * ay2;
+      orbitAcceleration(gm, x + 0.5 * h * vx2, y + 0.5 * h * vy2, &ax3, &ay3);
+      double vx4 = vx + h * ax3, vy4 = vy + h * ay3;
+      orbitAcceleration(gm, x + h * vx3, y + h * vy3, &ax4, &ay4);
+      s->x = x + h / 6.0 * (vx + 2.0 * vx2 + 2.0 * vx3 + vx4);
+      s->y = y + h / 6.0 * (vy + 2.0 * vy2 + 2.0 * vy3 + vy4);
+      s->vx = vx + h / 6.0 * (ax1 + 2.0 * ax2 + 2.0 * ax3 + ax4);
+      s->vy = vy + h / 6.0 * (ay1 + 2.0 * ay2 + 2.0 * ay3 + ay4);
+   }
+}
+
+// Stumpff functions C(z) and S(z). Near zero the series avoids the
+// cancellation of the closed forms.
+static inline void orbitStumpff(double z, double* c, double* s){
+   if(fabs(z) < 1e-2){
+      *c = 1.0 / 2 - z * (1.0 / 24 - z * (1.0 / 720 - z * (1.0 / 40320 - z / 3628800)));
+      *s = 1.0 / 6 - z * (1.0 / 120 - z * (1.0 / 5040 - z * (1.0 / 362880 - z / 39916800)));
+   } else if(z > 0){
+      double root = sqrt(z);
+      *c = (1.0 - cos(root)) / z;
+      *s = (root - sin(root)) / (z * root);
+   } else {
+      double root = sqrt(-z);
+      *c = (cosh(root) - 1.0) / -z;
+      *s = (sinh(root) - root) / (-z * root);
+   }
+}
+
+// Universal Kepler equation iterations before giving up. Newton converges
+// in a handful of them for the orbits of this program.
+#define ORBIT_KEPLER_ITERATIONS 50
+
+// Advances along the exact conic through the current state. Works for
+// elliptic, parabolic and hyperbolic orbits alike.
+static inline void orbitKepler(orbitState* s, double gm, double dt){
+   double sqrtGm = sqrt(gm);
+   double r0 = sqrt(s->x * s->x + s->y * s->y);
+   double radialVelocity = (s->x * s->vx + s->y * s->vy) / r0;
+   double speedSquared = s->vx * s->vx + s->vy * s->vy;
+   // Reciprocal of the semi-major axis
+   double alpha = 2.0 / r0 - speedSquared / gm;
+
+   // Newton iteration on the universal anomaly chi
+   double chi = sqrtGm * fabs(alpha) * dt;
+   if(chi == 0.0){
+      chi = sqrtGm * dt / r0;
+   }
+   double c, st;
+   for(int iteration = 0; iteration < ORBIT_KEPLER_ITERATIONS; ++iteration){
+      double z = alpha * chi * chi;
+      orbitStumpff(z, &c, &st);
+      double f = r0 * radialVelocity / sqrtGm * chi * chi * c +
+                 (1.0 - alpha * r0) * chi * chi * chi * st + r0 * chi - sqrtGm * dt;
+      double derivative = r0 * radialVelocity / sqrtGm * chi * (1.0 - z * st) +
+                          (1.0 - alpha * r0) * chi * chi * c + r0;
+      double correction = f / derivative;
+      chi -= correction;
+      if(fabs(correction) <= 1e-14 * fabs(chi)){
+         break;
+      }
+   }
+
+   // Lagrange coefficients
+   double chiSquared = chi * chi;
+   double z = alpha * chiSquared;
+   orbitStumpff(z, &c, &st);
+   double f = 1.0 - chiSquared / r0 * c;
+   double g = dt - chiSquared * chi / sqrtGm * st;
+   double x = f * s->x + g * s->vx;
+   double y = f * s->y + g * s->vy;
+   double r = sqrt(x * x + y * y);
+   double fDot = sqrtGm / (r * r0) * (z * chi * st - chi);
+   double gDot = 1.0 - chiSquared / r * c;
+   double vx = fDot * s->x + gDot * s->vx;
+   double vy = fDot * s->y + gDot * s->vy;
+   s->x = x;
+   s->y = y;
+   s->vx = vx;
+   s->vy = vy;
+}
+
+#endif
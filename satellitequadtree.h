@@ -0,0 +1,278 @@
+/* Quadtree over the satellites for the approximate weighted color blend
+
+   The blend gives every satellite the weight 1 / d^4, so a group of
+   satellites far away from a pixel adds almost the same as all of them
+   sitting at their centroid. Every node keeps the satellite count, the
+   centroid and the summed colors of its satellites. The blend uses these
+   sums for a node as soon as the node looks smaller than the opening angle
+   theta from the pixels (node side < theta * distance), and only walks
+   into the nearby nodes. Per pixel this visits roughly O(log N) nodes
+   instead of all N satellites. A few neighbouring pixels of a row share
+   one walk, which keeps the per node work in vectorizable loops.
+
+   Satellites with non-finite coordinates are left out of the tree.
+*/
+
+#ifndef SATELLITEQUADTREE_H
+#define SATELLITEQUADTREE_H
+
+#include <math.h>
+#include <stdlib.h>
+
+// Nodes with at most this many satellites are not split further
+#define QUADTREE_LEAF_SIZE 8
+
+// Depth limit, stops the splitting of satellites at the same position
+#define QUADTREE_MAX_DEPTH 24
+
+typedef struct{
+   // Centroid of the satellites
+   float x;
+   float y;
+   // Side of the node square
+   float size;
+   // Summed colors of the satellites
+   float red;
+   float green;
+   float blue;
+   int count;
+   // First of the four consecutive children, -1 for leaves
+   int child;
+   // Satellites of a leaf are order[first .. first + count)
+   int first;
+} satelliteQuadNode;
+
+typedef struct{
+   satelliteQuadNode* nodes;
+   int nodeCount;
+   int nodeCapacity;
+   int* order;
+   int* scratch;
+   int satelliteCapacity;
+} satelliteQuadtree;
+
+// Adds count consecutive nodes, returns the index of the first or -1 if
+// memory runs out
+static inline int satelliteQuadtreeAddNodes(satelliteQuadtree* tree, int count){
+   if(tree->nodeCount + count > tree->nodeCapacity){
+      int capacity = tree->nodeCapacity ? tree->nodeCapacity * 2 : 256;
+      while(capacity < tree->nodeCount + count){
+         capacity *= 2;
+      }
+      satelliteQuadNode* nodes = (satelliteQuadNode*)realloc(tree->nodes,
+         sizeof(satelliteQuadNode) * capacity);
+      if(!nodes) return -1;
+      tree->nodes = nodes;
+      tree->nodeCapacity = capacity;
+   }
+   int index = tree->nodeCount;
+   tree->nodeCount += count;
+   return index;
+}
+
+// Fills in node for the satellites order[first .. first + count) inside the
+// square with corner (left, bottom) and splits it. Returns 0 if memory runs out.
+static inline int satelliteQuadtreeSplit(satelliteQuadtree* tree, int node,
+                                         const float* x, const float* y,
+                                         const float* red, const float* green,
+                                         const float* blue, int first, int count,
+                                         float left, float bottom, float size,
+                                         int depth){
+   float sumX = 0.f, sumY = 0.f, sumRed = 0.f, sumGreen = 0.f, sumBlue = 0.f;
+   for(int k = first; k < first + count; ++k){
+      int j = tree->order[k];
+      sumX += x[j];
+      sumY += y[j];
+      sumRed += red[j];
+      sumGreen += green[j];
+      sumBlue += blue[j];
+   }
+   satelliteQuadNode* n = &tree->nodes[node];
+   n->x = count > 0 ? sumX / count : left + 0.5f * size;
+   n->y = count > 0 ? sumY / count : bottom + 0.5f * size;
+   n->size = size;
+   n->red = sumRed;
+   n->green = sumGreen;
+   n->blue = sumBlue;
+   n->count = count;
+   n->child = -1;
+   n->first = first;
+   if(count <= QUADTREE_LEAF_SIZE || depth >= QUADTREE_MAX_DEPTH){
+      return 1;
+   }
+
+   // Sorts the satellites by quadrant: lower left, lower right, upper left,
+   // upper right
+   float half = 0.5f * size;
+   float middleX = left + half;
+   float middleY = bottom + half;
+   int quadrantCount[4] = {0, 0, 0, 0};
+   for(int k = first; k < first + count; ++k){
+      int j = tree->order[k];
+      int quadrant = (x[j] >= middleX) + 2 * (y[j] >= middleY);
+      tree->scratch[k] = quadrant;
+      quadrantCount[quadrant]++;
+   }
+   int quadrantStart[4];
+   quadrantStart[0] = first;
+   for(int q = 1; q < 4; ++q){
+      quadrantStart[q] = quadrantStart[q - 1] + quadrantCount[q - 1];
+   }
+   // The first half of scratch holds the quadrants, the second half the
+   // reordered satellites
+   int* sorted = tree->scratch + tree->satelliteCapacity;
+   int position[4] = {quadrantStart[0], quadrantStart[1],
+                      quadrantStart[2], quadrantStart[3]};
+   for(int k = first; k < first + count; ++k){
+      sorted[position[tree->scratch[k]]++] = tree->order[k];
+   }
+   for(int k = first; k < first + count; ++k){
+      tree->order[k] = sorted[k];
+   }
+
+   int child = satelliteQuadtreeAddNodes(tree, 4);
+   if(child < 0) return 0;
+   tree->nodes[node].child = child;
+   for(int q = 0; q < 4; ++q){
+      if(!satelliteQuadtreeSplit(tree, child + q, x, y, red, green, blue,
+                                 quadrantStart[q], quadrantCount[q],
+                                 q & 1 ? middleX : left, q & 2 ? middleY : bottom,
+                                 half, depth + 1)){
+         return 0;
+      }
+   }
+   return 1;
+}
+
+// Builds the tree over count satellites given as arrays of positions and
+// colors. Returns 0 if memory runs out.
+static inline int satelliteQuadtreeBuild(satelliteQuadtree* tree, const float* x,
+                                         const float* y, const float* red,
+                                         const float* green, const float* blue,
+                                         int count){
+   if(tree->satelliteCapacity < count){
+      int* order = (int*)realloc(tree->order, sizeof(int) * count);
+      if(!order) return 0;
+      tree->order = order;
+      int* scratch = (int*)realloc(tree->scratch, sizeof(int) * 2 * count);
+      if(!scratch) return 0;
+      tree->scratch = scratch;
+      tree->satelliteCapacity = count;
+   }
+
+   int finite = 0;
+   float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+   for(int i = 0; i < count; ++i){
+      if(isfinite(x[i]) && isfinite(y[i])){
+         tree->order[finite++] = i;
+         minX = fminf(minX, x[i]);
+         minY = fminf(minY, y[i]);
+         maxX = fmaxf(maxX, x[i]);
+         maxY = fmaxf(maxY, y[i]);
+      }
+   }
+   if(finite == 0){
+      minX = minY = 0.f;
+      maxX = maxY = 1.f;
+   }
+
+   // Slightly larger than the satellites so that the largest coordinates
+   // still fall into the lower left of the next split
+   float size = fmaxf(maxX - minX, maxY - minY) * 1.0001f + 1.0f;
+   tree->nodeCount = 0;
+   int root = satelliteQuadtreeAddNodes(tree, 1);
+   if(root < 0) return 0;
+   return satelliteQuadtreeSplit(tree, root, x, y, red, green, blue, 0, finite,
+                                 minX, minY, size, 0);
+}
+
+static inline void satelliteQuadtreeFree(satelliteQuadtree* tree){
+   free(tree->nodes);
+   free(tree->order);
+   free(tree->scratch);
+   tree->nodes = NULL;
+   tree->order = NULL;
+   tree->scratch = NULL;
+   tree->nodeCount = 0;
+   tree->nodeCapacity = 0;
+   tree->satelliteCapacity = 0;
+}
+
+// Pixels blended together by satelliteQuadtreeBlendRow
+#define QUADTREE_BLEND_LANES 16
+
+// Sums the blend weights and the weighted colors of all satellites for the
+// pixels (px + lane, py), lane = 0 .. lanes - 1, lanes at most
+// QUADTREE_BLEND_LANES. The tree is walked once for all of them: a node
+// counts as one satellite at its centroid when it looks smaller than theta
+// from the nearest of the pixels, leaves that have to be opened are summed
+// exactly. The sums are not normalized, divide the colors by the weights.
+static inline void satelliteQuadtreeBlendRow(const satelliteQuadtree* tree,
+                                             const float* x, const float* y,
+                                             const float* red, const float* green,
+                                             const float* blue, float px, float py,
+                                             int lanes, float theta, float* weights,
+                                             float* redSum, float* greenSum,
+                                             float* blueSum){
+   float thetaSquared = theta * theta;
+   float lastX = px + (lanes - 1);
+   float pixelX[QUADTREE_BLEND_LANES];
+   float w[QUADTREE_BLEND_LANES], r[QUADTREE_BLEND_LANES];
+   float g[QUADTREE_BLEND_LANES], b[QUADTREE_BLEND_LANES];
+   for(int lane = 0; lane < QUADTREE_BLEND_LANES; ++lane){
+      pixelX[lane] = px + lane;
+      w[lane] = r[lane] = g[lane] = b[lane] = 0.f;
+   }
+
+   int stack[4 * QUADTREE_MAX_DEPTH + 4];
+   int top = 0;
+   stack[top++] = 0;
+   while(top > 0){
+      const satelliteQuadNode* node = &tree->nodes[stack[--top]];
+      if(node->count == 0){
+         continue;
+      }
+      // Distance to the nearest pixel of the row
+      float nearestX = fminf(fmaxf(node->x, px), lastX);
+      float ex = nearestX - node->x;
+      float ey = py - node->y;
+      if(node->size * node->size < thetaSquared * (ex * ex + ey * ey)){
+         float dy = py - node->y;
+         for(int lane = 0; lane < QUADTREE_BLEND_LANES; ++lane){
+            float dx = pixelX[lane] - node->x;
+            float distSquared = dx * dx + dy * dy;
+            float weight = 1.0f / (distSquared * distSquared);
+            w[lane] += node->count * weight;
+            r[lane] += node->red * weight;
+            g[lane] += node->green * weight;
+            b[lane] += node->blue * weight;
+         }
+      } else if(node->child < 0){
+         for(int k = node->first; k < node->first + node->count; ++k){
+            int j = tree->order[k];
+            float dy = py - y[j];
+            for(int lane = 0; lane < QUADTREE_BLEND_LANES; ++lane){
+               float dx = pixelX[lane] - x[j];
+               float dist2 = dx * dx + dy * dy;
+               float weight = 1.0f / (dist2 * dist2);
+               w[lane] += weight;
+               r[lane] += red[j] * weight;
+               g[lane] += green[j] * weight;
+               b[lane] += blue[j] * weight;
+            }
+         }
+      } else {
+         for(int q = 0; q < 4; ++q){
+            stack[top++] = node->child + q;
+         }
+      }
+   }
+   for(int lane = 0; lane < lanes; ++lane){
+      weights[lane] = w[lane];
+      redSum[lane] = r[lane];
+      greenSum[lane] = g[lane];
+      blueSum[lane] = b[lane];
+   }
+}
+
+#endif
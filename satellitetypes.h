@@ -0,0 +1,62 @@
+/* Types and constants shared by OpenCL_modified.c and parallelOpenCL.cl
+
+   The host includes this file normally. For the kernels, build_program()
+   hands its text to clCreateProgramWithSource in front of
+   parallelOpenCL.cl, so the structs have one definition on both sides.
+   Everything outside the host-only block must stay valid OpenCL C: no
+   includes and no host types.
+
+   The constants reach the kernels as -D build options instead, generated
+   from SATELLITE_KERNEL_OPTIONS below. The host adds the runtime sizes
+   (WINDOW_WIDTH, WINDOW_HEIGHT, SATELLITE_COUNT, PHYSICSUPDATESPERFRAME) the
+   same way, so every kernel build is specialized for the sizes of the run.
+*/
+
+#ifndef SATELLITETYPES_H
+#define SATELLITETYPES_H
+
+#ifndef __OPENCL_VERSION__
+
+// These are used to control the satellite movement
+#define SATELLITE_RADIUS 3.16f
+#define MAX_VELOCITY 0.1f
+#define GRAVITY 1.0f
+#define DELTATIME 32
+
+// Build options that give the kernels the constants above
+#define SATELLITE_STRING_(x) #x
+#define SATELLITE_STRING(x) SATELLITE_STRING_(x)
+#define SATELLITE_KERNEL_OPTIONS \
+   "-DSATELLITE_RADIUS=" SATELLITE_STRING(SATELLITE_RADIUS) \
+   " -DMAX_VELOCITY=" SATELLITE_STRING(MAX_VELOCITY) \
+   " -DGRAVITY=" SATELLITE_STRING(GRAVITY) \
+   " -DDELTATIME=" SATELLITE_STRING(DELTATIME)
+
+#endif
+
+// Some helpers to window size variables
+#define SIZE WINDOW_WIDTH*WINDOW_HEIGHT
+#define HORIZONTAL_CENTER (WINDOW_WIDTH / 2)
+#define VERTICAL_CENTER (WINDOW_HEIGHT / 2)
+
+// Stores 2D data like the coordinates
+typedef struct{
+   float x;
+   float y;
+} floatvector;
+
+// Stores rendered colors. Each float may vary from 0.0f ... 1.0f
+typedef struct{
+   float red;
+   float green;
+   float blue;
+} color;
+
+// Stores the satellite data, which fly around black hole in the space
+typedef struct{
+   color identifier;
+   floatvector position;
+   floatvector velocity;
+} satellite;
+
+#endif
@@ -0,0 +1,278 @@
+/* Snapshot files of the simulation state
+
+   The whole state of a run is the satellites buffer and the frame number;
+   rand() is only used by fixedInit(), so the seed is kept for reference
+   only. A snapshot file holds any number of states of one run:
+
+   - a 64 byte header: "SATSNAP" and a zero byte, then 32 bit words for
+     the version (SNAPSHOT_VERSION), header bytes, record bytes, satellite
+     count, bytes per satellite, window width and height, physics substeps
+     per frame, seed, flags and the number of records, zero padded.
+   - records of recordBytes each, in increasing frame order: the frame the
+     state starts, an FNV-1a checksum of the satellites, then the
+     satellites as they are in memory, zero padded to 64 bytes.
+
+   Words are in host byte order. Records have a fixed size, so record k is
+   at headerBytes + k * recordBytes and a frame is found by binary search
+   in the mapped file without reading the others. The record count in the
+   header is only raised after a record is written, so a run that dies
+   while writing leaves the earlier records readable.
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_BYTES 64
+#define SNAPSHOT_RECORD_ALIGNMENT 64
+
+// The records follow sequentialPhysicsEngine, one for every frame
+#define SNAPSHOT_SEQUENTIAL 1
+
+typedef struct{
+   char magic[8];
+   uint32_t version;
+   uint32_t headerBytes;
+   uint32_t recordBytes;
+   uint32_t satelliteCount;
+   uint32_t satelliteBytes;
+   uint32_t width;
+   uint32_t height;
+   uint32_t substeps;
+   uint32_t seed;
+   uint32_t flags;
+   uint32_t recordCount;
+   uint32_t reserved[3];
+} snapshotHeader;
+
+typedef struct{
+   uint32_t frame;
+   uint32_t checksum;
+   // satelliteCount * satelliteBytes bytes follow
+} snapshotRecord;
+
+static inline uint32_t snapshotChecksum(const void* data, size_t size){
+   const unsigned char* bytes = (const unsigned char*)data;
+   uint32_t hash = 2166136261u;
+   for(size_t i = 0; i < size; ++i){
+      hash = (hash ^ bytes[i]) * 16777619u;
+   }
+   return hash;
+}
+
+// Header of a run of count satellites of satelliteBytes each
+static inline snapshotHeader snapshotLayout(int count, int satelliteBytes, int width,
+                                            int height, int substeps, unsigned int seed,
+                                            unsigned int flags){
+   snapshotHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, "SATSNAP", 8);
+   header.version = SNAPSHOT_VERSION;
+   header.headerBytes = SNAPSHOT_HEADER_BYTES;
+   size_t record = sizeof(snapshotRecord) + (size_t)count * satelliteBytes;
+   header.recordBytes = (uint32_t)((record + SNAPSHOT_RECORD_ALIGNMENT - 1) /
+                                   SNAPSHOT_RECORD_ALIGNMENT * SNAPSHOT_RECORD_ALIGNMENT);
+   header.satelliteCount = count;
+   header.satelliteBytes = satelliteBytes;
+   header.width = width;
+   header.height = height;
+   header.substeps = substeps;
+   header.seed = seed;
+   header.flags = flags;
+   return header;
+}
+
+static inline const void* snapshotSatellites(const snapshotRecord* record){
+   return record + 1;
+}
+
+// A snapshot file mapped for reading
+typedef struct{
+   void* map;
+   size_t size;
+   const snapshotHeader* header;
+} snapshotFile;
+
+// Maps path and checks its header. Returns 0 and prints why if the file
+// is not a snapshot file this build can read.
+static inline int snapshotOpen(snapshotFile* file, const char* path){
+   memset(file, 0, sizeof(*file));
+   int fd = open(path, O_RDONLY);
+   struct stat info;
+   if(fd < 0 || fstat(fd, &info) != 0){
+      printf("Cannot open the snapshot file %s: %s\n", path, strerror(errno));
+      if(fd >= 0){
+         close(fd);
+      }
+      return 0;
+   }
+   if((size_t)info.st_size < sizeof(snapshotHeader)){
+      printf("%s is not a snapshot file\n", path);
+      close(fd);
+      return 0;
+   }
+   file->size = (size_t)info.st_size;
+   file->map = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if(file->map == MAP_FAILED){
+      printf("Cannot map the snapshot file %s: %s\n", path, strerror(errno));
+      file->map = NULL;
+      return 0;
+   }
+   const snapshotHeader* header = (const snapshotHeader*)file->map;
+   if(memcmp(header->magic, "SATSNAP", 8) != 0){
+      printf("%s is not a snapshot file\n", path);
+   } else if(header->version != SNAPSHOT_VERSION){
+      printf("%s is a version %u snapshot file, this build reads version %i\n",
+             path, header->version, SNAPSHOT_VERSION);
+   } else if(header->recordBytes < sizeof(snapshotRecord) +
+             (size_t)header->satelliteCount * header->satelliteBytes ||
+             header->headerBytes + (size_t)header->recordCount * header->recordBytes >
+             file->size){
+      printf("The snapshot file %s is truncated\n", path);
+   } else {
+      file->header = header;
+      return 1;
+   }
+   munmap(file->map, file->size);
+   file->map = NULL;
+   return 0;
+}
+
+static inline const snapshotRecord* snapshotRecordAt(const snapshotFile* file,
+                                                     unsigned int index){
+   return (const snapshotRecord*)((const char*)file->map + file->header->headerBytes +
+                                  (size_t)index * file->header->recordBytes);
+}
+
+// Record of frame, NULL if there is none
+static inline const snapshotRecord* snapshotFind(const snapshotFile* file, unsigned int frame){
+   unsigned int low = 0, high = file->header->recordCount;
+   while(low < high){
+      unsigned int middle = low + (high - low) / 2;
+      if(snapshotRecordAt(file, middle)->frame < frame){
+         low = middle + 1;
+      } else {
+         high = middle;
+      }
+   }
+   if(low < file->header->recordCount && snapshotRecordAt(file, low)->frame == frame){
+      return snapshotRecordAt(file, low);
+   }
+   return NULL;
+}
+
+// 1 if the satellites of a record match their checksum
+static inline int snapshotRecordValid(const snapshotFile* file, const snapshotRecord* record){
+   return snapshotChecksum(snapshotSatellites(record), (size_t)file->header->satelliteCount *
+                           file->header->satelliteBytes) == record->checksum;
+}
+
+static inline void snapshotClose(snapshotFile* file){
+   if(file->map){
+      munmap(file->map, file->size);
+   }
+   memset(file, 0, sizeof(*file));
+}
+
+// A snapshot file being written
+typedef struct{
+   int fd;
+   snapshotHeader header;
+   unsigned char* record;
+} snapshotWriter;
+
+// Writes the header of a new snapshot file. An existing file of the same
+// layout and seed is continued instead: its records of the frames before
+// keepBefore stay, the later ones are overwritten. Any other existing file
+// is left alone, since it holds states no run of this layout could write
+// again. Returns 0 and prints why if the file cannot be written.
+static inline int snapshotCreate(snapshotWriter* writer, const char* path,
+                                 const snapshotHeader* layout, unsigned int keepBefore){
+   memset(writer, 0, sizeof(*writer));
+   writer->fd = -1;
+   writer->header = *layout;
+
+   snapshotFile existing;
+   struct stat info;
+   if(stat(path, &info) == 0 && info.st_size > 0){
+      if(!snapshotOpen(&existing, path)){
+         printf("Will not overwrite %s\n", path);
+         return 0;
+      }
+      const snapshotHeader* old = existing.header;
+      int same = old->recordBytes == layout->recordBytes &&
+                 old->satelliteCount == layout->satelliteCount &&
+                 old->satelliteBytes == layout->satelliteBytes &&
+                 old->width == layout->width && old->height == layout->height &&
+                 old->substeps == layout->substeps && old->seed == layout->seed &&
+                 old->flags == layout->flags;
+      if(!same){
+         printf("Will not overwrite %s, a snapshot of %u satellites at %ux%u with %u "
+                "substeps and seed %u; remove it or choose another file\n", path,
+                old->satelliteCount, old->width, old->height, old->substeps, old->seed);
+         snapshotClose(&existing);
+         return 0;
+      }
+      unsigned int kept = 0;
+      while(kept < old->recordCount && snapshotRecordAt(&existing, kept)->frame < keepBefore){
+         ++kept;
+      }
+      writer->header.recordCount = kept;
+      snapshotClose(&existing);
+   }
+
+   writer->fd = open(path, O_RDWR | O_CREAT | (writer->header.recordCount ? 0 : O_TRUNC), 0644);
+   writer->record = (unsigned char*)calloc(1, layout->recordBytes);
+   if(writer->fd < 0 || !writer->record ||
+      pwrite(writer->fd, &writer->header, sizeof(snapshotHeader), 0) !=
+      (ssize_t)sizeof(snapshotHeader)){
+      printf("Cannot write the snapshot file %s: %s\n", path, strerror(errno));
+      return 0;
+   }
+   return 1;
+}
+
+// Appends the state that starts frame. Returns 0 if it was not written.
+static inline int snapshotAppend(snapshotWriter* writer, unsigned int frame,
+                                 const void* satellites){
+   snapshotHeader* header = &writer->header;
+   size_t bytes = (size_t)header->satelliteCount * header->satelliteBytes;
+   snapshotRecord* record = (snapshotRecord*)writer->record;
+   record->frame = frame;
+   record->checksum = snapshotChecksum(satellites, bytes);
+   memcpy(record + 1, satellites, bytes);
+   off_t offset = header->headerBytes + (off_t)header->recordCount * header->recordBytes;
+   if(pwrite(writer->fd, writer->record, header->recordBytes, offset) !=
+      (ssize_t)header->recordBytes){
+      return 0;
+   }
+   header->recordCount++;
+   return pwrite(writer->fd, header, sizeof(snapshotHeader), 0) ==
+          (ssize_t)sizeof(snapshotHeader);
+}
+
+static inline void snapshotWriterClose(snapshotWriter* writer){
+   if(writer->record && writer->fd >= 0){
+      // Records of an earlier, longer run past the last one written
+      if(ftruncate(writer->fd, writer->header.headerBytes +
+                   (off_t)writer->header.recordCount * writer->header.recordBytes) != 0){
+         printf("Cannot truncate the snapshot file: %s\n", strerror(errno));
+      }
+      close(writer->fd);
+   }
+   free(writer->record);
+   memset(writer, 0, sizeof(*writer));
+}
+
+#endif
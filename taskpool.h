@@ -0,0 +1,403 @@
+/* Persistent work-stealing thread pool shared by physics and rendering
+
+   The workers are started once and sleep between jobs, so a frame does
+   not pay for creating or waking a fresh OpenMP team for every loop. A job
+   is a parallel loop over count items. Every worker starts with a
+   contiguous slice of the items and takes grain items at a time from the
+   front of it. A worker whose slice runs dry steals the back half of
+   another worker's slice, preferring workers on its own NUMA node. Slow
+   items and uneven thread counts are balanced this way without a shared
+   queue.
+
+   On Linux every worker is pinned to its own CPU when there are enough
+   CPUs. The CPUs are ordered by NUMA node, so neighbouring slices, and the
+   pixel rows they first touch, stay on one node. The calling thread takes
+   part in every job as worker 0.
+
+   Needs -pthread. Pinning needs _GNU_SOURCE before the first system
+   include, without it the workers simply float. With it the kernel thread
+   id of every worker is known as well, for per-thread tools such as the
+   counters of perfcounters.h.
+*/
+
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(CPU_SET)
+#define TASKPOOL_AFFINITY
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Polls of an idle worker for the next job before it blocks on the
+// condition variable. Only used when every worker has a CPU of its own.
+#define TASKPOOL_SPIN 20000
+
+typedef void (*taskPoolBody)(void* context, int begin, int end, int worker);
+
+// Remaining items [begin, end) of a worker packed as begin | end << 32. The
+// owner moves begin, thieves move end, both with compare and swap.
+typedef struct{
+   uint64_t range;
+} __attribute__((aligned(64))) taskPoolSlice;
+
+typedef struct taskPool taskPool;
+
+typedef struct{
+   taskPool* pool;
+   int index;
+} taskPoolWorker;
+
+struct taskPool{
+   int threads;
+   int pinned;
+   int spin;
+   pthread_t* handles;
+   taskPoolWorker* workers;
+   taskPoolSlice* slices;
+   // CPU and NUMA node of every worker, -1 when not pinned
+   int* cpus;
+   int* nodes;
+   // Kernel thread id of every worker, 0 when unknown
+   int* tids;
+   // Steal order of every worker: threads - 1 victims, same node first
+   int* victims;
+
+   // Current job
+   taskPoolBody body;
+   void* context;
+   int grain;
+
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+   pthread_cond_t done;
+   unsigned int generation;
+   int busy;
+   int stop;
+};
+
+static inline uint64_t taskPoolPack(uint32_t begin, uint32_t end){
+   return (uint64_t)begin | (uint64_t)end << 32;
+}
+
+// Takes up to grain items from the front of the own slice
+static inline int taskPoolTake(taskPoolSlice* slice, int grain, int* begin, int* end){
+   uint64_t range = __atomic_load_n(&slice->range, __ATOMIC_ACQUIRE);
+   for(;;){
+      uint32_t first = (uint32_t)range;
+      uint32_t last = (uint32_t)(range >> 32);
+      if(first >= last){
+         return 0;
+      }
+      uint32_t next = last - first > (uint32_t)grain ? first + grain : last;
+      if(__atomic_compare_exchange_n(&slice->range, &range, taskPoolPack(next, last),
+                                     0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+         *begin = first;
+         *end = next;
+         return 1;
+      }
+   }
+}
+
+// Moves the back half of some other slice into the own slice
+static inline int taskPoolSteal(taskPool* pool, int worker){
+   const int* victims = pool->victims + (size_t)worker * (pool->threads - 1);
+   for(int v = 0; v < pool->threads - 1; ++v){
+      taskPoolSlice* slice = &pool->slices[victims[v]];
+      uint64_t range = __atomic_load_n(&slice->range, __ATOMIC_ACQUIRE);
+      for(;;){
+         uint32_t first = (uint32_t)range;
+         uint32_t last = (uint32_t)(range >> 32);
+         if(first >= last){
+            break;
+         }
+         // A slice within one grain is taken as a whole
+         uint32_t middle = last - first > (uint32_t)pool->grain ?
+                           first + (last - first) / 2 : first;
+         if(__atomic_compare_exchange_n(&slice->range, &range,
+                                        taskPoolPack(first, middle), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            __atomic_store_n(&pool->slices[worker].range,
+                             taskPoolPack(middle, last), __ATOMIC_RELEASE);
+            return 1;
+         }
+      }
+   }
+   return 0;
+}
+
+static inline void taskPoolWork(taskPool* pool, int worker){
+   int begin, end;
+   do{
+      while(taskPoolTake(&pool->slices[worker], pool->grain, &begin, &end)){
+         pool->body(pool->context, begin, end, worker);
+      }
+   } while(taskPoolSteal(pool, worker));
+}
+
+#ifdef TASKPOOL_AFFINITY
+static inline void taskPoolPin(int cpu){
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// NUMA node of a CPU from sysfs, 0 when unknown
+static inline int taskPoolNodeOf(int cpu){
+   char path[64];
+   snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+   DIR* directory = opendir(path);
+   if(!directory){
+      return 0;
+   }
+   int node = 0;
+   struct dirent* entry;
+   while((entry = readdir(directory)) != NULL){
+      if(strncmp(entry->d_name, "node", 4) == 0 &&
+         entry->d_name[4] >= '0' && entry->d_name[4] <= '9'){
+         node = atoi(entry->d_name + 4);
+         break;
+      }
+   }
+   closedir(directory);
+   return node;
+}
+#endif
+
+static inline void* taskPoolMain(void* argument){
+   taskPoolWorker* self = (taskPoolWorker*)argument;
+   taskPool* pool = self->pool;
+#ifdef TASKPOOL_AFFINITY
+   __atomic_store_n(&pool->tids[self->index], (int)syscall(SYS_gettid), __ATOMIC_RELEASE);
+   if(pool->pinned){
+      taskPoolPin(pool->cpus[self->index]);
+   }
+#endif
+   unsigned int seen = 0;
+   for(;;){
+      for(int i = 0; i < pool->spin &&
+          __atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE) == seen; ++i){
+#ifdef __SSE2__
+         __builtin_ia32_pause();
+#endif
+      }
+      pthread_mutex_lock(&pool->lock);
+      while(pool->generation == seen && !pool->stop){
+         pthread_cond_wait(&pool->wake, &pool->lock);
+      }
+      if(pool->stop){
+         pthread_mutex_unlock(&pool->lock);
+         return NULL;
+      }
+      seen = pool->generation;
+      pthread_mutex_unlock(&pool->lock);
+
+      taskPoolWork(pool, self->index);
+
+      if(__atomic_sub_fetch(&pool->busy, 1, __ATOMIC_ACQ_REL) == 0){
+         pthread_mutex_lock(&pool->lock);
+         pthread_cond_signal(&pool->done);
+         pthread_mutex_unlock(&pool->lock);
+      }
+   }
+}
+
+// Number of CPUs this process may run on
+static inline int taskPoolCpuCount(void){
+#ifdef TASKPOOL_AFFINITY
+   cpu_set_t set;
+   if(sched_getaffinity(0, sizeof(set), &set) == 0){
+      return CPU_COUNT(&set);
+   }
+#endif
+   return 1;
+}
+
+// Starts threads - 1 workers. pin asks for one CPU per worker, which is
+// only done when the process has at least threads CPUs. Returns 0 if the
+// pool cannot be set up.
+static inline int taskPoolInit(taskPool* pool, int threads, int pin){
+   memset(pool, 0, sizeof(*pool));
+   pool->threads = threads < 1 ? 1 : threads;
+   threads = pool->threads;
+   pool->handles = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+   pool->workers = (taskPoolWorker*)malloc(sizeof(taskPoolWorker) * threads);
+   pool->cpus = (int*)malloc(sizeof(int) * threads);
+   pool->nodes = (int*)malloc(sizeof(int) * threads);
+   pool->tids = (int*)calloc(threads, sizeof(int));
+   pool->victims = (int*)malloc(sizeof(int) * threads * (threads > 1 ? threads - 1 : 1));
+   if(posix_memalign((void**)&pool->slices, 64, sizeof(taskPoolSlice) * threads) != 0){
+      pool->slices = NULL;
+   }
+   if(!pool->handles || !pool->workers || !pool->cpus || !pool->nodes ||
+      !pool->tids || !pool->victims || !pool->slices){
+      return 0;
+   }
+   for(int w = 0; w < threads; ++w){
+      pool->cpus[w] = -1;
+      pool->nodes[w] = 0;
+      pool->slices[w].range = 0;
+   }
+
+#ifdef TASKPOOL_AFFINITY
+   // Allowed CPUs ordered by node, then by number
+   cpu_set_t allowed;
+   if(pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0 &&
+      CPU_COUNT(&allowed) >= threads){
+      int count = 0;
+      int* cpus = (int*)malloc(sizeof(int) * CPU_SETSIZE);
+      int* nodes = (int*)malloc(sizeof(int) * CPU_SETSIZE);
+      if(cpus && nodes){
+         for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu){
+            if(CPU_ISSET(cpu, &allowed)){
+               int node = taskPoolNodeOf(cpu);
+               int k = count++;
+               while(k > 0 && nodes[k - 1] > node){
+                  cpus[k] = cpus[k - 1];
+                  nodes[k] = nodes[k - 1];
+                  --k;
+               }
+               cpus[k] = cpu;
+               nodes[k] = node;
+            }
+         }
+         for(int w = 0; w < threads; ++w){
+            pool->cpus[w] = cpus[w];
+            pool->nodes[w] = nodes[w];
+         }
+         pool->pinned = 1;
+      }
+      free(cpus);
+      free(nodes);
+   }
+#else
+   (void)pin;
+#endif
+   pool->spin = pool->pinned ? TASKPOOL_SPIN : 0;
+
+   // Victims on the own node first, nearest slices first within a node
+   for(int w = 0; w < threads; ++w){
+      int* victims = pool->victims + (size_t)w * (threads - 1);
+      int count = 0;
+      for(int local = 1; local >= 0; --local){
+         for(int step = 1; step < threads; ++step){
+            int v = (w + step) % threads;
+            if((pool->nodes[v] == pool->nodes[w]) == local){
+               victims[count++] = v;
+            }
+         }
+      }
+   }
+
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->wake, NULL);
+   pthread_cond_init(&pool->done, NULL);
+   for(int w = 1; w < threads; ++w){
+      pool->workers[w].pool = pool;
+      pool->workers[w].index = w;
+      if(pthread_create(&pool->handles[w], NULL, taskPoolMain, &pool->workers[w]) != 0){
+         // Stops the workers started so far
+         pthread_mutex_lock(&pool->lock);
+         pool->stop = 1;
+         pthread_cond_broadcast(&pool->wake);
+         pthread_mutex_unlock(&pool->lock);
+         for(int started = 1; started < w; ++started){
+            pthread_join(pool->handles[started], NULL);
+         }
+         pool->threads = 1;
+         return 0;
+      }
+   }
+#ifdef TASKPOOL_AFFINITY
+   pool->tids[0] = (int)syscall(SYS_gettid);
+   // Every worker has its id once it runs
+   for(int w = 1; w < threads; ++w){
+      while(!__atomic_load_n(&pool->tids[w], __ATOMIC_ACQUIRE)){
+         sched_yield();
+      }
+   }
+   if(pool->pinned){
+      taskPoolPin(pool->cpus[0]);
+   }
+#endif
+   return 1;
+}
+
+// Calls body(context, begin, end, worker) for disjoint item ranges covering
+// 0 .. count - 1, at most grain items at a time, and returns when all are
+// done. worker is below pool->threads and unique among running calls.
+static inline void taskPoolFor(taskPool* pool, int count, int grain,
+                               taskPoolBody body, void* context){
+   if(count <= 0){
+      return;
+   }
+   grain = grain < 1 ? 1 : grain;
+   if(pool->threads == 1 || count <= grain){
+      body(context, 0, count, 0);
+      return;
+   }
+
+   pool->body = body;
+   pool->context = context;
+   pool->grain = grain;
+   for(int w = 0; w < pool->threads; ++w){
+      uint32_t begin = (uint32_t)((int64_t)count * w / pool->threads);
+      uint32_t end = (uint32_t)((int64_t)count * (w + 1) / pool->threads);
+      __atomic_store_n(&pool->slices[w].range, taskPoolPack(begin, end), __ATOMIC_RELAXED);
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   pool->busy = pool->threads - 1;
+   __atomic_add_fetch(&pool->generation, 1, __ATOMIC_RELEASE);
+   pthread_cond_broadcast(&pool->wake);
+   pthread_mutex_unlock(&pool->lock);
+
+   taskPoolWork(pool, 0);
+
+   for(int i = 0; i < pool->spin && __atomic_load_n(&pool->busy, __ATOMIC_ACQUIRE); ++i){
+#ifdef __SSE2__
+      __builtin_ia32_pause();
+#endif
+   }
+   pthread_mutex_lock(&pool->lock);
+   while(__atomic_load_n(&pool->busy, __ATOMIC_ACQUIRE)){
+      pthread_cond_wait(&pool->done, &pool->lock);
+   }
+   pthread_mutex_unlock(&pool->lock);
+}
+
+static inline void taskPoolDestroy(taskPool* pool){
+   if(pool->threads > 1){
+      pthread_mutex_lock(&pool->lock);
+      pool->stop = 1;
+      pthread_cond_broadcast(&pool->wake);
+      pthread_mutex_unlock(&pool->lock);
+      for(int w = 1; w < pool->threads; ++w){
+         pthread_join(pool->handles[w], NULL);
+      }
+   }
+   if(pool->handles){
+      pthread_mutex_destroy(&pool->lock);
+      pthread_cond_destroy(&pool->wake);
+      pthread_cond_destroy(&pool->done);
+   }
+   free(pool->handles);
+   free(pool->workers);
+   free(pool->cpus);
+   free(pool->nodes);
+   free(pool->tids);
+   free(pool->victims);
+   free(pool->slices);
+   memset(pool, 0, sizeof(*pool));
+}
+
+#endif
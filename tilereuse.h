@@ -0,0 +1,165 @@
+/* Tile tests of the --incremental rendering of parallel.c and
+   OpenCL_modified.c
+
+   A tile keeps the pixels of the frame it was last shaded in while
+
+   - no satellite comes within the hit radius of it and the nearest
+     satellite of every pixel stays the same, which tileKeepsNearest()
+     tests from one frame to the next, and
+   - the blended part of the color has moved by less than the threshold.
+     tileSampleBlend() samples the blend on a TILE_GRID x TILE_GRID grid
+     over the tile and tileBlendChange() estimates the change from the
+     samples of the frame the tile was shaded in.
+
+   The blend change is an estimate from samples, not a bound: single pixels
+   between the samples can drift a little further. --verify checks the kept
+   tiles against the threshold itself.
+
+   Satellites are read as strided float arrays, so the SoA state of
+   parallel.c and the satellite structs of OpenCL_modified.c both fit:
+   satellite i is at (x[i * stride], y[i * stride]).
+*/
+
+#ifndef TILEREUSE_H
+#define TILEREUSE_H
+
+#include <math.h>
+#include <stddef.h>
+
+#define TILE_GRID 3
+#define TILE_SAMPLES (TILE_GRID * TILE_GRID)
+
+typedef struct{
+   const float* x;
+   const float* y;
+   const float* red;
+   const float* green;
+   const float* blue;
+   int stride;
+   int count;
+} tileSatellites;
+
+// Pixels left .. right - 1 and bottom .. top - 1 of tile number tile,
+// counted row by row from the bottom left
+static inline void tileBounds(int tile, int columns, int size, int width, int height,
+                              int* left, int* bottom, int* right, int* top){
+   *left = tile % columns * size;
+   *bottom = tile / columns * size;
+   *right = *left + size < width ? *left + size : width;
+   *top = *bottom + size < height ? *bottom + size : height;
+}
+
+// Distance from (x, y) to the nearest and to the farthest pixel of the tile
+static inline float tileNearDistance(float x, float y, int left, int bottom, int right, int top){
+   float dx = x < left ? left - x : (x > right - 1 ? x - (right - 1) : 0.f);
+   float dy = y < bottom ? bottom - y : (y > top - 1 ? y - (top - 1) : 0.f);
+   return sqrtf(dx * dx + dy * dy);
+}
+
+static inline float tileFarDistance(float x, float y, int left, int bottom, int right, int top){
+   float dx = fmaxf(fabsf(x - left), fabsf(x - (right - 1)));
+   float dy = fmaxf(fabsf(y - bottom), fabsf(y - (top - 1)));
+   return sqrtf(dx * dx + dy * dy);
+}
+
+// Whether the tile keeps its hits and nearest satellite from the previous
+// frame to this one. Satellite j is at most f_j and at least n_j away from
+// every pixel of the tile in both frames. No pixel can be hit if every n_j
+// exceeds the radius, and satellite k is the nearest for every pixel in
+// both frames if f_k is below every other n_j.
+static inline int tileKeepsNearest(const tileSatellites* previous, const tileSatellites* now,
+                                   float radius, int left, int bottom, int right, int top){
+   int nearest = -1;
+   float nearestFar = INFINITY;
+   for(int j = 0; j < now->count; ++j){
+      size_t p = (size_t)j * previous->stride, n = (size_t)j * now->stride;
+      float far = fmaxf(
+         tileFarDistance(previous->x[p], previous->y[p], left, bottom, right, top),
+         tileFarDistance(now->x[n], now->y[n], left, bottom, right, top));
+      if(far < nearestFar){
+         nearestFar = far;
+         nearest = j;
+      }
+   }
+   for(int j = 0; j < now->count; ++j){
+      size_t p = (size_t)j * previous->stride, n = (size_t)j * now->stride;
+      float near = fminf(
+         tileNearDistance(previous->x[p], previous->y[p], left, bottom, right, top),
+         tileNearDistance(now->x[n], now->y[n], left, bottom, right, top));
+      if(near < radius + 1.0f || (j != nearest && !(nearestFar < near))){
+         return 0;
+      }
+   }
+   return nearest >= 0;
+}
+
+// The blended part of the color, 3 * sum(c w) / sum(w), on a grid of
+// TILE_GRID x TILE_GRID points spread evenly over the tile, row by row.
+// samples gets 3 * TILE_SAMPLES floats.
+static inline void tileSampleBlend(const tileSatellites* s, int left, int bottom, int right,
+                                   int top, float* samples){
+   for(int k = 0; k < TILE_SAMPLES; ++k){
+      float x = left + (right - 1 - left) * (float)(k % TILE_GRID) / (TILE_GRID - 1);
+      float y = bottom + (top - 1 - bottom) * (float)(k / TILE_GRID) / (TILE_GRID - 1);
+      float weights = 0.f, red = 0.f, green = 0.f, blue = 0.f;
+      for(int j = 0; j < s->count; ++j){
+         size_t i = (size_t)j * s->stride;
+         float dx = x - s->x[i];
+         float dy = y - s->y[i];
+         float distSquared = dx * dx + dy * dy;
+         float weight = 1.0f / (distSquared * distSquared);
+         weights += weight;
+         red += s->red[i] * weight;
+         green += s->green[i] * weight;
+         blue += s->blue[i] * weight;
+      }
+      samples[3 * k] = red / weights * 3.0f;
+      samples[3 * k + 1] = green / weights * 3.0f;
+      samples[3 * k + 2] = blue / weights * 3.0f;
+   }
+}
+
+// How far the blend of a tile has moved since shaded was sampled: the
+// largest change at a sample plus the largest step of the change between
+// neighbouring samples, which stands in for its slope between them. A NaN
+// sample gives INFINITY, so the tile is shaded again.
+static inline float tileBlendChange(const float* samples, const float* shaded){
+   float change = 0.f, step = 0.f;
+   for(int k = 0; k < TILE_SAMPLES; ++k){
+      for(int c = 0; c < 3; ++c){
+         float here = samples[3 * k + c] - shaded[3 * k + c];
+         change = fmaxf(change, fabsf(here));
+         if(k % TILE_GRID > 0){
+            int left = 3 * (k - 1) + c;
+            step = fmaxf(step, fabsf(here - (samples[left] - shaded[left])));
+         }
+         if(k >= TILE_GRID){
+            int below = 3 * (k - TILE_GRID) + c;
+            step = fmaxf(step, fabsf(here - (samples[below] - shaded[below])));
+         }
+      }
+   }
+   return change == change && step == step ? change + step : INFINITY;
+}
+
+// Tolerance of every pixel of a width x height image for --verify: kept
+// for the pixels of the tiles marked in keptTiles, shaded for the others.
+// Returns the number of kept tiles.
+static inline int tileFillTolerances(float* tolerances, const unsigned char* keptTiles,
+                                     int columns, int rows, int size, int width, int height,
+                                     float shaded, float kept){
+   int keptCount = 0;
+   for(int tile = 0; tile < columns * rows; ++tile){
+      int left, bottom, right, top;
+      tileBounds(tile, columns, size, width, height, &left, &bottom, &right, &top);
+      keptCount += keptTiles[tile] != 0;
+      for(int y = bottom; y < top; ++y){
+         for(int x = left; x < right; ++x){
+            tolerances[(size_t)y * width + x] = keptTiles[tile] ? kept : shaded;
+         }
+      }
+   }
+   return keptCount;
+}
+
+#endif
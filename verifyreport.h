@@ -0,0 +1,107 @@
+/* Error measures for the --verify mode of parallel.c and OpenCL_modified.c
+
+   --verify N runs the chosen engines for N frames next to
+   sequentialPhysicsEngine and sequentialGraphicsEngine. Every frame reports
+   how far the satellites are from the sequential result in units in the
+   last place, and the largest and mean absolute pixel error. Every pixel
+   over the tolerance is listed. Nothing waits for input, and the process
+   exits with 1 if anything failed.
+*/
+
+#ifndef VERIFYREPORT_H
+#define VERIFYREPORT_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pixelformat.h"
+
+// Distance of two floats in units in the last place. Zero for equal values
+// (also +0 and -0), huge for NaN against a number.
+static inline long long floatUlpDistance(float a, float b){
+   int32_t ia, ib;
+   memcpy(&ia, &a, sizeof(ia));
+   memcpy(&ib, &b, sizeof(ib));
+   // Map the sign-magnitude bits onto a line of ordered integers
+   long long la = ia < 0 ? (long long)INT32_MIN - ia : ia;
+   long long lb = ib < 0 ? (long long)INT32_MIN - ib : ib;
+   return la > lb ? la - lb : lb - la;
+}
+
+// Largest ULP distance over count records of fields floats each, stride
+// floats apart. *worst gets the record, if it is not NULL.
+static inline long long floatRecordsUlpDistance(const float* values, const float* reference,
+                                                int count, int stride, int fields, int* worst){
+   long long largest = 0;
+   for(int i = 0; i < count; ++i){
+      for(int k = 0; k < fields; ++k){
+         long long distance = floatUlpDistance(values[(size_t)i * stride + k],
+                                               reference[(size_t)i * stride + k]);
+         if(distance > largest){
+            largest = distance;
+            if(worst){
+               *worst = i;
+            }
+         }
+      }
+   }
+   return largest;
+}
+
+typedef struct{
+   double maxError;
+   double errorSum;
+   long long failing;
+} pixelErrors;
+
+// Compares count pixels of image, stored in format, with the float colors
+// of reference. A packed image is compared with the packed reference, see
+// pixelFormatCompare(). Prints every pixel with a channel more than its
+// tolerance off and returns their number. Pixel i may be off by
+// tolerances[i], or by tolerance if tolerances is NULL.
+static inline long long verifyPixelsWithin(unsigned int frame, int format,
+                                           const void* image, const float* reference,
+                                           size_t count, int width, float tolerance,
+                                           const float* tolerances, pixelErrors* errors){
+   memset(errors, 0, sizeof(*errors));
+   for(size_t i = 0; i < count; ++i){
+      unsigned char packed[3 * sizeof(float)];
+      float expected[3], actual[3];
+      pixelFormatStore(format, packed, 0, reference[3 * i], reference[3 * i + 1],
+                       reference[3 * i + 2]);
+      pixelFormatLoad(format, packed, 0, &expected[0], &expected[1], &expected[2]);
+      pixelFormatLoad(format, image, i, &actual[0], &actual[1], &actual[2]);
+      // A NaN channel makes the pixel NaN, which fails every comparison
+      double error = 0.0;
+      for(int c = 0; c < 3; ++c){
+         double difference = fabs((double)actual[c] - expected[c]);
+         if(difference > error || difference != difference){
+            error = difference;
+         }
+      }
+      if(error == error){
+         errors->errorSum += error;
+      }
+      if(!(error <= errors->maxError)){
+         errors->maxError = error;
+      }
+      if(!(error <= (tolerances ? tolerances[i] : tolerance))){
+         errors->failing++;
+         printf("frame %u pixel (x=%i, y=%i): %.5f %.5f %.5f, expected %.5f %.5f %.5f\n",
+                frame, (int)(i % width), (int)(i / width), actual[0], actual[1], actual[2],
+                expected[0], expected[1], expected[2]);
+      }
+   }
+   return errors->failing;
+}
+
+static inline long long verifyPixels(unsigned int frame, int format, const void* image,
+                                     const float* reference, size_t count, int width,
+                                     float tolerance, pixelErrors* errors){
+   return verifyPixelsWithin(frame, format, image, reference, count, width, tolerance,
+                             NULL, errors);
+}
+
+#endif